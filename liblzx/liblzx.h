@@ -30,9 +30,18 @@ typedef struct liblzx_internal liblzx_internal_t;
 typedef struct liblzx_compress_properties liblzx_compress_properties_t;
 typedef struct liblzx_compressor liblzx_compressor_t;
 typedef struct liblzx_output_chunk liblzx_output_chunk_t;
+typedef struct liblzx_batch liblzx_batch_t;
+typedef struct liblzx_batch_job liblzx_batch_job_t;
 
 typedef void *(*liblzx_alloc_func_t)(void *opaque, size_t size);
 typedef void (*liblzx_free_func_t)(void *opaque, void *ptr);
+typedef void *(*liblzx_aligned_alloc_func_t)(void *opaque, size_t size,
+                                             size_t alignment);
+
+typedef void (*liblzx_task_func_t)(void *arg);
+typedef void (*liblzx_submit_func_t)(void *opaque, liblzx_task_func_t task,
+                                     void *arg);
+typedef void (*liblzx_wait_func_t)(void *opaque);
 
 enum liblzx_variant {
         /* LZX variant used by CAB files and LZX DELTA */
@@ -47,7 +56,15 @@ typedef enum liblzx_variant liblzx_variant_t;
 enum liblzx_constant {
         LIBLZX_CONST_DEFAULT_CHUNK_SIZE = 32768,
         LIBLZX_CONST_DEFAULT_E8_FILE_SIZE = 12 * 1024 * 1024,
-        LIBLZX_CONST_MAX_WINDOW_SIZE = 64 * 1024 * 1024,
+
+        /* Largest window size, that of LZX DELTA.  Its 290 offset slots
+         * cover offsets of up to 2^25. */
+        LIBLZX_CONST_MAX_WINDOW_SIZE = 32 * 1024 * 1024,
+
+        /* Highest compression level used for windows larger than 2MB */
+        LIBLZX_CONST_MAX_LARGE_WINDOW_LEVEL = 34,
+
+        LIBLZX_CONST_ARENA_ALIGNMENT = 2 * 1024 * 1024,
 };
 
 struct liblzx_output_chunk {
@@ -61,20 +78,33 @@ struct liblzx_compress_properties {
 
         /* Source file size for LZX DELTA.  Ignored for WIM.
          * When using this, use liblzx_compress_add_input to add the source
-         * file's data before adding the new file's data.  For compression
-         * only, set this to 0.
+         * file's data before adding the new file's data.  The source data
+         * is only used as a dictionary and produces no output.  Must not
+         * exceed window_size.  For compression only, set this to 0.
          */
         size_t delta_source_size;
 
-        /* Compression window size. */
+        /* Compression window size.  CAB and WIM allow up to 2MB.  Larger
+         * windows, up to LIBLZX_CONST_MAX_WINDOW_SIZE, are only valid for
+         * LZX DELTA, and their compression level is capped to
+         * LIBLZX_CONST_MAX_LARGE_WINDOW_LEVEL.
+         */
         uint32_t window_size;
 
         /* Granularity of a chunk.  Should generally be set to
-         * LIBLZX_CONST_DEFAULT_CHUNK_SIZE.
+         * LIBLZX_CONST_DEFAULT_CHUNK_SIZE.  For WIM, each chunk is compressed
+         * independently, and a compressed chunk that isn't smaller than its
+         * input should be stored uncompressed instead.
          */
         uint32_t chunk_granularity;
 
-        /* Compression level.  Can be set arbitrarily high. */
+        /* Compression level.  Can be set arbitrarily high.  Levels up to 34
+         * use a faster lazy parser, and higher levels a near-optimal parser.
+         * The near-optimal parser is limited to 2MB windows, so the level of
+         * larger windows is capped to LIBLZX_CONST_MAX_LARGE_WINDOW_LEVEL.
+         * For WIM, levels of 150 and above find matches with a suffix array,
+         * which needs about 12 bytes of memory per byte of window.
+         */
         uint16_t compression_level;
 
         /* E8 file size parameter.  For WIM, this is ignored.  For other
@@ -83,14 +113,71 @@ struct liblzx_compress_properties {
          */
         uint32_t e8_file_size;
 
+        /* If nonzero, E8 translation is only used if the first chunk looks
+         * like x86 machine code, so that other data isn't translated for
+         * nothing.  The decision is made once per stream and can be read with
+         * liblzx_compress_get_e8_file_size.  Ignored for WIM.
+         */
+        uint8_t auto_e8;
+
         /* Memory allocation function. */
         liblzx_alloc_func_t alloc_func;
 
         /* Memory free function. */
         liblzx_free_func_t free_func;
 
+        /* Optional aligned memory allocation function.  If set, a compressor
+         * is allocated as a single block with this function instead of
+         * alloc_func, holding the compressor, its matchfinder and its
+         * buffers, which is freed with free_func.  The block must be aligned
+         * to the requested alignment, which is LIBLZX_CONST_ARENA_ALIGNMENT
+         * for blocks at least that large, so that the caller can back it
+         * with large pages (e.g. with madvise(MADV_HUGEPAGE) on Linux) and
+         * the matchfinder's tables need far fewer TLB entries.
+         */
+        liblzx_aligned_alloc_func_t aligned_alloc_func;
+
         /* Userdata parameter to pass to alloc function. */
         void *userdata;
+
+        /* Optional executor for work that can run in parallel.  submit_func
+         * must run task(arg) once, on any thread, and wait_func must wait
+         * until all tasks submitted so far have finished.  It is used by:
+         * - liblzx_compress_add_input_multi, with the executor of the first
+         *   stream, for the chunks of the streams;
+         * - liblzx_batch_compress, for its workers;
+         * - the suffix array of WIM chunks of 256KB and more, for all of its
+         *   construction but the suffix sort, which is sequential.
+         * A stream compresses its chunks one at a time, and each block
+         * depends on the ones before it.  WIM chunks are independent, though,
+         * so they can be compressed in parallel as the jobs of a batch, one
+         * per chunk, which gives the same output as a single stream.
+         * liblzx never creates threads of its own; if submit_func is NULL,
+         * all work is done on the calling thread.
+         */
+        liblzx_submit_func_t submit_func;
+        liblzx_wait_func_t wait_func;
+
+        /* Userdata parameter to pass to the executor functions. */
+        void *executor_userdata;
+};
+
+struct liblzx_batch_job {
+        /* Input data, which is compressed as a stream of its own */
+        const void *in_data;
+        size_t in_data_size;
+
+        /* Set by liblzx_batch_compress: the compressed chunks.  Each chunk
+         * holds chunk_granularity bytes of input, except the last one.  They
+         * stay valid until the batch is used again or destroyed.
+         */
+        const liblzx_output_chunk_t *out_chunks;
+        size_t num_out_chunks;
+
+        /* Set by liblzx_batch_compress: the E8 file size written in the
+         * stream header, as returned by liblzx_compress_get_e8_file_size.
+         */
+        uint32_t e8_file_size;
 };
 
 #ifdef __cplusplus
@@ -105,10 +192,41 @@ liblzx_compress_create(const liblzx_compress_properties_t *props);
 void
 liblzx_compress_destroy(liblzx_compressor_t *stream);
 
-/* Resets a compressor to its initial state. */
+/* Creates a copy of a compressor, including its window, matchfinder state,
+ * recent offsets, previous block's Huffman codes and E8 offset, along with any
+ * pending input or unreleased output chunk.  The copy uses the same memory
+ * allocation functions as the original and can be used to continue
+ * compression independently, e.g. to compress several streams that share a
+ * common prefix, or as a snapshot to restore with liblzx_compress_restore.
+ * Returns NULL if allocation fails.
+ */
+liblzx_compressor_t *
+liblzx_compress_clone(const liblzx_compressor_t *stream);
+
+/* Restores a compressor to the state of a snapshot made with
+ * liblzx_compress_clone.  The snapshot must have been cloned from a compressor
+ * created with the same properties, otherwise LIBLZX_ERR_INVALID_PARAM is
+ * returned and the compressor is left unchanged.  The snapshot is not modified
+ * and can be restored again.
+ */
+enum liblzx_error
+liblzx_compress_restore(liblzx_compressor_t *stream,
+                        const liblzx_compressor_t *snapshot);
+
+/* Resets a compressor to its initial state, to compress a new stream with the
+ * same properties.  This is much cheaper than creating a new compressor, since
+ * the buffers are kept and only the matchfinder's hash tables are cleared.
+ */
 void
 liblzx_compress_reset(liblzx_compressor_t *stream);
 
+/* Returns the E8 file size written in the stream header, or 0 if the stream
+ * doesn't use E8 translation.  With auto_e8, this is decided when the first
+ * chunk is compressed; until then, it returns the e8_file_size property.
+ */
+uint32_t
+liblzx_compress_get_e8_file_size(const liblzx_compressor_t *stream);
+
 /* Adds input data to the compression stream and returns the number of bytes
  * digested.  The return value will never exceed in_data_size.  If this
  * returns a value smaller than in_data_size, then a compressed block was
@@ -119,6 +237,19 @@ size_t
 liblzx_compress_add_input(liblzx_compressor_t *stream, const void *in_data,
                           size_t in_data_size);
 
+/* Adds input data to several compression streams, as if by calling
+ * liblzx_compress_add_input for each of them in turn, and stores the number of
+ * bytes digested by each stream in in_data_digested.  If the first stream has
+ * an executor, the streams that complete a chunk compress it as tasks on it,
+ * and this returns once they're all done.  The output of each stream is the
+ * same as with liblzx_compress_add_input.
+ */
+void
+liblzx_compress_add_input_multi(liblzx_compressor_t *const *streams,
+                                const void *const *in_data,
+                                const size_t *in_data_size,
+                                size_t *in_data_digested, size_t num_streams);
+
 /* Returns the next compressed chunk.  This doesn't consume the chunk in the
  * process, so repeated calls will keep returning the same chunk.  If no chunk
  * is available, returns NULL.
@@ -134,6 +265,42 @@ liblzx_compress_release_next_chunk(liblzx_compressor_t *stream);
 void
 liblzx_compress_end_input(liblzx_compressor_t *stream);
 
+/* Creates a batch compressor, for compressing many small independent streams
+ * with the same properties.  It has num_workers compressors, each of which is
+ * reset between streams instead of being recreated, and keeps the memory for
+ * the output between batches.  delta_source_size must be 0.  If props has an
+ * executor, each worker compresses its share of a batch in a task on it, and
+ * the workers' compressors don't use the executor themselves; otherwise the
+ * workers take turns on the calling thread.  Returns NULL if the properties
+ * are invalid or allocation fails.
+ */
+liblzx_batch_t *
+liblzx_batch_create(const liblzx_compress_properties_t *props,
+                    unsigned num_workers);
+
+/* Destroys a batch compressor and releases all resources, including the output
+ * of the last batch.
+ */
+void
+liblzx_batch_destroy(liblzx_batch_t *batch);
+
+/* Compresses each job's input as an independent stream and sets its output.
+ * Returns LIBLZX_ERR_NOMEM if memory for the output couldn't be allocated, in
+ * which case the output of all jobs is invalid.
+ */
+enum liblzx_error
+liblzx_batch_compress(liblzx_batch_t *batch, liblzx_batch_job_t *jobs,
+                      size_t num_jobs);
+
+/* Undoes the E8 translation on a chunk of decompressed data, for decoders of
+ * LZX streams.  chunk_offset is the uncompressed position of the chunk in the
+ * stream and e8_file_size is the E8 file size parameter.  Calls that start in
+ * the last 10 bytes of the chunk are not translated.
+ */
+void
+liblzx_e8_postprocess(void *data, size_t size, uint32_t chunk_offset,
+                      uint32_t e8_file_size);
+
 #ifdef __cplusplus
 }
 #endif
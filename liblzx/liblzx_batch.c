@@ -0,0 +1,343 @@
+/*
+ * liblzx_batch.c - Compression of many small independent streams
+ */
+
+/*
+ * Copyright (C) 2025 Eric Lasota
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * A batch is compressed by a fixed set of workers, each with a compressor of
+ * its own that is reset between jobs, so that the window, the matchfinder
+ * tables and the output buffer are allocated once rather than once per stream.
+ * Worker i takes jobs i, i + num_workers, i + 2 * num_workers, and so on, so
+ * the workers never need to synchronize with each other.
+ *
+ * The compressed chunks are copied into an arena owned by the worker.  The
+ * arena is a list of large blocks which are kept between batches and rewound
+ * at the start of each one, so that a steady stream of batches doesn't
+ * allocate at all.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include "liblzx.h"
+#include "liblzx_types.h"
+
+/* Minimum size of an arena block, including its header */
+#define LZX_BATCH_ARENA_BLOCK_SIZE (1024 * 1024)
+
+/* Round allocations up so that every allocation is aligned for a pointer */
+#define LZX_BATCH_ARENA_ALIGN(n) \
+        (((n) + sizeof(void *) - 1) & ~(size_t)(sizeof(void *) - 1))
+
+struct lzx_batch_arena_block {
+        struct lzx_batch_arena_block *next;
+        size_t capacity;
+        size_t used;
+};
+
+#define LZX_BATCH_ARENA_HEADER_SIZE \
+        LZX_BATCH_ARENA_ALIGN(sizeof(struct lzx_batch_arena_block))
+
+struct lzx_batch_worker {
+        struct liblzx_batch *batch;
+        liblzx_compressor_t *compressor;
+
+        /* The arena's blocks, and the block currently being allocated from */
+        struct lzx_batch_arena_block *arena_first;
+        struct lzx_batch_arena_block *arena_cur;
+
+        /* Jobs of the current batch; this worker takes every num_workers'th
+         * one, starting at index */
+        unsigned index;
+        liblzx_batch_job_t *jobs;
+        size_t num_jobs;
+
+        enum liblzx_error error;
+};
+
+struct liblzx_batch {
+        liblzx_alloc_func_t alloc_func;
+        liblzx_free_func_t free_func;
+        void *alloc_userdata;
+
+        liblzx_submit_func_t submit_func;
+        liblzx_wait_func_t wait_func;
+        void *executor_userdata;
+
+        uint32_t chunk_size;
+
+        unsigned num_workers;
+        struct lzx_batch_worker workers[];
+};
+
+/* Make all memory in a worker's arena available again. */
+static void
+lzx_batch_arena_rewind(struct lzx_batch_worker *w)
+{
+        struct lzx_batch_arena_block *block;
+
+        for (block = w->arena_first; block; block = block->next)
+                block->used = 0;
+
+        w->arena_cur = w->arena_first;
+}
+
+/* Allocate memory from a worker's arena, or return NULL if out of memory. */
+static void *
+lzx_batch_arena_alloc(struct lzx_batch_worker *w, size_t size)
+{
+        struct liblzx_batch *batch = w->batch;
+        struct lzx_batch_arena_block *block = w->arena_cur;
+        size_t capacity;
+        void *ptr;
+
+        size = LZX_BATCH_ARENA_ALIGN(size);
+
+        if (!block || block->capacity - block->used < size) {
+                /* Move on to the next block if it's big enough.  A block that
+                 * isn't is skipped for this batch but kept for the next. */
+                if (block && block->next &&
+                    block->next->capacity >= size) {
+                        block = block->next;
+                } else {
+                        capacity = LZX_BATCH_ARENA_BLOCK_SIZE -
+                                   LZX_BATCH_ARENA_HEADER_SIZE;
+                        if (capacity < size)
+                                capacity = size;
+
+                        ptr = batch->alloc_func(batch->alloc_userdata,
+                                                LZX_BATCH_ARENA_HEADER_SIZE +
+                                                        capacity);
+                        if (!ptr)
+                                return NULL;
+
+                        block = (struct lzx_batch_arena_block *)ptr;
+                        block->capacity = capacity;
+                        block->used = 0;
+                        if (w->arena_cur) {
+                                block->next = w->arena_cur->next;
+                                w->arena_cur->next = block;
+                        } else {
+                                block->next = w->arena_first;
+                                w->arena_first = block;
+                        }
+                }
+                w->arena_cur = block;
+        }
+
+        ptr = (uint8_t *)block + LZX_BATCH_ARENA_HEADER_SIZE + block->used;
+        block->used += size;
+        return ptr;
+}
+
+/* Copy the compressor's next chunk into the arena and release it. */
+static bool
+lzx_batch_take_chunk(struct lzx_batch_worker *w, liblzx_output_chunk_t *out)
+{
+        const liblzx_output_chunk_t *chunk =
+                liblzx_compress_get_next_chunk(w->compressor);
+        void *data;
+
+        data = lzx_batch_arena_alloc(w, chunk->size);
+        if (!data)
+                return false;
+
+        memcpy(data, chunk->data, chunk->size);
+        out->data = data;
+        out->size = chunk->size;
+
+        liblzx_compress_release_next_chunk(w->compressor);
+        return true;
+}
+
+/* Compress one job as a stream of its own. */
+static enum liblzx_error
+lzx_batch_compress_job(struct lzx_batch_worker *w, liblzx_batch_job_t *job)
+{
+        liblzx_compressor_t *c = w->compressor;
+        const uint8_t *in = (const uint8_t *)job->in_data;
+        size_t max_chunks = (job->in_data_size + w->batch->chunk_size - 1) /
+                            w->batch->chunk_size;
+        liblzx_output_chunk_t *chunks = NULL;
+        size_t num_chunks = 0;
+        size_t pos = 0;
+
+        if (max_chunks > 0) {
+                chunks = (liblzx_output_chunk_t *)lzx_batch_arena_alloc(
+                        w, max_chunks * sizeof(liblzx_output_chunk_t));
+                if (!chunks)
+                        return LIBLZX_ERR_NOMEM;
+        }
+
+        liblzx_compress_reset(c);
+
+        while (pos < job->in_data_size) {
+                pos += liblzx_compress_add_input(c, in + pos,
+                                                 job->in_data_size - pos);
+                if (liblzx_compress_get_next_chunk(c)) {
+                        if (!lzx_batch_take_chunk(w, &chunks[num_chunks++]))
+                                return LIBLZX_ERR_NOMEM;
+                }
+        }
+
+        liblzx_compress_end_input(c);
+
+        while (liblzx_compress_get_next_chunk(c)) {
+                if (!lzx_batch_take_chunk(w, &chunks[num_chunks++]))
+                        return LIBLZX_ERR_NOMEM;
+        }
+
+        job->out_chunks = chunks;
+        job->num_out_chunks = num_chunks;
+        job->e8_file_size = liblzx_compress_get_e8_file_size(c);
+        return LIBLZX_ERR_NONE;
+}
+
+/* Compress a worker's share of the batch. */
+static void
+lzx_batch_worker_task(void *arg)
+{
+        struct lzx_batch_worker *w = (struct lzx_batch_worker *)arg;
+        size_t i;
+
+        for (i = w->index; i < w->num_jobs; i += w->batch->num_workers) {
+                w->error = lzx_batch_compress_job(w, &w->jobs[i]);
+                if (w->error != LIBLZX_ERR_NONE)
+                        break;
+        }
+}
+
+liblzx_batch_t *
+liblzx_batch_create(const liblzx_compress_properties_t *props,
+                    unsigned num_workers)
+{
+        liblzx_compress_properties_t worker_props;
+        struct liblzx_batch *batch;
+        unsigned i;
+
+        if (num_workers == 0 || props->delta_source_size != 0 ||
+            props->chunk_granularity == 0)
+                return NULL;
+
+        batch = (struct liblzx_batch *)props->alloc_func(
+                props->userdata,
+                sizeof(struct liblzx_batch) +
+                        num_workers * sizeof(struct lzx_batch_worker));
+        if (!batch)
+                return NULL;
+
+        batch->alloc_func = props->alloc_func;
+        batch->free_func = props->free_func;
+        batch->alloc_userdata = props->userdata;
+        batch->submit_func = props->submit_func;
+        batch->wait_func = props->wait_func;
+        batch->executor_userdata = props->executor_userdata;
+        batch->chunk_size = props->chunk_granularity;
+        batch->num_workers = 0;
+
+        /* The workers already run as tasks on the executor, so their
+         * compressors must not submit tasks of their own. */
+        worker_props = *props;
+        worker_props.submit_func = NULL;
+        worker_props.wait_func = NULL;
+
+        for (i = 0; i < num_workers; i++) {
+                struct lzx_batch_worker *w = &batch->workers[i];
+
+                w->batch = batch;
+                w->compressor = liblzx_compress_create(&worker_props);
+                if (!w->compressor) {
+                        liblzx_batch_destroy(batch);
+                        return NULL;
+                }
+                w->arena_first = NULL;
+                w->arena_cur = NULL;
+                w->index = i;
+                w->jobs = NULL;
+                w->num_jobs = 0;
+                w->error = LIBLZX_ERR_NONE;
+
+                batch->num_workers++;
+        }
+
+        return batch;
+}
+
+void
+liblzx_batch_destroy(liblzx_batch_t *batch)
+{
+        unsigned i;
+
+        for (i = 0; i < batch->num_workers; i++) {
+                struct lzx_batch_worker *w = &batch->workers[i];
+                struct lzx_batch_arena_block *block = w->arena_first;
+
+                while (block) {
+                        struct lzx_batch_arena_block *next = block->next;
+
+                        batch->free_func(batch->alloc_userdata, block);
+                        block = next;
+                }
+
+                liblzx_compress_destroy(w->compressor);
+        }
+
+        batch->free_func(batch->alloc_userdata, batch);
+}
+
+enum liblzx_error
+liblzx_batch_compress(liblzx_batch_t *batch, liblzx_batch_job_t *jobs,
+                      size_t num_jobs)
+{
+        unsigned num_tasks = 0;
+        unsigned i;
+
+        for (i = 0; i < batch->num_workers; i++) {
+                struct lzx_batch_worker *w = &batch->workers[i];
+
+                lzx_batch_arena_rewind(w);
+                w->jobs = jobs;
+                w->num_jobs = num_jobs;
+                w->error = LIBLZX_ERR_NONE;
+
+                if (w->index >= num_jobs)
+                        continue;
+
+                if (batch->submit_func) {
+                        batch->submit_func(batch->executor_userdata,
+                                           lzx_batch_worker_task, w);
+                        num_tasks++;
+                } else {
+                        lzx_batch_worker_task(w);
+                }
+        }
+
+        if (num_tasks > 0)
+                batch->wait_func(batch->executor_userdata);
+
+        for (i = 0; i < batch->num_workers; i++) {
+                if (batch->workers[i].error != LIBLZX_ERR_NONE)
+                        return batch->workers[i].error;
+        }
+
+        return LIBLZX_ERR_NONE;
+}
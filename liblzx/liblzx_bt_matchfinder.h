@@ -116,7 +116,31 @@ struct TEMPLATED(bt_matchfinder) {
 static attrib_forceinline bool
 TEMPLATED(matchfinder_is_valid_pos)(mf_pos_t pos, mf_pos_t min_pos)
 {
-        return ((pos + 1) & MF_INVALID_POS) > min_pos;
+        return (((pos & MF_POS_MASK) + 1) & MF_POS_MASK) > min_pos;
+}
+
+/*
+ * Hash table entries may hold some extra hash bits in the MF_TAG_MASK bits that
+ * positions never use.  A hash computed with lz_hash_tagged(..., MF_TAG_MASK)
+ * selects its bucket with the remaining bits, and a candidate whose tag differs
+ * from the hash's is known not to match, without loading it from the window.
+ */
+static attrib_forceinline uint32_t
+TEMPLATED(matchfinder_bucket)(uint32_t hash)
+{
+        return hash & ~MF_TAG_MASK;
+}
+
+static attrib_forceinline mf_pos_t
+TEMPLATED(matchfinder_tagged_pos)(uint32_t pos, uint32_t hash)
+{
+        return pos | (hash & MF_TAG_MASK);
+}
+
+static attrib_forceinline bool
+TEMPLATED(matchfinder_tag_matches)(mf_pos_t entry, uint32_t hash)
+{
+        return ((entry ^ hash) & MF_TAG_MASK) == 0;
 }
 
 static attrib_forceinline void
@@ -125,10 +149,12 @@ TEMPLATED(matchfinder_rebase)(mf_pos_t * mf_base, size_t count,
 {
         /* The invalid value points to the last element of the buffer. */
         /* Since no match can start from that byte, it is always invalid. */
+        /* Subtracting from a tagged position leaves its tag unchanged. */
         while (count > 0) {
                 mf_pos_t pos = *mf_base;
 
-                if (pos < cull_amount || pos == MF_INVALID_POS) {
+                if ((pos & MF_POS_MASK) < cull_amount ||
+                    pos == MF_INVALID_POS) {
                         *mf_base = MF_INVALID_POS;
                 } else {
                         *mf_base -= cull_amount;
@@ -219,47 +245,59 @@ TEMPLATED(bt_matchfinder_advance_one_byte)(struct TEMPLATED(bt_matchfinder) * co
         hash3 = next_hashes[0];
         hash4 = next_hashes[1];
 
-        next_hashes[0] = lz_hash(next_hashseq & 0xFFFFFF, BT_MATCHFINDER_HASH3_ORDER);
+        /* The length 2 and 3 hashes are tagged; the length 4 hash only
+         * selects a binary tree, which is searched by comparing bytes.  */
+        next_hashes[0] = lz_hash_tagged(next_hashseq & 0xFFFFFF,
+                                        BT_MATCHFINDER_HASH3_ORDER,
+                                        MF_TAG_MASK);
         next_hashes[1] = lz_hash(next_hashseq, BT_MATCHFINDER_HASH4_ORDER);
-        prefetchw(&mf->hash3_tab[next_hashes[0]]);
+        prefetchw(&mf->hash3_tab[TEMPLATED(matchfinder_bucket)(next_hashes[0])]);
         prefetchw(&mf->hash4_tab[next_hashes[1]]);
 
 #ifdef BT_MATCHFINDER_HASH2_ORDER
         seq2 = load_u16_unaligned(in_next);
-        hash2 = lz_hash(seq2, BT_MATCHFINDER_HASH2_ORDER);
-        cur_node = mf->hash2_tab[hash2];
-        mf->hash2_tab[hash2] = cur_pos;
+        hash2 = lz_hash_tagged(seq2, BT_MATCHFINDER_HASH2_ORDER, MF_TAG_MASK);
+        cur_node = mf->hash2_tab[TEMPLATED(matchfinder_bucket)(hash2)];
+        mf->hash2_tab[TEMPLATED(matchfinder_bucket)(hash2)] =
+                TEMPLATED(matchfinder_tagged_pos)(cur_pos, hash2);
         if (record_matches &&
             TEMPLATED(matchfinder_is_valid_pos)(cur_node, in_min_pos) &&
-            seq2 == load_u16_unaligned(&in_begin[cur_node]))
+            TEMPLATED(matchfinder_tag_matches)(cur_node, hash2) &&
+            seq2 == load_u16_unaligned(&in_begin[cur_node & MF_POS_MASK]))
         {
                 lz_matchptr->length = 2;
-                lz_matchptr->offset = in_next - &in_begin[cur_node];
+                lz_matchptr->offset = in_next -
+                                      &in_begin[cur_node & MF_POS_MASK];
                 lz_matchptr++;
         }
 #endif
 
-        cur_node = mf->hash3_tab[hash3][0];
-        mf->hash3_tab[hash3][0] = cur_pos;
+        cur_node = mf->hash3_tab[TEMPLATED(matchfinder_bucket)(hash3)][0];
+        mf->hash3_tab[TEMPLATED(matchfinder_bucket)(hash3)][0] =
+                TEMPLATED(matchfinder_tagged_pos)(cur_pos, hash3);
 #if BT_MATCHFINDER_HASH3_WAYS >= 2
-        cur_node_2 = mf->hash3_tab[hash3][1];
-        mf->hash3_tab[hash3][1] = cur_node;
+        cur_node_2 = mf->hash3_tab[TEMPLATED(matchfinder_bucket)(hash3)][1];
+        mf->hash3_tab[TEMPLATED(matchfinder_bucket)(hash3)][1] = cur_node;
 #endif
         if (record_matches &&
             TEMPLATED(matchfinder_is_valid_pos)(cur_node, in_min_pos)) {
                 uint32_t seq3 = load_u24_unaligned(in_next);
-                if (seq3 == load_u24_unaligned(&in_begin[cur_node]) &&
-                        likely(cur_node >= in_min_pos)) {
+                if (TEMPLATED(matchfinder_tag_matches)(cur_node, hash3) &&
+                    seq3 == load_u24_unaligned(&in_begin[cur_node & MF_POS_MASK]) &&
+                        likely((cur_node & MF_POS_MASK) >= in_min_pos)) {
                         lz_matchptr->length = 3;
-                        lz_matchptr->offset = in_next - &in_begin[cur_node];
+                        lz_matchptr->offset = in_next -
+                                              &in_begin[cur_node & MF_POS_MASK];
                         lz_matchptr++;
                 }
         #if BT_MATCHFINDER_HASH3_WAYS >= 2
                 else if (TEMPLATED(matchfinder_is_valid_pos)(cur_node_2,
                                                              in_min_pos) &&
-                        seq3 == load_u24_unaligned(&in_begin[cur_node_2])) {
+                        TEMPLATED(matchfinder_tag_matches)(cur_node_2, hash3) &&
+                        seq3 == load_u24_unaligned(&in_begin[cur_node_2 & MF_POS_MASK])) {
                         lz_matchptr->length = 3;
-                        lz_matchptr->offset = in_next - &in_begin[cur_node_2];
+                        lz_matchptr->offset = in_next -
+                                              &in_begin[cur_node_2 & MF_POS_MASK];
                         lz_matchptr++;
                 }
         #endif
@@ -430,6 +468,46 @@ TEMPLATED(bt_matchfinder_skip_byte)(struct TEMPLATED(bt_matchfinder) *mf,
                                                    false);
 }
 
+/*
+ * Advance the matchfinder over a position covered by a long match, updating
+ * only the length 2 and 3 hash tables and the precomputed hash codes.  The
+ * position isn't added to the binary trees, so later searches can't find
+ * length 4+ matches starting there, but this doesn't touch the trees at all,
+ * where bt_matchfinder_skip_byte() re-roots one.  On highly redundant data,
+ * that re-rooting costs nearly as much as searching.
+ */
+static attrib_forceinline void
+TEMPLATED(bt_matchfinder_skip_byte_hashed)(struct TEMPLATED(bt_matchfinder) *mf,
+                                           const uint8_t *in_begin,
+                                           ptrdiff_t cur_pos,
+                                           uint32_t next_hashes[2])
+{
+        const uint8_t *in_next = in_begin + cur_pos;
+        uint32_t next_hashseq = get_unaligned_le32(in_next + 1);
+        uint32_t hash3 = next_hashes[0];
+        uint32_t bucket3 = TEMPLATED(matchfinder_bucket)(hash3);
+#ifdef BT_MATCHFINDER_HASH2_ORDER
+        uint32_t hash2 = lz_hash_tagged(load_u16_unaligned(in_next),
+                                        BT_MATCHFINDER_HASH2_ORDER,
+                                        MF_TAG_MASK);
+
+        mf->hash2_tab[TEMPLATED(matchfinder_bucket)(hash2)] =
+                TEMPLATED(matchfinder_tagged_pos)(cur_pos, hash2);
+#endif
+#if BT_MATCHFINDER_HASH3_WAYS >= 2
+        mf->hash3_tab[bucket3][1] = mf->hash3_tab[bucket3][0];
+#endif
+        mf->hash3_tab[bucket3][0] =
+                TEMPLATED(matchfinder_tagged_pos)(cur_pos, hash3);
+
+        next_hashes[0] = lz_hash_tagged(next_hashseq & 0xFFFFFF,
+                                        BT_MATCHFINDER_HASH3_ORDER,
+                                        MF_TAG_MASK);
+        next_hashes[1] = lz_hash(next_hashseq, BT_MATCHFINDER_HASH4_ORDER);
+        prefetchw(&mf->hash3_tab[TEMPLATED(matchfinder_bucket)(next_hashes[0])]);
+        prefetchw(&mf->hash4_tab[next_hashes[1]]);
+}
+
 /*
  * Culls any matches that are lower than a specified offset and reduces any
  * remaining offsets by the same amount.
@@ -102,7 +102,7 @@ heap_sort(uint32_t A[], unsigned length)
         }
 }
 
-#define NUM_SYMBOL_BITS 10
+#define NUM_SYMBOL_BITS 12
 #define NUM_FREQ_BITS        (32 - NUM_SYMBOL_BITS)
 #define SYMBOL_MASK        ((1 << NUM_SYMBOL_BITS) - 1)
 #define FREQ_MASK        (~SYMBOL_MASK)
@@ -9,7 +9,7 @@
 
 #include "liblzx_types.h"
 
-#define MAX_NUM_SYMS            799        /* LZMS_MAX_NUM_SYMS */
+#define MAX_NUM_SYMS            2576       /* LZX_DELTA_MAINCODE_MAX_NUM_SYMBOLS */
 #define MAX_CODEWORD_LEN        16
 
 void
@@ -156,12 +156,29 @@ TEMPLATED(hc_matchfinder_size)(size_t max_bufsize, bool streaming)
                (max_bufsize * streaming_mul * sizeof(mf_pos_t));
 }
 
-/* Prepare the matchfinder for a new input buffer.  */
+/* Compute the hash codes of the sequence at @in_next, which the next call to
+ * hc_matchfinder_longest_match() or hc_matchfinder_skip_bytes() expects in
+ * @next_hashes.  At least 4 bytes must be available at @in_next.  */
 static attrib_forceinline void
-TEMPLATED(hc_matchfinder_init)(struct TEMPLATED(hc_matchfinder) * mf,
-                               size_t max_bufsize, bool streaming)
+TEMPLATED(hc_matchfinder_init_hashes)(const uint8_t *in_next,
+                                      uint32_t next_hashes[2])
 {
-        memset(mf, 0xFF, TEMPLATED(hc_matchfinder_size)(max_bufsize, streaming));
+        uint32_t seq = get_unaligned_le32(in_next);
+
+        next_hashes[0] = lz_hash_tagged(seq & 0xFFFFFF,
+                                        HC_MATCHFINDER_HASH3_ORDER,
+                                        MF_TAG_MASK);
+        next_hashes[1] = lz_hash_tagged(seq, HC_MATCHFINDER_HASH4_ORDER,
+                                        MF_TAG_MASK);
+}
+
+/* Prepare the matchfinder for a new input buffer.  Only the hash tables need to
+ * be cleared: a 'next_tab' entry is always written when its position is
+ * inserted, before any linked list can reach it.  */
+static attrib_forceinline void
+TEMPLATED(hc_matchfinder_init)(struct TEMPLATED(hc_matchfinder) * mf)
+{
+        memset(mf, 0xFF, sizeof(*mf));
 }
 
 /* The minimum permissible value of 'max_len' for bt_matchfinder_get_matches()
@@ -215,7 +232,6 @@ TEMPLATED(hc_matchfinder_longest_match)(struct TEMPLATED(hc_matchfinder) * const
         const uint8_t *best_matchptr = in_next;
         mf_pos_t cur_node3, cur_node4;
         uint32_t hash3, hash4;
-        uint32_t next_hashseq;
         uint32_t seq4;
         const uint8_t *matchptr;
         uint32_t len;
@@ -230,24 +246,26 @@ TEMPLATED(hc_matchfinder_longest_match)(struct TEMPLATED(hc_matchfinder) * const
         hash4 = next_hashes[1];
 
         /* From the hash buckets, get the first node of each linked list.  */
-        cur_node3 = mf->hash3_tab[hash3];
-        cur_node4 = mf->hash4_tab[hash4];
+        cur_node3 = mf->hash3_tab[TEMPLATED(matchfinder_bucket)(hash3)];
+        cur_node4 = mf->hash4_tab[TEMPLATED(matchfinder_bucket)(hash4)];
 
         /* Update for length 3 matches.  This replaces the singleton node in the
          * 'hash3' bucket with the node for the current sequence.  */
-        mf->hash3_tab[hash3] = cur_pos;
+        mf->hash3_tab[TEMPLATED(matchfinder_bucket)(hash3)] =
+                TEMPLATED(matchfinder_tagged_pos)(cur_pos, hash3);
 
         /* Update for length 4 matches.  This prepends the node for the current
-         * sequence to the linked list in the 'hash4' bucket.  */
-        mf->hash4_tab[hash4] = cur_pos;
+         * sequence to the linked list in the 'hash4' bucket.  Nodes keep their
+         * tags in the linked list, so most of the sequences in it that don't
+         * match are skipped without being loaded.  */
+        mf->hash4_tab[TEMPLATED(matchfinder_bucket)(hash4)] =
+                TEMPLATED(matchfinder_tagged_pos)(cur_pos, hash4);
         mf->next_tab[cur_pos] = cur_node4;
 
         /* Compute the next hash codes.  */
-        next_hashseq = get_unaligned_le32(in_next + 1);
-        next_hashes[0] = lz_hash(next_hashseq & 0xFFFFFF, HC_MATCHFINDER_HASH3_ORDER);
-        next_hashes[1] = lz_hash(next_hashseq, HC_MATCHFINDER_HASH4_ORDER);
-        prefetchw(&mf->hash3_tab[next_hashes[0]]);
-        prefetchw(&mf->hash4_tab[next_hashes[1]]);
+        TEMPLATED(hc_matchfinder_init_hashes)(in_next + 1, next_hashes);
+        prefetchw(&mf->hash3_tab[TEMPLATED(matchfinder_bucket)(next_hashes[0])]);
+        prefetchw(&mf->hash4_tab[TEMPLATED(matchfinder_bucket)(next_hashes[1])]);
 
         if (best_len < 4) {  /* No match of length >= 4 found yet?  */
 
@@ -258,8 +276,9 @@ TEMPLATED(hc_matchfinder_longest_match)(struct TEMPLATED(hc_matchfinder) * const
 
                 seq4 = load_u32_unaligned(in_next);
 
-                if (best_len < 3) {
-                        matchptr = &in_begin[cur_node3];
+                if (best_len < 3 &&
+                    TEMPLATED(matchfinder_tag_matches)(cur_node3, hash3)) {
+                        matchptr = &in_begin[cur_node3 & MF_POS_MASK];
                         if (load_u24_unaligned(matchptr) == loaded_u32_to_u24(seq4)) {
                                 best_len = 3;
                                 best_matchptr = matchptr;
@@ -273,13 +292,14 @@ TEMPLATED(hc_matchfinder_longest_match)(struct TEMPLATED(hc_matchfinder) * const
 
                 for (;;) {
                         /* No length 4 match found yet.  Check the first 4 bytes.  */
-                        matchptr = &in_begin[cur_node4];
+                        matchptr = &in_begin[cur_node4 & MF_POS_MASK];
 
-                        if (load_u32_unaligned(matchptr) == seq4)
+                        if (TEMPLATED(matchfinder_tag_matches)(cur_node4, hash4) &&
+                            load_u32_unaligned(matchptr) == seq4)
                                 break;
 
                         /* The first 4 bytes did not match.  Keep trying.  */
-                        cur_node4 = mf->next_tab[cur_node4];
+                        cur_node4 = mf->next_tab[cur_node4 & MF_POS_MASK];
                         if (!TEMPLATED(matchfinder_is_valid_pos)(cur_node4,
                                                                  in_min_pos) ||
                             !--depth_remaining)
@@ -291,7 +311,7 @@ TEMPLATED(hc_matchfinder_longest_match)(struct TEMPLATED(hc_matchfinder) * const
                 best_len = lz_extend(in_next, best_matchptr, 4, max_find_len);
                 if (best_len >= nice_len)
                         goto out;
-                cur_node4 = mf->next_tab[cur_node4];
+                cur_node4 = mf->next_tab[cur_node4 & MF_POS_MASK];
                 if (!TEMPLATED(matchfinder_is_valid_pos)(cur_node4,
                                                          in_min_pos) ||
                     !--depth_remaining)
@@ -307,25 +327,26 @@ TEMPLATED(hc_matchfinder_longest_match)(struct TEMPLATED(hc_matchfinder) * const
 
         for (;;) {
                 for (;;) {
-                        matchptr = &in_begin[cur_node4];
+                        matchptr = &in_begin[cur_node4 & MF_POS_MASK];
 
                         /* Already found a length 4 match.  Try for a longer
                          * match; start by checking either the last 4 bytes and
                          * the first 4 bytes, or the last byte.  (The last byte,
                          * the one which would extend the match length by 1, is
                          * the most important.)  */
+                        if (TEMPLATED(matchfinder_tag_matches)(cur_node4, hash4) &&
                 #if UNALIGNED_ACCESS_IS_FAST
-                        if ((load_u32_unaligned(matchptr + best_len - 3) ==
+                            (load_u32_unaligned(matchptr + best_len - 3) ==
                              load_u32_unaligned(in_next + best_len - 3)) &&
                             (load_u32_unaligned(matchptr) ==
                              load_u32_unaligned(in_next)))
                 #else
-                        if (matchptr[best_len] == in_next[best_len])
+                            matchptr[best_len] == in_next[best_len])
                 #endif
                                 break;
 
                         /* Continue to the next node in the list.  */
-                        cur_node4 = mf->next_tab[cur_node4];
+                        cur_node4 = mf->next_tab[cur_node4 & MF_POS_MASK];
                         if (!TEMPLATED(matchfinder_is_valid_pos)(cur_node4,
                                                                  in_min_pos) ||
                                 !--depth_remaining)
@@ -347,7 +368,7 @@ TEMPLATED(hc_matchfinder_longest_match)(struct TEMPLATED(hc_matchfinder) * const
                 }
 
                 /* Continue to the next node in the list.  */
-                cur_node4 = mf->next_tab[cur_node4];
+                cur_node4 = mf->next_tab[cur_node4 & MF_POS_MASK];
                 if (!TEMPLATED(matchfinder_is_valid_pos)(cur_node4,
                                                          in_min_pos) ||
                     !--depth_remaining)
@@ -356,8 +377,6 @@ TEMPLATED(hc_matchfinder_longest_match)(struct TEMPLATED(hc_matchfinder) * const
 out:
         *offset_ret = in_next - best_matchptr;
         best_len = min_u32(best_len, max_produce_len);
-        if (best_len < 2)
-                best_len = 2;
 
         return best_len;
 }
@@ -390,7 +409,6 @@ TEMPLATED(hc_matchfinder_skip_bytes)(struct TEMPLATED(hc_matchfinder) * const mf
 {
         uint32_t cur_pos;
         uint32_t hash3, hash4;
-        uint32_t next_hashseq;
         uint32_t remaining = count;
 
         if (unlikely(count + HC_MATCHFINDER_REQUIRED_NBYTES > in_end - in_next))
@@ -400,20 +418,21 @@ TEMPLATED(hc_matchfinder_skip_bytes)(struct TEMPLATED(hc_matchfinder) * const mf
         hash3 = next_hashes[0];
         hash4 = next_hashes[1];
         do {
-                mf->hash3_tab[hash3] = cur_pos;
-                mf->next_tab[cur_pos] = mf->hash4_tab[hash4];
-                mf->hash4_tab[hash4] = cur_pos;
-
-                next_hashseq = get_unaligned_le32(++in_next);
-                hash3 = lz_hash(next_hashseq & 0xFFFFFF, HC_MATCHFINDER_HASH3_ORDER);
-                hash4 = lz_hash(next_hashseq, HC_MATCHFINDER_HASH4_ORDER);
+                mf->hash3_tab[TEMPLATED(matchfinder_bucket)(hash3)] =
+                        TEMPLATED(matchfinder_tagged_pos)(cur_pos, hash3);
+                mf->next_tab[cur_pos] =
+                        mf->hash4_tab[TEMPLATED(matchfinder_bucket)(hash4)];
+                mf->hash4_tab[TEMPLATED(matchfinder_bucket)(hash4)] =
+                        TEMPLATED(matchfinder_tagged_pos)(cur_pos, hash4);
+
+                TEMPLATED(hc_matchfinder_init_hashes)(++in_next, next_hashes);
+                hash3 = next_hashes[0];
+                hash4 = next_hashes[1];
                 cur_pos++;
         } while (--remaining);
 
-        prefetchw(&mf->hash3_tab[hash3]);
-        prefetchw(&mf->hash4_tab[hash4]);
-        next_hashes[0] = hash3;
-        next_hashes[1] = hash4;
+        prefetchw(&mf->hash3_tab[TEMPLATED(matchfinder_bucket)(hash3)]);
+        prefetchw(&mf->hash4_tab[TEMPLATED(matchfinder_bucket)(hash4)]);
 }
 
 /*
@@ -41,45 +41,114 @@
 #include "liblzx_lzx_common.h"
 #include "liblzx_unaligned.h"
 #include "liblzx_util.h"
+#include "liblzx.h"
 
 /* Mapping: offset slot => first match offset that uses that offset slot.
- * The offset slots for repeat offsets map to "fake" offsets < 1.  */
-const int32_t lzx_offset_slot_base[LZX_MAX_OFFSET_SLOTS + 1] = {
-        -2     , -1     , 0      , 1      , 2      ,    /* 0  --- 4  */
-        4      , 6      , 10     , 14     , 22     ,    /* 5  --- 9  */
-        30     , 46     , 62     , 94     , 126    ,    /* 10 --- 14 */
-        190    , 254    , 382    , 510    , 766    ,    /* 15 --- 19 */
-        1022   , 1534   , 2046   , 3070   , 4094   ,    /* 20 --- 24 */
-        6142   , 8190   , 12286  , 16382  , 24574  ,    /* 25 --- 29 */
-        32766  , 49150  , 65534  , 98302  , 131070 ,    /* 30 --- 34 */
-        196606 , 262142 , 393214 , 524286 , 655358 ,    /* 35 --- 39 */
-        786430 , 917502 , 1048574, 1179646, 1310718,    /* 40 --- 44 */
-        1441790, 1572862, 1703934, 1835006, 1966078,    /* 45 --- 49 */
-        2097150                                         /* extra     */
+ * The offset slots for repeat offsets map to "fake" offsets < 1.  Slots 50 and
+ * above only exist in LZX DELTA.  */
+const int32_t lzx_offset_slot_base[LZX_DELTA_MAX_OFFSET_SLOTS + 1] = {
+        -2      , -1      , 0       , 1       , 2       ,    /* 0   --- 4   */
+        4       , 6       , 10      , 14      , 22      ,    /* 5   --- 9   */
+        30      , 46      , 62      , 94      , 126     ,    /* 10  --- 14  */
+        190     , 254     , 382     , 510     , 766     ,    /* 15  --- 19  */
+        1022    , 1534    , 2046    , 3070    , 4094    ,    /* 20  --- 24  */
+        6142    , 8190    , 12286   , 16382   , 24574   ,    /* 25  --- 29  */
+        32766   , 49150   , 65534   , 98302   , 131070  ,    /* 30  --- 34  */
+        196606  , 262142  , 393214  , 524286  , 655358  ,    /* 35  --- 39  */
+        786430  , 917502  , 1048574 , 1179646 , 1310718 ,    /* 40  --- 44  */
+        1441790 , 1572862 , 1703934 , 1835006 , 1966078 ,    /* 45  --- 49  */
+        2097150 , 2228222 , 2359294 , 2490366 , 2621438 ,    /* 50  --- 54  */
+        2752510 , 2883582 , 3014654 , 3145726 , 3276798 ,    /* 55  --- 59  */
+        3407870 , 3538942 , 3670014 , 3801086 , 3932158 ,    /* 60  --- 64  */
+        4063230 , 4194302 , 4325374 , 4456446 , 4587518 ,    /* 65  --- 69  */
+        4718590 , 4849662 , 4980734 , 5111806 , 5242878 ,    /* 70  --- 74  */
+        5373950 , 5505022 , 5636094 , 5767166 , 5898238 ,    /* 75  --- 79  */
+        6029310 , 6160382 , 6291454 , 6422526 , 6553598 ,    /* 80  --- 84  */
+        6684670 , 6815742 , 6946814 , 7077886 , 7208958 ,    /* 85  --- 89  */
+        7340030 , 7471102 , 7602174 , 7733246 , 7864318 ,    /* 90  --- 94  */
+        7995390 , 8126462 , 8257534 , 8388606 , 8519678 ,    /* 95  --- 99  */
+        8650750 , 8781822 , 8912894 , 9043966 , 9175038 ,    /* 100 --- 104 */
+        9306110 , 9437182 , 9568254 , 9699326 , 9830398 ,    /* 105 --- 109 */
+        9961470 , 10092542, 10223614, 10354686, 10485758,    /* 110 --- 114 */
+        10616830, 10747902, 10878974, 11010046, 11141118,    /* 115 --- 119 */
+        11272190, 11403262, 11534334, 11665406, 11796478,    /* 120 --- 124 */
+        11927550, 12058622, 12189694, 12320766, 12451838,    /* 125 --- 129 */
+        12582910, 12713982, 12845054, 12976126, 13107198,    /* 130 --- 134 */
+        13238270, 13369342, 13500414, 13631486, 13762558,    /* 135 --- 139 */
+        13893630, 14024702, 14155774, 14286846, 14417918,    /* 140 --- 144 */
+        14548990, 14680062, 14811134, 14942206, 15073278,    /* 145 --- 149 */
+        15204350, 15335422, 15466494, 15597566, 15728638,    /* 150 --- 154 */
+        15859710, 15990782, 16121854, 16252926, 16383998,    /* 155 --- 159 */
+        16515070, 16646142, 16777214, 16908286, 17039358,    /* 160 --- 164 */
+        17170430, 17301502, 17432574, 17563646, 17694718,    /* 165 --- 169 */
+        17825790, 17956862, 18087934, 18219006, 18350078,    /* 170 --- 174 */
+        18481150, 18612222, 18743294, 18874366, 19005438,    /* 175 --- 179 */
+        19136510, 19267582, 19398654, 19529726, 19660798,    /* 180 --- 184 */
+        19791870, 19922942, 20054014, 20185086, 20316158,    /* 185 --- 189 */
+        20447230, 20578302, 20709374, 20840446, 20971518,    /* 190 --- 194 */
+        21102590, 21233662, 21364734, 21495806, 21626878,    /* 195 --- 199 */
+        21757950, 21889022, 22020094, 22151166, 22282238,    /* 200 --- 204 */
+        22413310, 22544382, 22675454, 22806526, 22937598,    /* 205 --- 209 */
+        23068670, 23199742, 23330814, 23461886, 23592958,    /* 210 --- 214 */
+        23724030, 23855102, 23986174, 24117246, 24248318,    /* 215 --- 219 */
+        24379390, 24510462, 24641534, 24772606, 24903678,    /* 220 --- 224 */
+        25034750, 25165822, 25296894, 25427966, 25559038,    /* 225 --- 229 */
+        25690110, 25821182, 25952254, 26083326, 26214398,    /* 230 --- 234 */
+        26345470, 26476542, 26607614, 26738686, 26869758,    /* 235 --- 239 */
+        27000830, 27131902, 27262974, 27394046, 27525118,    /* 240 --- 244 */
+        27656190, 27787262, 27918334, 28049406, 28180478,    /* 245 --- 249 */
+        28311550, 28442622, 28573694, 28704766, 28835838,    /* 250 --- 254 */
+        28966910, 29097982, 29229054, 29360126, 29491198,    /* 255 --- 259 */
+        29622270, 29753342, 29884414, 30015486, 30146558,    /* 260 --- 264 */
+        30277630, 30408702, 30539774, 30670846, 30801918,    /* 265 --- 269 */
+        30932990, 31064062, 31195134, 31326206, 31457278,    /* 270 --- 274 */
+        31588350, 31719422, 31850494, 31981566, 32112638,    /* 275 --- 279 */
+        32243710, 32374782, 32505854, 32636926, 32767998,    /* 280 --- 284 */
+        32899070, 33030142, 33161214, 33292286, 33423358,    /* 285 --- 289 */
+        33554430    /* extra     */
 };
 
 /* Mapping: offset slot => how many extra bits must be read and added to the
  * corresponding offset slot base to decode the match offset.  */
-const uint8_t lzx_extra_offset_bits[LZX_MAX_OFFSET_SLOTS] = {
-        0 , 0 , 0 , 0 , 1 ,
-        1 , 2 , 2 , 3 , 3 ,
-        4 , 4 , 5 , 5 , 6 ,
-        6 , 7 , 7 , 8 , 8 ,
-        9 , 9 , 10, 10, 11,
-        11, 12, 12, 13, 13,
-        14, 14, 15, 15, 16,
-        16, 17, 17, 17, 17,
-        17, 17, 17, 17, 17,
-        17, 17, 17, 17, 17,
+const uint8_t lzx_extra_offset_bits[LZX_DELTA_MAX_OFFSET_SLOTS] = {
+        0 , 0 , 0 , 0 , 1 , 1 , 2 , 2 , 3 , 3 ,
+        4 , 4 , 5 , 5 , 6 , 6 , 7 , 7 , 8 , 8 ,
+        9 , 9 , 10, 10, 11, 11, 12, 12, 13, 13,
+        14, 14, 15, 15, 16, 16, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
 };
 
 /* Round the specified buffer size up to the next valid LZX window size, and
  * return its order (log2).  Or, if the buffer size is 0 or greater than the
- * largest valid LZX window size, return 0.  */
+ * largest window size allowed by @max_window_order, return 0.  */
 unsigned
-lzx_get_window_order(size_t max_bufsize)
+lzx_get_window_order(size_t max_bufsize, unsigned max_window_order)
 {
-        if (max_bufsize == 0 || max_bufsize > LZX_MAX_WINDOW_SIZE)
+        if (max_bufsize == 0 || max_bufsize > ((size_t)1 << max_window_order))
                 return 0;
 
         return max_uint(ilog2_ceil(max_bufsize), LZX_MIN_WINDOW_ORDER);
@@ -168,8 +237,12 @@ undo_translate_target(void *target, int32_t input_pos, int32_t e8_file_size)
  * E8 processing is supposed to take the file size as a parameter, as it is used
  * in calculating the translated jump targets.  But in WIM files, this file size
  * is always the same (LZX_WIM_MAGIC_FILESIZE == 12000000).
+ *
+ * Returns the offset of the first byte that may start a call instruction, past
+ * the last position that was examined.  It is at most 4 bytes past the end of
+ * the examined area, if a call target was translated at its end.
  */
-static void
+static uint32_t
 lzx_e8_filter(uint8_t *data, uint32_t size, uint32_t chunk_offset, uint32_t e8_file_size,
               void (*process_target)(void *, int32_t, int32_t))
 {
@@ -179,7 +252,7 @@ lzx_e8_filter(uint8_t *data, uint32_t size, uint32_t chunk_offset, uint32_t e8_f
         uint8_t *p;
 
         if (size <= LZX_E8_FILTER_TAIL_SIZE)
-                return;
+                return 0;
 
         tail = &data[size - LZX_E8_FILTER_TAIL_SIZE];
         p = data;
@@ -193,6 +266,7 @@ lzx_e8_filter(uint8_t *data, uint32_t size, uint32_t chunk_offset, uint32_t e8_f
                                   e8_file_size);
                 p += 5;
         }
+        return (uint32_t)(p - data);
 #else
         /* SSE2 or AVX-2 optimized version for x86_64  */
 
@@ -200,7 +274,7 @@ lzx_e8_filter(uint8_t *data, uint32_t size, uint32_t chunk_offset, uint32_t e8_f
         uint64_t valid_mask = ~0;
 
         if (size <= LZX_E8_FILTER_TAIL_SIZE)
-                return;
+                return 0;
 #ifdef __AVX2__
 #  define ALIGNMENT_REQUIRED 32
 #else
@@ -210,7 +284,7 @@ lzx_e8_filter(uint8_t *data, uint32_t size, uint32_t chunk_offset, uint32_t e8_f
         /* Process one byte at a time until the pointer is properly aligned.  */
         while ((uintptr_t)p % ALIGNMENT_REQUIRED != 0) {
                 if (p >= data + size - LZX_E8_FILTER_TAIL_SIZE)
-                        return;
+                        goto out;
                 if (*p == 0xE8 && (valid_mask & 1)) {
                         (*process_target)(p + 1, p - data + chunk_offset,
                                           e8_file_size);
@@ -307,14 +381,22 @@ lzx_e8_filter(uint8_t *data, uint32_t size, uint32_t chunk_offset, uint32_t e8_f
                 valid_mask >>= 1;
                 valid_mask |= (uint64_t)1 << 63;
         }
+
+out:
+        /* Step over the rest of a target translated at the end.  */
+        while (!(valid_mask & 1)) {
+                p++;
+                valid_mask >>= 1;
+        }
+        return (uint32_t)(p - data);
 #endif /* __SSE2__ || __AVX2__ */
 }
 
-void
+uint32_t
 lzx_preprocess(uint8_t *data, uint32_t size, uint32_t chunk_offset, uint32_t e8_file_size)
 {
-        lzx_e8_filter(data, size, chunk_offset, e8_file_size,
-                      do_translate_target);
+        return lzx_e8_filter(data, size, chunk_offset, e8_file_size,
+                             do_translate_target);
 }
 
 void
@@ -323,3 +405,10 @@ lzx_postprocess(uint8_t *data, uint32_t size, uint32_t chunk_offset, uint32_t e8
         lzx_e8_filter(data, size, chunk_offset, e8_file_size,
                       undo_translate_target);
 }
+
+void
+liblzx_e8_postprocess(void *data, size_t size, uint32_t chunk_offset,
+                      uint32_t e8_file_size)
+{
+        lzx_postprocess(data, (uint32_t)size, chunk_offset, e8_file_size);
+}
@@ -71,6 +71,13 @@
  */
 #define MAX_FAST_LEVEL                                34
 
+/*
+ * Windows larger than LZX_MAX_WINDOW_SIZE have offsets that don't fit in the
+ * near-optimal parser's match and queue items, so they are always compressed
+ * with the faster algorithm, and higher levels are capped to this one.
+ */
+#define MAX_LARGE_WINDOW_LEVEL                        MAX_FAST_LEVEL
+
 /*
  * The compressor-side limits on the codeword lengths (in bits) for each Huffman
  * code.  To make outputting bits slightly faster, some of these limits are
@@ -127,6 +134,14 @@
  */
 #define BT_MATCHFINDER_HASH2_ORDER                12
 
+/*
+ * At levels >= MIN_SUFFIX_ARRAY_LEVEL, the slower algorithm finds matches with
+ * a suffix array instead of binary trees when each chunk is compressed
+ * independently.  This finds every match with the smallest offset for its
+ * length, at a cost that doesn't grow with the level.
+ */
+#define MIN_SUFFIX_ARRAY_LEVEL                        150
+
 /*
  * The number of lz_match structures in the match cache, excluding the extra
  * "overflow" entries.  This value should be high enough so that nearly the
@@ -172,6 +187,49 @@
  */
 #define CONSIDER_GAP_MATCHES                        1
 
+/*
+ * The positions covered by a match of at least nice_match_length bytes aren't
+ * searched.  If the match's offset is at most SKIP_HASHED_MAX_OFFSET, the data
+ * is a run of a short repeating pattern, which the trees already hold in full.
+ * Then only the last SKIP_TREE_TAIL_LENGTH positions are added to the binary
+ * trees, where the data that follows the run can be found from them, and the
+ * others only go in the hash tables for short matches.  Other long matches are
+ * repeats of arbitrary earlier data, which later data may match in part, so
+ * their positions are all added to the trees.
+ */
+#define SKIP_HASHED_MAX_OFFSET                        64
+#define SKIP_TREE_TAIL_LENGTH                        16
+
+/*
+ * The input is copied into the window and E8-preprocessed in pieces of this
+ * size, small enough that each piece is still in the L1 cache when the
+ * preprocessor goes over it.
+ */
+#define LZX_PREPROCESS_PIECE_SIZE                8192
+
+/*
+ * With automatic E8 preprocessing, the first chunk is taken for x86 machine code
+ * if at least 1 in E8_DETECT_MIN_CALL_RATIO of its E8 bytes start a plausible
+ * CALL instruction, and there's at least one such call per
+ * E8_DETECT_BYTES_PER_CALL bytes.
+ */
+#define E8_DETECT_MIN_CALL_RATIO                4
+#define E8_DETECT_BYTES_PER_CALL                4096
+
+/*
+ * With an executor, the suffix array of a chunk of at least SA_PARALLEL_MIN_SIZE
+ * bytes is linked and its LCP array is computed in SA_PARALLEL_NUM_TASKS tasks.
+ * For smaller chunks, the tasks would cost more than they save.
+ */
+#define SA_PARALLEL_NUM_TASKS                        8
+#define SA_PARALLEL_MIN_SIZE                        262144
+
+/*
+ * The size of a cache line, at which the regions of the compressor structure
+ * that are used together are aligned.
+ */
+#define LZX_CACHE_LINE_SIZE                        64
+
 /******************************************************************************/
 /*                                  Includes                                  */
 /*----------------------------------------------------------------------------*/
@@ -191,6 +249,7 @@
 #include <assert.h>
 
 #include <malloc.h>
+#include <string.h>
 
 /* Note: BT_MATCHFINDER_HASH2_ORDER must be defined before including
  * bt_matchfinder.h. */
@@ -199,6 +258,8 @@
 #define mf_pos_t        uint16_t
 #define MF_SUFFIX        _16
 #define MF_INVALID_POS        (0xFFFFu)
+#define MF_POS_MASK        (0xFFFFu)
+#define MF_TAG_MASK        (0u)
 #include "liblzx_bt_matchfinder.h"
 #include "liblzx_hc_matchfinder.h"
 
@@ -206,15 +267,27 @@
 #undef mf_pos_t
 #undef MF_SUFFIX
 #undef MF_INVALID_POS
+#undef MF_POS_MASK
+#undef MF_TAG_MASK
 #define mf_pos_t        uint32_t
 #define MF_SUFFIX        _32
 #define MF_INVALID_POS        (0xFFFFFFFFu)
+/* Positions stay below 2^28 even with the largest streaming window, so the top
+ * bits of each hash table entry hold a tag of extra hash bits.  */
+#define MF_POS_MASK        (0x0FFFFFFFu)
+#define MF_TAG_MASK        (0xF0000000u)
 #include "liblzx_bt_matchfinder.h"
 #include "liblzx_hc_matchfinder.h"
 
 #undef mf_pos_t
 #undef MF_SUFFIX
 #undef MF_INVALID_POS
+#undef MF_POS_MASK
+#undef MF_TAG_MASK
+
+/* Suffix array matchfinder, which uses 'struct lz_match' from
+ * bt_matchfinder.h */
+#include "liblzx_sa_matchfinder.h"
 
 /******************************************************************************/
 /*                            Compressor structure                            */
@@ -222,7 +295,7 @@
 
 /* Codewords for the Huffman codes */
 struct lzx_codewords {
-        uint32_t main[LZX_MAINCODE_MAX_NUM_SYMBOLS];
+        uint32_t main[LZX_DELTA_MAINCODE_MAX_NUM_SYMBOLS];
         uint32_t len[LZX_LENCODE_NUM_SYMBOLS];
         uint32_t aligned[LZX_ALIGNEDCODE_NUM_SYMBOLS];
 };
@@ -236,7 +309,7 @@ struct lzx_codewords {
  * See lzx_write_compressed_code().
  */
 struct lzx_lens {
-        uint8_t main[LZX_MAINCODE_MAX_NUM_SYMBOLS + 1];
+        uint8_t main[LZX_DELTA_MAINCODE_MAX_NUM_SYMBOLS + 1];
         uint8_t len[LZX_LENCODE_NUM_SYMBOLS + 1];
         uint8_t aligned[LZX_ALIGNEDCODE_NUM_SYMBOLS];
 };
@@ -249,7 +322,7 @@ struct lzx_codes {
 
 /* Symbol frequency counters for the Huffman-encoded alphabets */
 struct lzx_freqs {
-        uint32_t main[LZX_MAINCODE_MAX_NUM_SYMBOLS];
+        uint32_t main[LZX_DELTA_MAINCODE_MAX_NUM_SYMBOLS];
         uint32_t len[LZX_LENCODE_NUM_SYMBOLS];
         uint32_t aligned[LZX_ALIGNEDCODE_NUM_SYMBOLS];
 };
@@ -292,13 +365,16 @@ struct attrib_aligned(8) lzx_sequence {
         /*
          * If 'matchlen' doesn't indicate end-of-block, then this contains:
          *
-         * Bits 10..31: either the offset plus LZX_OFFSET_ADJUSTMENT or a recent
-         * offset code, depending on the offset slot encoded in the main symbol.
+         * Bits 12..31: the extra offset bits, i.e. the offset plus
+         * LZX_OFFSET_ADJUSTMENT minus the base of the offset slot encoded in
+         * the main symbol.  This is always 0 for recent offset codes.  Storing
+         * this instead of the full offset keeps the field narrow enough for
+         * LZX DELTA's largest windows.
          *
-         * Bits 0..9: the main symbol.
+         * Bits 0..11: the main symbol.
          */
-        uint32_t adjusted_offset_and_mainsym;
-#define SEQ_MAINSYM_BITS        10
+        uint32_t extra_bits_and_mainsym;
+#define SEQ_MAINSYM_BITS        12
 #define SEQ_MAINSYM_MASK        (((uint32_t)1 << SEQ_MAINSYM_BITS) - 1)
 };
 
@@ -375,7 +451,16 @@ struct lzx_costs {
 
 struct lzx_output_bitstream;
 
-/* The main LZX compressor structure */
+/*
+ * The main LZX compressor structure.
+ *
+ * The fields that are set up once or only touched once per chunk come first.
+ * They're followed by the state that the parsers update for every match or
+ * literal, packed into a few cache lines of its own, then by the larger
+ * per-block arrays, and finally by the data of the compression engine in use.
+ * Each of these regions starts on a cache line, and the allocation is sized to
+ * end with the engine's matchfinder, so an engine never pays for another's.
+ */
 struct liblzx_compressor {
 
         /* The LZX variant to use */
@@ -393,9 +478,28 @@ struct liblzx_compressor {
         /* Memory free function */
         liblzx_free_func_t free_func;
 
+        /* Aligned memory allocation function, or NULL.  If set, the structure
+         * and the buffers are in one allocation starting at alloc_base. */
+        liblzx_aligned_alloc_func_t aligned_alloc_func;
+
         /* Memory allocation userdata */
         void *alloc_userdata;
 
+        /* Executor functions and userdata, or NULL */
+        liblzx_submit_func_t submit_func;
+        liblzx_wait_func_t wait_func;
+        void *executor_userdata;
+
+        /* True while the chunk is being compressed in a task.  The executor
+         * can't be waited on from one of its own tasks, so no more tasks are
+         * submitted. */
+        bool in_task;
+
+        /* The allocation holding this structure, which starts up to
+         * LZX_CACHE_LINE_SIZE - 1 bytes before it, and the structure's size */
+        void *alloc_base;
+        size_t alloc_size;
+
         /* True if the compressor is outputting the first block */
         bool first_block;
 
@@ -405,6 +509,16 @@ struct liblzx_compressor {
         /* E8 preprocessor chunk offset */
         uint32_t e8_chunk_offset;
 
+        /* True if the stream uses E8 preprocessing */
+        bool e8_enabled;
+
+        /* True if E8 preprocessing is only used when the first chunk looks
+         * like x86 machine code */
+        bool e8_auto;
+
+        /* True until enough input is present to make that decision */
+        bool e8_pending;
+
         /* The buffer for preprocessed input data, if not using destructive
          * compression */
         void *in_buffer;
@@ -424,9 +538,20 @@ struct liblzx_compressor {
         /* Number of bytes currently in in_buffer */
         uint32_t in_used;
 
+        /* Number of bytes of the pending input that the E8 preprocessor is
+         * done with.  This extends into the next chunk by up to
+         * LZX_MAX_MATCH_LEN bytes, which the matchfinder looks at. */
+        uint32_t in_preprocessed;
+
         /* Maximum size of a chunk */
         uint32_t chunk_size;
 
+        /* Size of the LZX DELTA reference data */
+        uint32_t delta_source_size;
+
+        /* Number of bytes of reference data that haven't been added yet */
+        uint32_t delta_source_remaining;
+
         /* Pointer to the reset() implementation chosen at allocation time */
         void (*reset)(struct liblzx_compressor *);
 
@@ -437,63 +562,70 @@ struct liblzx_compressor {
         /* Pointer to the cul() implementation chosen at allocation time */
         void (*cull)(struct liblzx_compressor *, size_t);
 
+        /* Pointer to the prime() implementation chosen at allocation time */
+        void (*prime)(struct liblzx_compressor *, uint32_t);
+
         /* The window size. */
         uint32_t window_size;
 
         /* The log base 2 of the window size for match offset encoding purposes.
-         * This will be >= LZX_MIN_WINDOW_ORDER and <= LZX_MAX_WINDOW_ORDER. */
+         * This will be >= LZX_MIN_WINDOW_ORDER and <= LZX_MAX_WINDOW_ORDER,
+         * or <= LZX_DELTA_MAX_WINDOW_ORDER for LZX DELTA. */
         unsigned window_order;
 
+        /* True if matches of length LZX_MAX_MATCH_LEN must be followed by an
+         * LZX DELTA extended length */
+        bool extended_lengths;
+
         /* The number of symbols in the main alphabet.  This depends on the
          * window order, since the window order determines the maximum possible
          * match offset. */
         unsigned num_main_syms;
 
+        /* The number of optimization passes per block */
+        unsigned num_optim_passes;
+
         /* The "nice" match length: if a match of this length is found, then it
          * is chosen immediately without further consideration. */
-        unsigned nice_match_length;
+        attrib_aligned(LZX_CACHE_LINE_SIZE) unsigned nice_match_length;
 
         /* The maximum search depth: at most this many potential matches are
          * considered at each position. */
         unsigned max_search_depth;
 
-        /* The number of optimization passes per block */
-        unsigned num_optim_passes;
+        /* Least-recently-used match queue */
+        uint32_t lru_queue[LZX_NUM_RECENT_OFFSETS];
 
-        /* The symbol frequency counters for the current block */
-        struct lzx_freqs freqs;
+        /* Next hashes */
+        uint32_t next_hashes[2];
+
+        /* Index in 'codes' of the Huffman codes for the current block */
+        unsigned codes_index;
 
         /* Block split statistics for the current block */
         struct lzx_block_split_stats split_stats;
 
+        /* The symbol frequency counters for the current block */
+        struct lzx_freqs freqs;
+
         /* The Huffman codes for the current and previous blocks.  The one with
          * index 'codes_index' is for the current block, and the other one is
          * for the previous block. */
-        struct lzx_codes codes[2];
-        unsigned codes_index;
+        attrib_aligned(LZX_CACHE_LINE_SIZE) struct lzx_codes codes[2];
 
         /* The matches and literals that the compressor has chosen for the
          * current block.  The required length of this array is limited by the
          * maximum number of matches that can ever be chosen for a single block,
          * plus one for the special entry at the end. */
+        attrib_aligned(LZX_CACHE_LINE_SIZE)
         struct lzx_sequence chosen_sequences[
                        DIV_ROUND_UP(SOFT_MAX_BLOCK_SIZE, LZX_MIN_MATCH_LEN) + 1];
 
-        /* Least-recently-used match queue */
-        uint32_t lru_queue[LZX_NUM_RECENT_OFFSETS];
-
-        /* Next hashes */
-        uint32_t next_hashes[2];
-
-        /* Tables for mapping adjusted offsets to offset slots */
-        uint8_t offset_slot_tab_1[32768]; /* offset slots [0, 29] */
-        uint8_t offset_slot_tab_2[128]; /* offset slots [30, 49] */
-
         union {
                 /* Data for lzx_compress_lazy() */
                 struct {
                         /* Hash chains matchfinder (MUST BE LAST!!!) */
-                        union {
+                        union attrib_aligned(LZX_CACHE_LINE_SIZE) {
                                 struct hc_matchfinder_16 hc_mf_16;
                                 struct hc_matchfinder_32 hc_mf_32;
                         };
@@ -501,6 +633,11 @@ struct liblzx_compressor {
 
                 /* Data for lzx_compress_near_optimal() */
                 struct {
+                        /* The cost model for the current optimization pass,
+                         * which is read for every match considered */
+                        attrib_aligned(LZX_CACHE_LINE_SIZE)
+                        struct lzx_costs costs;
+
                         /*
                          * Array of nodes, one per position, for running the
                          * minimum-cost path algorithm.
@@ -513,13 +650,10 @@ struct liblzx_compressor {
                          * LZX_MAX_MATCH_LEN'.  Add one for the end-of-block
                          * node.
                          */
+                        attrib_aligned(LZX_CACHE_LINE_SIZE)
                         struct lzx_optimum_node optimum_nodes[
                                                     SOFT_MAX_BLOCK_SIZE - 1 +
                                                     LZX_MAX_MATCH_LEN + 1];
-
-                        /* The cost model for the current optimization pass */
-                        struct lzx_costs costs;
-
                         /*
                          * Cached matches for the current block.  This array
                          * contains the matches that were found at each position
@@ -546,10 +680,12 @@ struct liblzx_compressor {
                                                     MAX_MATCHES_PER_POS +
                                                     LZX_MAX_MATCH_LEN - 1];
 
-                        /* Binary trees matchfinder (MUST BE LAST!!!) */
-                        union {
+                        /* Binary trees or suffix array matchfinder (MUST BE
+                         * LAST!!!) */
+                        union attrib_aligned(LZX_CACHE_LINE_SIZE) {
                                 struct bt_matchfinder_16 bt_mf_16;
                                 struct bt_matchfinder_32 bt_mf_32;
+                                struct sa_matchfinder sa_mf;
                         };
                 };
         };
@@ -561,34 +697,66 @@ struct liblzx_compressor {
 
 /*
  * Will a matchfinder using 16-bit positions be sufficient for compressing
- * buffers of up to the specified size?  The limit could be 65536 bytes, but we
- * also want to optimize out the use of offset_slot_tab_2 in the 16-bit case.
- * This requires that the limit be no more than the length of offset_slot_tab_1
- * (currently 32768).
+ * buffers of up to the specified size?  Window sizes are powers of 2, and a
+ * 65536-byte window would use every 16-bit position, leaving none free for
+ * MF_INVALID_POS.
  */
 static attrib_forceinline bool
 lzx_is_16_bit(size_t max_bufsize)
 {
-        STATIC_ASSERT(ARRAY_LEN(((struct liblzx_compressor *)0)->offset_slot_tab_1) == 32768);
         return max_bufsize <= 32768;
 }
 
+/*
+ * Will the window need offset slots beyond those of CAB LZX?  Such windows are
+ * only valid in LZX DELTA.
+ */
+static attrib_forceinline bool
+lzx_is_large(size_t max_bufsize)
+{
+        return max_bufsize > LZX_MAX_WINDOW_SIZE;
+}
+
 /*
  * Return the offset slot for the specified adjusted match offset.
+ *
+ * Slots 0 to 3 each hold a single adjusted offset.  After that, each power of
+ * 2 is split into two slots, so the slot is twice the index of the highest set
+ * bit plus the bit just below it.  This holds up to slot 36, the first of the
+ * slots that all have 17 extra bits; from there on, each slot holds 1 << 17
+ * adjusted offsets.  Computing the slot this way is a few instructions with no
+ * memory access, where a lookup table would be large enough to compete with
+ * the matchfinder for the cache.
  */
 static attrib_forceinline unsigned
-lzx_get_offset_slot(struct liblzx_compressor *c, uint32_t adjusted_offset,
-                    bool is_16_bit)
+lzx_get_offset_slot(uint32_t adjusted_offset, bool is_16_bit)
 {
+        unsigned high_bit;
+
         if (__builtin_constant_p(adjusted_offset) &&
             adjusted_offset < LZX_NUM_RECENT_OFFSETS)
                 return adjusted_offset;
-        if (is_16_bit || adjusted_offset < ARRAY_LEN(c->offset_slot_tab_1))
-                return c->offset_slot_tab_1[adjusted_offset];
 
-        assert((adjusted_offset >> 14) < ARRAY_LEN(c->offset_slot_tab_2));
+        if (!is_16_bit &&
+            adjusted_offset >= ((uint32_t)2 << LZX_MAX_NUM_EXTRA_BITS))
+                return (adjusted_offset >> LZX_MAX_NUM_EXTRA_BITS) + 34;
 
-        return c->offset_slot_tab_2[adjusted_offset >> 14];
+        high_bit = bsr32(adjusted_offset | 1);
+        return adjusted_offset < 4 ? adjusted_offset :
+               (high_bit * 2) + ((adjusted_offset >> (high_bit - 1)) & 1);
+}
+
+/*
+ * Return the extra offset bits of a match with the specified main symbol and
+ * adjusted offset.
+ */
+static attrib_forceinline uint32_t
+lzx_get_extra_bits(unsigned mainsym, uint32_t adjusted_offset)
+{
+        unsigned offset_slot = (mainsym - LZX_NUM_CHARS) / LZX_NUM_LEN_HEADERS;
+
+        return adjusted_offset - (lzx_offset_slot_base[offset_slot] +
+                                  LZX_OFFSET_ADJUSTMENT);
 }
 
 /*
@@ -611,7 +779,7 @@ lzx_tally_main_and_lensyms(struct liblzx_compressor *c, unsigned length,
         }
 
         mainsym += LZX_NUM_LEN_HEADERS *
-                   lzx_get_offset_slot(c, adjusted_offset, is_16_bit);
+                   lzx_get_offset_slot(adjusted_offset, is_16_bit);
         c->freqs.main[mainsym]++;
         return mainsym;
 }
@@ -630,6 +798,26 @@ lzx_tally_main_and_lensyms(struct liblzx_compressor *c, unsigned length,
         ((is_16_bit) ? CONCAT(funcname, _16)(&(c)->bt_mf_16, ##__VA_ARGS__) : \
                        CONCAT(funcname, _32)(&(c)->bt_mf_32, ##__VA_ARGS__));
 
+/*
+ * The bitstream formats a compressor instance can produce.  Like 'is_16_bit',
+ * the format is a compilation time constant in each instance, so the block
+ * header layout and the LZX DELTA extended length checks are resolved when the
+ * compressor is created rather than once per block or per match.
+ */
+enum lzx_format {
+        /* CAB LZX: 24-bit block sizes, E8 header in the first block */
+        LZX_FORMAT_CAB,
+
+        /* LZX DELTA: CAB LZX with extended lengths after maximum length
+         * matches */
+        LZX_FORMAT_DELTA,
+
+        /* WIM LZX: 1-bit default block size flag, no E8 header */
+        LZX_FORMAT_WIM,
+
+        LZX_NUM_FORMATS,
+};
+
 /******************************************************************************/
 /*                             Output bitstream                               */
 /*----------------------------------------------------------------------------*/
@@ -994,11 +1182,14 @@ lzx_write_compressed_code(struct lzx_output_bitstream *os,
  *        The matches and literals to output, given as a series of sequences.
  * @codes
  *        The main, length, and aligned offset Huffman codes for the block.
+ * @extended_lengths
+ *        True if matches of length LZX_MAX_MATCH_LEN must be followed by an
+ *        LZX DELTA extended length.
  */
-static void
+static attrib_forceinline void
 lzx_write_sequences(struct lzx_output_bitstream *os, int block_type,
                     const uint8_t *block_data, const struct lzx_sequence sequences[],
-                    const struct lzx_codes *codes)
+                    const struct lzx_codes *codes, bool extended_lengths)
 {
         const struct lzx_sequence *seq = sequences;
         unsigned min_aligned_offset_slot;
@@ -1006,7 +1197,7 @@ lzx_write_sequences(struct lzx_output_bitstream *os, int block_type,
         if (block_type == LZX_BLOCKTYPE_ALIGNED)
                 min_aligned_offset_slot = LZX_MIN_ALIGNED_OFFSET_SLOT;
         else
-                min_aligned_offset_slot = LZX_MAX_OFFSET_SLOTS;
+                min_aligned_offset_slot = LZX_DELTA_MAX_OFFSET_SLOTS;
 
         for (;;) {
                 /* Output the next sequence.  */
@@ -1015,7 +1206,6 @@ lzx_write_sequences(struct lzx_output_bitstream *os, int block_type,
                 unsigned matchlen = seq->litrunlen_and_matchlen & SEQ_MATCHLEN_MASK;
                 STATIC_ASSERT((uint32_t)~SEQ_MATCHLEN_MASK >> SEQ_MATCHLEN_BITS >=
                               SOFT_MAX_BLOCK_SIZE);
-                uint32_t adjusted_offset;
                 unsigned main_symbol;
                 unsigned offset_slot;
                 unsigned num_extra_bits;
@@ -1078,13 +1268,11 @@ lzx_write_sequences(struct lzx_output_bitstream *os, int block_type,
 
                 block_data += matchlen;
 
-                adjusted_offset = seq->adjusted_offset_and_mainsym >> SEQ_MAINSYM_BITS;
-                main_symbol = seq->adjusted_offset_and_mainsym & SEQ_MAINSYM_MASK;
+                extra_bits = seq->extra_bits_and_mainsym >> SEQ_MAINSYM_BITS;
+                main_symbol = seq->extra_bits_and_mainsym & SEQ_MAINSYM_MASK;
 
                 offset_slot = (main_symbol - LZX_NUM_CHARS) / LZX_NUM_LEN_HEADERS;
                 num_extra_bits = lzx_extra_offset_bits[offset_slot];
-                extra_bits = adjusted_offset - (lzx_offset_slot_base[offset_slot] +
-                                                LZX_OFFSET_ADJUSTMENT);
 
         #define MAX_MATCH_BITS (MAIN_CODEWORD_LIMIT +                \
                                 LENGTH_CODEWORD_LIMIT +                \
@@ -1117,7 +1305,9 @@ lzx_write_sequences(struct lzx_output_bitstream *os, int block_type,
                  * offset blocks, the lowest 3 bits of the adjusted offset are
                  * Huffman-encoded using the aligned offset code, provided that
                  * there are at least extra 3 offset bits required.  All other
-                 * extra offset bits are output verbatim.  */
+                 * extra offset bits are output verbatim.  (The bases of those
+                 * offset slots are multiples of 8, so the low 3 bits of the
+                 * extra bits are the low 3 bits of the adjusted offset.)  */
 
                 if (offset_slot >= min_aligned_offset_slot) {
 
@@ -1127,9 +1317,9 @@ lzx_write_sequences(struct lzx_output_bitstream *os, int block_type,
                                 lzx_flush_bits(os, LZX_MAX_NUM_EXTRA_BITS -
                                                    LZX_NUM_ALIGNED_OFFSET_BITS);
 
-                        lzx_add_bits(os, codes->codewords.aligned[adjusted_offset &
+                        lzx_add_bits(os, codes->codewords.aligned[extra_bits &
                                                                   LZX_ALIGNED_OFFSET_BITMASK],
-                                     codes->lens.aligned[adjusted_offset &
+                                     codes->lens.aligned[extra_bits &
                                                          LZX_ALIGNED_OFFSET_BITMASK]);
                         if (!CAN_BUFFER(MAX_MATCH_BITS))
                                 lzx_flush_bits(os, ALIGNED_CODEWORD_LIMIT);
@@ -1144,6 +1334,11 @@ lzx_write_sequences(struct lzx_output_bitstream *os, int block_type,
                 if (CAN_BUFFER(MAX_MATCH_BITS))
                         lzx_flush_bits(os, MAX_MATCH_BITS);
 
+                /* In LZX DELTA, follow a maximum length match with an
+                 * extended length of 0 additional bytes.  */
+                if (extended_lengths && matchlen == LZX_MAX_MATCH_LEN)
+                        lzx_write_bits(os, 0, LZX_DELTA_SHORT_EXTENDED_LEN_BITS);
+
                 /* Advance to the next sequence.  */
                 seq++;
         }
@@ -1161,11 +1356,11 @@ lzx_write_header(uint32_t e8_file_size, struct lzx_output_bitstream *os)
         }
 }
 
-static void
+static attrib_forceinline void
 lzx_write_compressed_block(const uint8_t *block_begin,
                            int block_type,
                            uint32_t block_size,
-                           enum liblzx_variant variant,
+                           enum lzx_format format,
                            unsigned window_order,
                            unsigned num_main_syms,
                            const struct lzx_sequence sequences[],
@@ -1196,7 +1391,7 @@ lzx_write_compressed_block(const uint8_t *block_begin,
          * allocated to be capable of compressing more than 32768 bytes at once
          * (which also causes the number of main symbols to be increased).
          */
-        if (variant == LIBLZX_VARIANT_WIM) {
+        if (format == LZX_FORMAT_WIM) {
                 if (block_size == LZX_DEFAULT_BLOCK_SIZE) {
                         lzx_write_bits(os, 1, 1);
                 } else {
@@ -1234,7 +1429,8 @@ lzx_write_compressed_block(const uint8_t *block_begin,
                                   LZX_LENCODE_NUM_SYMBOLS);
 
         /* Output the compressed matches and literals.  */
-        lzx_write_sequences(os, block_type, block_begin, sequences, codes);
+        lzx_write_sequences(os, block_type, block_begin, sequences, codes,
+                            format == LZX_FORMAT_DELTA);
 }
 
 /*
@@ -1279,9 +1475,10 @@ lzx_choose_verbatim_or_aligned(const struct lzx_freqs * freqs,
  * Note: we never output UNCOMPRESSED blocks.  This probably should be
  * implemented sometime, but it doesn't make much difference.
  */
-static void
+static attrib_forceinline void
 lzx_flush_block(struct liblzx_compressor *c, struct lzx_output_bitstream *os,
-                const uint8_t *block_begin, uint32_t block_size, uint32_t seq_idx)
+                const uint8_t *block_begin, uint32_t block_size, uint32_t seq_idx,
+                enum lzx_format format)
 {
         int block_type;
 
@@ -1290,9 +1487,10 @@ lzx_flush_block(struct liblzx_compressor *c, struct lzx_output_bitstream *os,
         block_type = lzx_choose_verbatim_or_aligned(&c->freqs,
                                                     &c->codes[c->codes_index]);
 
-        if (c->variant != LIBLZX_VARIANT_WIM) {
+        if (format != LZX_FORMAT_WIM) {
                 if (c->first_block) {
-                        lzx_write_header(c->e8_file_size, os);
+                        lzx_write_header(c->e8_enabled ? c->e8_file_size : 0,
+                                         os);
                         c->first_block = false;
                 }
         }
@@ -1300,7 +1498,7 @@ lzx_flush_block(struct liblzx_compressor *c, struct lzx_output_bitstream *os,
         lzx_write_compressed_block(block_begin,
                                    block_type,
                                    block_size,
-                                   c->variant,
+                                   format,
                                    c->window_order,
                                    c->num_main_syms,
                                    &c->chosen_sequences[seq_idx],
@@ -1540,7 +1738,7 @@ lzx_walk_item_list(struct liblzx_compressor *c, uint32_t block_size, bool is_16_
                                          SEQ_MATCHLEN_BITS;
                                 seq--;
                                 seq->litrunlen_and_matchlen = matchlen;
-                                seq->adjusted_offset_and_mainsym = mainsym;
+                                seq->extra_bits_and_mainsym = mainsym;
                                 litrun_end = node_idx - matchlen;
                         }
 
@@ -1573,8 +1771,9 @@ lzx_walk_item_list(struct liblzx_compressor *c, uint32_t block_size, bool is_16_
                                 (litrun_end - node_idx) << SEQ_MATCHLEN_BITS;
                         seq--;
                         seq->litrunlen_and_matchlen = matchlen;
-                        seq->adjusted_offset_and_mainsym =
-                                (adjusted_offset << SEQ_MAINSYM_BITS) | mainsym;
+                        seq->extra_bits_and_mainsym =
+                                (lzx_get_extra_bits(mainsym, adjusted_offset) <<
+                                 SEQ_MAINSYM_BITS) | mainsym;
                         litrun_end = node_idx - matchlen;
                 }
                 node_idx -= matchlen;
@@ -1834,7 +2033,7 @@ lzx_find_min_cost_path(struct liblzx_compressor * const restrict c,
                         for (;;) {
                                 uint32_t offset = cache_ptr->offset;
                                 uint32_t adjusted_offset = offset + LZX_OFFSET_ADJUSTMENT;
-                                unsigned offset_slot = lzx_get_offset_slot(c, adjusted_offset, is_16_bit);
+                                unsigned offset_slot = lzx_get_offset_slot(adjusted_offset, is_16_bit);
                                 uint32_t base_cost = cur_node->cost;
                                 uint32_t cost;
 
@@ -2386,7 +2585,11 @@ lzx_set_default_costs(struct liblzx_compressor *c)
         fixed32frac half_base_literal_prob;
         fixed32 temp_fixed;
 
-        fixed_rcp_approx(&inv_num_matches, c->freqs.main[LZX_NUM_CHARS]);
+        /* A short block, such as all of a tiny input, may have no matches,
+         * or even no symbols tallied at all, so guard the divisions below.
+         * inv_num_matches is only used if there are matches. */
+        fixed_rcp_approx(&inv_num_matches,
+                         max_u32(c->freqs.main[LZX_NUM_CHARS], 1));
         fixed_rcp_approx(&half_inv_6870, 6870 * 2);
         fixed_set(&prob_match, 1);
         fixed_set_fraction(&frac_15_100, 15, 100);
@@ -2406,7 +2609,8 @@ lzx_set_default_costs(struct liblzx_compressor *c)
          * don't attempt to estimate which ones will be used. */
 
         fixed_rcp_approx(&half_inv_num_items,
-                         (num_literals + c->freqs.main[LZX_NUM_CHARS]) * 2);
+                         max_u32(num_literals + c->freqs.main[LZX_NUM_CHARS],
+                                 1) * 2);
         fixed_mul_uint_frac_to_frac(&half_base_literal_prob,
                             literal_scaled_probs[num_used_literals],
                             &half_inv_6870);
@@ -2506,7 +2710,7 @@ lzx_optimize_and_flush_block(struct liblzx_compressor * const restrict c,
                              const uint8_t * const restrict block_begin,
                              const uint32_t block_size,
                              const struct lzx_lru_queue initial_queue,
-                             bool is_16_bit)
+                             enum lzx_format format, bool is_16_bit)
 {
         unsigned num_passes_remaining = c->num_optim_passes;
         struct lzx_lru_queue new_queue;
@@ -2532,7 +2736,7 @@ lzx_optimize_and_flush_block(struct liblzx_compressor * const restrict c,
         /* Done optimizing.  Generate the sequence list and flush the block. */
         lzx_reset_symbol_frequencies(c);
         seq_idx = lzx_record_item_list(c, block_size, is_16_bit);
-        lzx_flush_block(c, os, block_begin, block_size, seq_idx);
+        lzx_flush_block(c, os, block_begin, block_size, seq_idx, format);
         return new_queue;
 }
 
@@ -2556,6 +2760,104 @@ lzx_reset_near_optimal(struct liblzx_compressor *c, bool is_16_bit)
         CALL_BT_MF(is_16_bit, c, bt_matchfinder_init);
 }
 
+static void
+lzx_reset_near_optimal_sa(struct liblzx_compressor *c)
+{
+        /* The suffix array is rebuilt for each chunk. */
+        sa_matchfinder_init(&c->sa_mf, c->window_size);
+}
+
+struct lzx_sa_task {
+        struct sa_matchfinder *mf;
+        const uint8_t *in;
+        uint32_t in_size;
+        uint32_t begin;
+        uint32_t end;
+};
+
+static void
+lzx_sa_link_task(void *arg)
+{
+        struct lzx_sa_task *task = arg;
+
+        sa_matchfinder_link(task->mf, task->begin, task->end);
+}
+
+static void
+lzx_sa_compute_lcp_task(void *arg)
+{
+        struct lzx_sa_task *task = arg;
+
+        sa_matchfinder_compute_lcp(task->mf, task->in, task->in_size,
+                                   LZX_MAX_MATCH_LEN, task->begin, task->end);
+}
+
+static void
+lzx_sa_build_tree_task(void *arg)
+{
+        struct lzx_sa_task *task = arg;
+
+        sa_matchfinder_build_tree(task->mf, task->begin, task->end);
+}
+
+/* Run a stage of suffix array construction on each range, and wait until
+ * they're all done. */
+static void
+lzx_run_sa_tasks(struct liblzx_compressor *c, struct lzx_sa_task *tasks,
+                 liblzx_task_func_t func)
+{
+        unsigned i;
+
+        for (i = 0; i < SA_PARALLEL_NUM_TASKS; i++)
+                c->submit_func(c->executor_userdata, func, &tasks[i]);
+        c->wait_func(c->executor_userdata);
+}
+
+/*
+ * Index a chunk with the suffix array matchfinder.  With an executor, every
+ * stage of a large chunk but sorting the suffixes is split into ranges that run
+ * as tasks on it.  The tree of LCP intervals can only be split between
+ * subtrees of the root, so its ranges are moved forward to where those start.
+ * The output doesn't depend on how the work is split.
+ */
+static void
+lzx_build_suffix_array(struct liblzx_compressor *c, const uint8_t *in,
+                       uint32_t in_size)
+{
+        struct lzx_sa_task tasks[SA_PARALLEL_NUM_TASKS];
+        unsigned i;
+
+        if (!c->submit_func || c->in_task || in_size < SA_PARALLEL_MIN_SIZE) {
+                sa_matchfinder_build(&c->sa_mf, in, in_size,
+                                     LZX_MAX_MATCH_LEN);
+                return;
+        }
+
+        sa_matchfinder_sort(&c->sa_mf, in, in_size);
+
+        for (i = 0; i < SA_PARALLEL_NUM_TASKS; i++) {
+                tasks[i].mf = &c->sa_mf;
+                tasks[i].in = in;
+                tasks[i].in_size = in_size;
+                tasks[i].begin = (uint32_t)((uint64_t)in_size * i /
+                                            SA_PARALLEL_NUM_TASKS);
+                tasks[i].end = (uint32_t)((uint64_t)in_size * (i + 1) /
+                                          SA_PARALLEL_NUM_TASKS);
+        }
+
+        lzx_run_sa_tasks(c, tasks, lzx_sa_link_task);
+        lzx_run_sa_tasks(c, tasks, lzx_sa_compute_lcp_task);
+
+        for (i = 1; i < SA_PARALLEL_NUM_TASKS; i++) {
+                tasks[i].begin = sa_matchfinder_next_subtree(
+                        &c->sa_mf, in_size,
+                        max_u32(tasks[i].begin, tasks[i - 1].begin));
+                tasks[i - 1].end = tasks[i].begin;
+        }
+
+        lzx_run_sa_tasks(c, tasks, lzx_sa_build_tree_task);
+}
+
 static void
 lzx_reset_near_optimal_16(struct liblzx_compressor *c)
 {
@@ -2573,10 +2875,13 @@ lzx_compress_near_optimal(struct liblzx_compressor * restrict c,
                           const uint8_t *restrict in_begin,
                           size_t in_nchunk, size_t in_ndata,
                           struct lzx_output_bitstream * restrict os,
-                          bool is_16_bit)
+                          enum lzx_format format, bool is_16_bit, bool use_sa)
 {
-        uint32_t max_offset                 = c->window_size;
+        /* The format disallows offsets that would let a match begin at the
+         * window position being written; see lzx_get_num_main_syms(). */
+        uint32_t max_offset = c->window_size - LZX_MIN_MATCH_LEN - 1;
         const uint8_t *         in_next = in_begin;
+        const uint8_t * const in_chunk_begin = in_begin;
         const uint8_t * const in_chunk_end = in_begin + in_nchunk;
         const uint8_t * const in_data_end = in_begin + in_ndata;
         uint32_t max_find_len = LZX_MAX_MATCH_LEN;
@@ -2585,20 +2890,22 @@ lzx_compress_near_optimal(struct liblzx_compressor * restrict c,
         uint32_t next_hashes[2] = {0, 0};
         struct lzx_lru_queue queue;
 
-        if (max_offset >= LZX_MAX_WINDOW_SIZE) {
-                /* Slightly shrink window to avoid offset values that are
-                 * greater than 21 bits. */
-                max_offset = LZX_MAX_WINDOW_SIZE - 1 - LZX_OFFSET_ADJUSTMENT;
-        }
+        /* The LRU queue and the optimum nodes hold offsets in 21 bits, which
+         * is enough for CAB LZX windows. */
+        STATIC_ASSERT_STMT(LZX_MAX_WINDOW_SIZE - LZX_MIN_MATCH_LEN - 1 <=
+                           LZX_QUEUE_OFFSET_MASK);
+        assert(!lzx_is_large(c->window_size));
 
         in_begin -= c->in_prefix_size;
 
-        if (c->variant == LIBLZX_VARIANT_WIM) {
-                CALL_BT_MF(is_16_bit, c, bt_matchfinder_init);
-        } else {
-                /* Load the LRU queue */
-                lzx_lru_queue_load(&queue, c->lru_queue);
-        }
+        /* Only used for WIM, where each chunk stands alone, so only the chunk
+         * is indexed.  The binary trees were reset at the end of the last
+         * one. */
+        if (use_sa)
+                lzx_build_suffix_array(c, in_chunk_begin, (uint32_t)in_ndata);
+
+        /* Load the LRU queue */
+        lzx_lru_queue_load(&queue, c->lru_queue);
 
         do {
                 /* Starting a new block */
@@ -2608,6 +2915,7 @@ lzx_compress_near_optimal(struct liblzx_compressor * restrict c,
                         in_next + min_size(SOFT_MAX_BLOCK_SIZE, in_chunk_end - in_next);
                 struct lz_match *cache_ptr = c->match_cache;
                 const uint8_t *next_search_pos = in_next;
+                bool skip_hashed = false;
                 const uint8_t *next_observation = in_next;
                 const uint8_t *next_pause_point =
                         min_constptr(in_next + min_size(MIN_BLOCK_SIZE,
@@ -2641,18 +2949,30 @@ lzx_compress_near_optimal(struct liblzx_compressor * restrict c,
                                 struct lz_match *lz_matchptr;
                                 uint32_t best_len;
 
-                                lz_matchptr = CALL_BT_MF(is_16_bit, c,
-                                                         bt_matchfinder_get_matches,
-                                                         in_begin,
-                                                         min_match_pos,
-                                                         in_next - in_begin,
-                                                         max_find_len,
-                                                         max_produce_len,
-                                                         nice_len,
-                                                         c->max_search_depth,
-                                                         next_hashes,
-                                                         &best_len,
-                                                         cache_ptr + 1);
+                                if (use_sa) {
+                                        uint32_t sa_pos = in_next - in_chunk_begin;
+
+                                        lz_matchptr = sa_matchfinder_get_matches(
+                                                        &c->sa_mf,
+                                                        sa_pos - min_u32(sa_pos, max_offset),
+                                                        sa_pos,
+                                                        max_produce_len,
+                                                        &best_len,
+                                                        cache_ptr + 1);
+                                } else {
+                                        lz_matchptr = CALL_BT_MF(is_16_bit, c,
+                                                                 bt_matchfinder_get_matches,
+                                                                 in_begin,
+                                                                 min_match_pos,
+                                                                 in_next - in_begin,
+                                                                 max_find_len,
+                                                                 max_produce_len,
+                                                                 nice_len,
+                                                                 c->max_search_depth,
+                                                                 next_hashes,
+                                                                 &best_len,
+                                                                 cache_ptr + 1);
+                                }
                                 cache_ptr->length = lz_matchptr - (cache_ptr + 1);
                                 cache_ptr = lz_matchptr;
 
@@ -2701,18 +3021,34 @@ lzx_compress_near_optimal(struct liblzx_compressor * restrict c,
                                  * compressible, so it doesn't matter as much
                                  * what we do.
                                  */
-                                if (best_len >= nice_len)
+                                if (best_len >= nice_len) {
                                         next_search_pos = in_next + best_len;
+                                        skip_hashed = (cache_ptr[-1].offset <=
+                                                       SKIP_HASHED_MAX_OFFSET);
+                                }
                         } else {
                                 /* Don't search for matches at this position. */
-                                CALL_BT_MF(is_16_bit, c,
-                                           bt_matchfinder_skip_byte,
-                                           in_begin,
-                                           min_match_pos,
-                                           in_next - in_begin,
-                                           nice_len,
-                                           c->max_search_depth,
-                                           next_hashes);
+                                if (use_sa) {
+                                        sa_matchfinder_skip_byte(&c->sa_mf,
+                                                                 in_next - in_chunk_begin);
+                                } else if (skip_hashed &&
+                                           next_search_pos - in_next >
+                                           SKIP_TREE_TAIL_LENGTH) {
+                                        CALL_BT_MF(is_16_bit, c,
+                                                   bt_matchfinder_skip_byte_hashed,
+                                                   in_begin,
+                                                   in_next - in_begin,
+                                                   next_hashes);
+                                } else {
+                                        CALL_BT_MF(is_16_bit, c,
+                                                   bt_matchfinder_skip_byte,
+                                                   in_begin,
+                                                   min_match_pos,
+                                                   in_next - in_begin,
+                                                   nice_len,
+                                                   c->max_search_depth,
+                                                   next_hashes);
+                                }
                                 cache_ptr->length = 0;
                                 cache_ptr++;
                         }
@@ -2770,28 +3106,38 @@ lzx_compress_near_optimal(struct liblzx_compressor * restrict c,
                  * choose a match/literal sequence and flush the block. */
                 queue = lzx_optimize_and_flush_block(c, os, in_block_begin,
                                                      in_next - in_block_begin,
-                                                     queue, is_16_bit);
+                                                     queue, format, is_16_bit);
         } while (in_next != in_chunk_end);
 
         /* Save the LRU queue and next hashes */
         lzx_lru_queue_save(c->lru_queue, &queue);
 }
 
-static void
-lzx_compress_near_optimal_16(struct liblzx_compressor *c, const uint8_t *in,
-                             size_t in_nchunk, size_t in_ndata,
-                             struct lzx_output_bitstream *os)
-{
-        lzx_compress_near_optimal(c, in, in_nchunk, in_ndata, os, true);
+/*
+ * Instances of the near-optimal compressor, one per format and matchfinder
+ * position width.  The suffix array matchfinder is only used for WIM.
+ */
+#define LZX_NEAR_OPTIMAL_INSTANCE(suffix, format, is_16_bit, use_sa)          \
+static void                                                                   \
+CONCAT(lzx_compress_near_optimal, suffix)(struct liblzx_compressor *c,        \
+                                          const uint8_t *in,                  \
+                                          size_t in_nchunk, size_t in_ndata,  \
+                                          struct lzx_output_bitstream *os)    \
+{                                                                             \
+        lzx_compress_near_optimal(c, in, in_nchunk, in_ndata, os, format,     \
+                                  is_16_bit, use_sa);                         \
 }
 
-static void
-lzx_compress_near_optimal_32(struct liblzx_compressor *c, const uint8_t *in,
-                             size_t in_nchunk, size_t in_ndata,
-                             struct lzx_output_bitstream *os)
-{
-        lzx_compress_near_optimal(c, in, in_nchunk, in_ndata, os, false);
-}
+LZX_NEAR_OPTIMAL_INSTANCE(_cab_16, LZX_FORMAT_CAB, true, false)
+LZX_NEAR_OPTIMAL_INSTANCE(_cab_32, LZX_FORMAT_CAB, false, false)
+LZX_NEAR_OPTIMAL_INSTANCE(_delta_16, LZX_FORMAT_DELTA, true, false)
+LZX_NEAR_OPTIMAL_INSTANCE(_delta_32, LZX_FORMAT_DELTA, false, false)
+LZX_NEAR_OPTIMAL_INSTANCE(_wim_16, LZX_FORMAT_WIM, true, false)
+LZX_NEAR_OPTIMAL_INSTANCE(_wim_32, LZX_FORMAT_WIM, false, false)
+LZX_NEAR_OPTIMAL_INSTANCE(_sa_wim_16, LZX_FORMAT_WIM, true, true)
+LZX_NEAR_OPTIMAL_INSTANCE(_sa_wim_32, LZX_FORMAT_WIM, false, true)
+
+#undef LZX_NEAR_OPTIMAL_INSTANCE
 
 static attrib_forceinline void
 lzx_cull_near_optimal(struct liblzx_compressor *c, size_t nbytes, const bool is_16_bit)
@@ -2811,6 +3157,62 @@ lzx_cull_near_optimal_32(struct liblzx_compressor *c, size_t nbytes)
         lzx_cull_near_optimal(c, nbytes, false);
 }
 
+/*
+ * Insert the first @source_size bytes of the input buffer, which hold the LZX
+ * DELTA reference data, into the binary trees so that the following data can
+ * be matched against them.
+ */
+static attrib_forceinline void
+lzx_prime_near_optimal(struct liblzx_compressor *c, uint32_t source_size,
+                       const bool is_16_bit)
+{
+        const uint8_t *in_begin = c->in_buffer;
+        uint32_t nice_len = min_u32(c->nice_match_length, LZX_MAX_MATCH_LEN);
+        uint32_t next_hashes[2] = {0, 0};
+        uint32_t pos;
+
+        /* Matches must not extend past the end of the reference data, since
+         * the bytes after it haven't been added yet. */
+        for (pos = 0; pos + BT_MATCHFINDER_REQUIRED_NBYTES <= source_size;
+             pos++)
+        {
+                nice_len = min_u32(nice_len, source_size - pos);
+                CALL_BT_MF(is_16_bit, c, bt_matchfinder_skip_byte, in_begin,
+                           0, pos, nice_len, c->max_search_depth,
+                           next_hashes);
+        }
+}
+
+static void
+lzx_prime_near_optimal_16(struct liblzx_compressor *c, uint32_t source_size)
+{
+        lzx_prime_near_optimal(c, source_size, true);
+}
+
+static void
+lzx_prime_near_optimal_32(struct liblzx_compressor *c, uint32_t source_size)
+{
+        lzx_prime_near_optimal(c, source_size, false);
+}
+
+/*
+ * The suffix array is only used when each chunk is compressed independently, so
+ * there's never any history to cull or reference data to prime.
+ */
+static void
+lzx_cull_near_optimal_sa(struct liblzx_compressor *c, size_t nbytes)
+{
+        (void)c;
+        (void)nbytes;
+}
+
+static void
+lzx_prime_near_optimal_sa(struct liblzx_compressor *c, uint32_t source_size)
+{
+        (void)c;
+        (void)source_size;
+}
+
 /******************************************************************************/
 /*                     Faster ("lazy") compression algorithm                  */
 /*----------------------------------------------------------------------------*/
@@ -2837,7 +3239,8 @@ lzx_choose_literal(struct liblzx_compressor *c, unsigned literal, uint32_t *litr
 static attrib_forceinline void
 lzx_choose_match(struct liblzx_compressor *c, unsigned length, uint32_t adjusted_offset,
                  uint32_t recent_offsets[LZX_NUM_RECENT_OFFSETS], bool is_16_bit,
-                 uint32_t *litrunlen_p, struct lzx_sequence **next_seq_p)
+                 uint32_t *litrunlen_p,
+                 struct lzx_sequence **next_seq_p)
 {
         struct lzx_sequence *next_seq = *next_seq_p;
         unsigned mainsym;
@@ -2848,8 +3251,9 @@ lzx_choose_match(struct liblzx_compressor *c, unsigned length, uint32_t adjusted
                                              is_16_bit);
         next_seq->litrunlen_and_matchlen =
                 (*litrunlen_p << SEQ_MATCHLEN_BITS) | length;
-        next_seq->adjusted_offset_and_mainsym =
-                (adjusted_offset << SEQ_MAINSYM_BITS) | mainsym;
+        next_seq->extra_bits_and_mainsym =
+                (lzx_get_extra_bits(mainsym, adjusted_offset) <<
+                 SEQ_MAINSYM_BITS) | mainsym;
 
         /* Update the recent offsets queue. */
         if (adjusted_offset < LZX_NUM_RECENT_OFFSETS) {
@@ -2977,11 +3381,8 @@ lzx_repeat_offset_match_score(unsigned rep_len, unsigned rep_idx)
 static attrib_forceinline void
 lzx_reset_lazy(struct liblzx_compressor *c, bool is_16_bit)
 {
-        bool streaming = (c->variant != LIBLZX_VARIANT_WIM);
-
         /* Initialize the matchfinder. */
-        CALL_HC_MF(is_16_bit, c, hc_matchfinder_init, c->window_size,
-                   streaming);
+        CALL_HC_MF(is_16_bit, c, hc_matchfinder_init);
 }
 
 static void
@@ -3000,9 +3401,11 @@ static attrib_forceinline void
 lzx_compress_lazy(struct liblzx_compressor * restrict c,
                   const uint8_t * restrict in_begin, size_t in_nchunk,
                   size_t in_ndata, struct lzx_output_bitstream * restrict os,
-                  bool is_16_bit)
+                  enum lzx_format format, bool is_16_bit)
 {
-        uint32_t max_offset                 = c->window_size;
+        /* The format disallows offsets that would let a match begin at the
+         * window position being written; see lzx_get_num_main_syms(). */
+        uint32_t max_offset = c->window_size - LZX_MIN_MATCH_LEN - 1;
         const uint8_t *         in_next = in_begin;
         const uint8_t * const in_chunk_end = in_begin + in_nchunk;
         const uint8_t *const in_data_end = in_begin + in_ndata;
@@ -3013,12 +3416,6 @@ lzx_compress_lazy(struct liblzx_compressor * restrict c,
         uint32_t recent_offsets[LZX_NUM_RECENT_OFFSETS];
         uint32_t next_hashes[2];
 
-        if (max_offset >= LZX_MAX_WINDOW_SIZE) {
-                /* Slightly shrink window to avoid offset values that are
-                 * greater than 21 bits. */
-                max_offset = LZX_MAX_WINDOW_SIZE - 1 - LZX_OFFSET_ADJUSTMENT;
-        }
-
         in_begin -= c->in_prefix_size;
 
         /* Load the LRU queue and next hashes. */
@@ -3252,7 +3649,8 @@ lzx_compress_lazy(struct liblzx_compressor * restrict c,
 
                 /* Flush the block. */
                 lzx_finish_sequence(next_seq, litrunlen);
-                lzx_flush_block(c, os, in_block_begin, in_next - in_block_begin, 0);
+                lzx_flush_block(c, os, in_block_begin, in_next - in_block_begin, 0,
+                                format);
 
                 /* Keep going until we've reached the end of the input buffer. */
         } while (in_next != in_chunk_end);
@@ -3268,21 +3666,34 @@ lzx_compress_lazy(struct liblzx_compressor * restrict c,
         }
 }
 
-static void
-lzx_compress_lazy_16(struct liblzx_compressor *c, const uint8_t *in,
-                     size_t in_nchunk, size_t in_navail,
-                     struct lzx_output_bitstream *os)
-{
-        lzx_compress_lazy(c, in, in_nchunk, in_navail, os, true);
+/*
+ * Instances of the lazy compressor, one per format and matchfinder position
+ * width.
+ *
+ * Windows larger than LZX_MAX_WINDOW_SIZE are only possible in LZX DELTA.  They
+ * always use lazy parsing: the hash chains need half the memory of the binary
+ * trees, and the near-optimal parser's packed LRU queue and optimum nodes only
+ * have room for 21-bit offsets.
+ */
+#define LZX_LAZY_INSTANCE(suffix, format, is_16_bit)                          \
+static void                                                                   \
+CONCAT(lzx_compress_lazy, suffix)(struct liblzx_compressor *c,                \
+                                  const uint8_t *in,                          \
+                                  size_t in_nchunk, size_t in_navail,         \
+                                  struct lzx_output_bitstream *os)            \
+{                                                                             \
+        lzx_compress_lazy(c, in, in_nchunk, in_navail, os, format,            \
+                          is_16_bit);                                         \
 }
 
-static void
-lzx_compress_lazy_32(struct liblzx_compressor *c, const uint8_t *in,
-                     size_t in_nchunk, size_t in_navail,
-                     struct lzx_output_bitstream *os)
-{
-        lzx_compress_lazy(c, in, in_nchunk, in_navail, os, false);
-}
+LZX_LAZY_INSTANCE(_cab_16, LZX_FORMAT_CAB, true)
+LZX_LAZY_INSTANCE(_cab_32, LZX_FORMAT_CAB, false)
+LZX_LAZY_INSTANCE(_delta_16, LZX_FORMAT_DELTA, true)
+LZX_LAZY_INSTANCE(_delta_32, LZX_FORMAT_DELTA, false)
+LZX_LAZY_INSTANCE(_wim_16, LZX_FORMAT_WIM, true)
+LZX_LAZY_INSTANCE(_wim_32, LZX_FORMAT_WIM, false)
+
+#undef LZX_LAZY_INSTANCE
 
 static void
 lzx_cull_lazy_16(struct liblzx_compressor *c, size_t nbytes)
@@ -3296,47 +3707,96 @@ lzx_cull_lazy_32(struct liblzx_compressor *c, size_t nbytes)
         CALL_HC_MF(false, c, hc_matchfinder_cull, nbytes, c->window_size);
 }
 
-/******************************************************************************/
-/*                          Compressor operations                             */
-/*----------------------------------------------------------------------------*/
-
 /*
- * Generate tables for mapping match offsets (actually, "adjusted" match
- * offsets) to offset slots.
+ * Insert the first @source_size bytes of the input buffer, which hold the LZX
+ * DELTA reference data, into the hash chains so that the following data can be
+ * matched against them.
  */
-static void
-lzx_init_offset_slot_tabs(struct liblzx_compressor *c)
+static attrib_forceinline void
+lzx_prime_lazy(struct liblzx_compressor *c, uint32_t source_size,
+               const bool is_16_bit)
 {
-        uint32_t adjusted_offset = 0;
-        unsigned slot = 0;
+        const uint8_t *in_begin = c->in_buffer;
+        uint32_t next_hashes[2];
 
-        /* slots [0, 29] */
-        for (; adjusted_offset < ARRAY_LEN(c->offset_slot_tab_1);
-             adjusted_offset++)
-        {
-                if (adjusted_offset >= lzx_offset_slot_base[slot + 1] +
-                                       LZX_OFFSET_ADJUSTMENT)
-                        slot++;
-                c->offset_slot_tab_1[adjusted_offset] = slot;
-        }
+        if (source_size <= HC_MATCHFINDER_REQUIRED_NBYTES)
+                return;
 
-        /* slots [30, 49] */
-        for (; adjusted_offset < LZX_MAX_WINDOW_SIZE;
-             adjusted_offset += (uint32_t)1 << 14)
-        {
-                if (adjusted_offset >= lzx_offset_slot_base[slot + 1] +
-                                       LZX_OFFSET_ADJUSTMENT)
-                        slot++;
-                c->offset_slot_tab_2[adjusted_offset >> 14] = slot;
-        }
+        if (is_16_bit)
+                hc_matchfinder_init_hashes_16(in_begin, next_hashes);
+        else
+                hc_matchfinder_init_hashes_32(in_begin, next_hashes);
+        CALL_HC_MF(is_16_bit, c, hc_matchfinder_skip_bytes, in_begin,
+                   in_begin, in_begin + source_size,
+                   source_size - HC_MATCHFINDER_REQUIRED_NBYTES, next_hashes);
+}
+
+static void
+lzx_prime_lazy_16(struct liblzx_compressor *c, uint32_t source_size)
+{
+        lzx_prime_lazy(c, source_size, true);
+}
+
+static void
+lzx_prime_lazy_32(struct liblzx_compressor *c, uint32_t source_size)
+{
+        lzx_prime_lazy(c, source_size, false);
 }
 
+/******************************************************************************/
+/*                          Compressor operations                             */
+/*----------------------------------------------------------------------------*/
+
 static size_t
 lzx_bt_max_search_depth(unsigned compression_level)
 {
         return (24 * compression_level) / 50;
 }
 
+/*
+ * Should the near-optimal compressor use the suffix array matchfinder?  The
+ * suffix array indexes a whole chunk at once, so it's only used when chunks
+ * don't reference previous ones.
+ */
+static bool
+lzx_use_suffix_array(unsigned compression_level, bool streaming)
+{
+        return compression_level >= MIN_SUFFIX_ARRAY_LEVEL && !streaming;
+}
+
+/* Return the compression level that is used for the window size. */
+static unsigned
+lzx_get_effective_level(size_t window_size, unsigned compression_level)
+{
+        if (lzx_is_large(window_size))
+                return min_uint(compression_level, MAX_LARGE_WINDOW_LEVEL);
+        return compression_level;
+}
+
+/* Compressor instances, indexed by format and by whether the matchfinder uses
+ * 16-bit positions. */
+typedef void (*lzx_compress_func_t)(struct liblzx_compressor *, const uint8_t *,
+                                    size_t, size_t,
+                                    struct lzx_output_bitstream *);
+
+static const lzx_compress_func_t lzx_lazy_impls[LZX_NUM_FORMATS][2] = {
+        [LZX_FORMAT_CAB] = { lzx_compress_lazy_cab_32,
+                             lzx_compress_lazy_cab_16 },
+        [LZX_FORMAT_DELTA] = { lzx_compress_lazy_delta_32,
+                               lzx_compress_lazy_delta_16 },
+        [LZX_FORMAT_WIM] = { lzx_compress_lazy_wim_32,
+                             lzx_compress_lazy_wim_16 },
+};
+
+static const lzx_compress_func_t lzx_near_optimal_impls[LZX_NUM_FORMATS][2] = {
+        [LZX_FORMAT_CAB] = { lzx_compress_near_optimal_cab_32,
+                             lzx_compress_near_optimal_cab_16 },
+        [LZX_FORMAT_DELTA] = { lzx_compress_near_optimal_delta_32,
+                               lzx_compress_near_optimal_delta_16 },
+        [LZX_FORMAT_WIM] = { lzx_compress_near_optimal_wim_32,
+                             lzx_compress_near_optimal_wim_16 },
+};
+
 static size_t
 lzx_get_compressor_size(size_t window_size, unsigned compression_level,
         bool streaming)
@@ -3349,6 +3809,9 @@ lzx_get_compressor_size(size_t window_size, unsigned compression_level,
                 else
                         return offsetof(struct liblzx_compressor, hc_mf_32) +
                                hc_matchfinder_size_32(window_size, streaming);
+        } else if (lzx_use_suffix_array(compression_level, streaming)) {
+                return offsetof(struct liblzx_compressor, sa_mf) +
+                       sa_matchfinder_size(window_size);
         } else {
                 if (lzx_is_16_bit(window_size))
                         return offsetof(struct liblzx_compressor, bt_mf_16) +
@@ -3367,11 +3830,18 @@ lzx_reset(struct liblzx_compressor *c)
         c->codes_index = 0;
         memset(&c->codes[1].lens, 0, sizeof(struct lzx_lens));
 
-        /* Reset the E8 preprocessor offset */
+        /* Reset the E8 preprocessor offset, and decide again whether to use
+         * it */
         c->e8_chunk_offset = 0;
+        c->e8_enabled = (c->e8_file_size != 0);
+        c->e8_pending = (c->e8_auto && c->e8_enabled);
 
         /* Reset the streaming prefix */
         c->in_prefix_size = 0;
+        c->in_preprocessed = 0;
+
+        /* Expect the reference data again, if any */
+        c->delta_source_remaining = c->delta_source_size;
 
         /* Reset the LRU queue */
         {
@@ -3388,28 +3858,154 @@ lzx_reset(struct liblzx_compressor *c)
         c->reset(c);
 }
 
+/*
+ * Allocate a compressor structure of @alloc_size bytes, aligned to
+ * LZX_CACHE_LINE_SIZE, along with its input and output buffers.  With
+ * @aligned_alloc_func, they're allocated as one block aligned to
+ * LIBLZX_CONST_ARENA_ALIGNMENT, with the structure and its matchfinder first.
+ * Otherwise, they're three allocations, and the structure's is over-allocated
+ * to align it, since alloc_func isn't required to align that far.
+ */
+static struct liblzx_compressor *
+lzx_alloc_compressor(liblzx_alloc_func_t alloc_func,
+                     liblzx_aligned_alloc_func_t aligned_alloc_func,
+                     liblzx_free_func_t free_func, void *userdata,
+                     size_t alloc_size, uint32_t in_buffer_capacity,
+                     uint32_t out_buffer_capacity)
+{
+        void *alloc_base;
+        struct liblzx_compressor *c;
+
+        if (aligned_alloc_func) {
+                size_t in_offset = ALIGN(alloc_size, LZX_CACHE_LINE_SIZE);
+                size_t out_offset = in_offset +
+                                    ALIGN(in_buffer_capacity,
+                                          LZX_CACHE_LINE_SIZE);
+                size_t arena_size = out_offset + out_buffer_capacity;
+
+                alloc_base = aligned_alloc_func(
+                        userdata, arena_size,
+                        arena_size >= LIBLZX_CONST_ARENA_ALIGNMENT ?
+                                LIBLZX_CONST_ARENA_ALIGNMENT :
+                                LZX_CACHE_LINE_SIZE);
+                if (!alloc_base)
+                        return NULL;
+
+                c = (struct liblzx_compressor *)alloc_base;
+                c->alloc_base = alloc_base;
+                c->in_buffer = (uint8_t *)alloc_base + in_offset;
+                c->out_buffer = (uint8_t *)alloc_base + out_offset;
+                return c;
+        }
+
+        alloc_base = alloc_func(userdata,
+                                alloc_size + LZX_CACHE_LINE_SIZE - 1);
+        if (!alloc_base)
+                goto oom0;
+
+        c = (struct liblzx_compressor *)
+            ALIGN((uintptr_t)alloc_base, LZX_CACHE_LINE_SIZE);
+        c->alloc_base = alloc_base;
+
+        c->in_buffer = alloc_func(userdata, in_buffer_capacity);
+        if (!c->in_buffer)
+                goto oom1;
+
+        c->out_buffer = alloc_func(userdata, out_buffer_capacity);
+        if (!c->out_buffer)
+                goto oom2;
+
+        return c;
+
+oom2:
+        free_func(userdata, c->in_buffer);
+oom1:
+        free_func(userdata, alloc_base);
+oom0:
+        return NULL;
+}
+
+/* Free a compressor allocated with lzx_alloc_compressor(). */
+static void
+lzx_free_compressor(struct liblzx_compressor *c)
+{
+        if (!c->aligned_alloc_func) {
+                c->free_func(c->alloc_userdata, c->out_buffer);
+                c->free_func(c->alloc_userdata, c->in_buffer);
+        }
+        c->free_func(c->alloc_userdata, c->alloc_base);
+}
+
 /* Allocate an LZX compressor. */
 liblzx_compressor_t *
 liblzx_compress_create(const struct liblzx_compress_properties *props)
 {
         unsigned window_order;
+        unsigned compression_level;
+        size_t alloc_size;
+        uint32_t in_buffer_capacity;
+        uint32_t out_buffer_capacity;
         struct liblzx_compressor *c;
         bool streaming = (props->lzx_variant != LIBLZX_VARIANT_WIM);
-
-        /* Validate the maximum buffer size and get the window order from it. */
-        window_order = lzx_get_window_order(props->window_size);
+        enum lzx_format format;
+        bool is_16_bit;
+
+        /* Validate the maximum buffer size and get the window order from it.
+         * Only LZX DELTA, which shares the CAB variant, allows windows larger
+         * than LZX_MAX_WINDOW_SIZE. */
+        window_order = lzx_get_window_order(props->window_size,
+                                            streaming ?
+                                                LZX_DELTA_MAX_WINDOW_ORDER :
+                                                LZX_MAX_WINDOW_ORDER);
         if (window_order == 0)
                 return NULL;
 
-        /* Allocate the compressor. */
-        c = props->alloc_func(props->userdata,
-            lzx_get_compressor_size(props->window_size, props->compression_level, streaming));
+        STATIC_ASSERT(MAX_LARGE_WINDOW_LEVEL ==
+                      LIBLZX_CONST_MAX_LARGE_WINDOW_LEVEL);
+        compression_level = lzx_get_effective_level(props->window_size,
+                                                    props->compression_level);
+
+        /* The reference data must fit in the window. */
+        if (streaming && props->delta_source_size > props->window_size)
+                return NULL;
+
+        /* An executor needs both functions. */
+        if (props->submit_func && !props->wait_func)
+                return NULL;
+
+        /* The buffer for preprocessed data holds the window.  For streaming,
+         * pad it out to include past blocks and extra matchfinding space. */
+        in_buffer_capacity = props->window_size;
+        if (streaming) {
+                in_buffer_capacity *= 2;
+                in_buffer_capacity +=
+                    LZX_MAX_MATCH_LEN + LZX_E8_FILTER_TAIL_SIZE;
+        }
+
+        /* Leave room for chunks that don't compress.  A WIM chunk that's
+         * dropped would leave a gap in the output, so it needs the room too,
+         * and it's up to the caller to store such chunks uncompressed. */
+        out_buffer_capacity = props->chunk_granularity + 6144;
+
+        /* Allocate the compressor and its buffers. */
+        alloc_size = lzx_get_compressor_size(props->window_size,
+                                             compression_level, streaming);
+        c = lzx_alloc_compressor(props->alloc_func, props->aligned_alloc_func,
+                                 props->free_func, props->userdata,
+                                 alloc_size, in_buffer_capacity,
+                                 out_buffer_capacity);
         if (!c)
-                goto oom0;
+                return NULL;
 
+        c->alloc_size = alloc_size;
         c->alloc_func = props->alloc_func;
         c->free_func = props->free_func;
+        c->aligned_alloc_func = props->aligned_alloc_func;
         c->alloc_userdata = props->userdata;
+        c->submit_func = props->submit_func;
+        c->wait_func = props->wait_func;
+        c->executor_userdata = props->executor_userdata;
+        c->in_task = false;
         c->window_size = props->window_size;
         c->window_order = window_order;
         c->num_main_syms = lzx_get_num_main_syms(window_order);
@@ -3420,56 +4016,53 @@ liblzx_compress_create(const struct liblzx_compress_properties *props)
         c->flushing = false;
         c->e8_chunk_offset = 0;
         c->e8_file_size = props->e8_file_size;
-        c->in_buffer_capacity = c->window_size;
+        c->in_buffer_capacity = in_buffer_capacity;
+        c->out_buffer_capacity = out_buffer_capacity;
+        c->out_chunk.data = c->out_buffer;
         c->in_prefix_size = 0;
         c->in_used = 0;
+        c->in_preprocessed = 0;
         c->chunk_size = props->chunk_granularity;
+        c->delta_source_size = 0;
+        if (streaming)
+                c->delta_source_size = (uint32_t)props->delta_source_size;
 
-        /* Allocate the buffer for preprocessed data if needed. */
-        if (streaming) {
-                /* Pad out to include past blocks and extra
-                 * matchfinding space  */
-                c->in_buffer_capacity *= 2;
-                c->in_buffer_capacity +=
-                    LZX_MAX_MATCH_LEN + LZX_E8_FILTER_TAIL_SIZE;
-        }
+        /* Reference data or a large window means the stream is LZX DELTA,
+         * which needs extended lengths after maximum length matches. */
+        c->extended_lengths = (c->delta_source_size > 0 ||
+                               lzx_is_large(c->window_size));
 
         if (c->variant == LIBLZX_VARIANT_WIM)
-                c->e8_file_size = LZX_WIM_MAGIC_FILESIZE;
-
-        c->in_buffer =
-            props->alloc_func(props->userdata, c->in_buffer_capacity);
-
-        if (!c->in_buffer)
-                goto oom1;
-
-        c->out_buffer_capacity = c->chunk_size;
-        if (c->variant != LIBLZX_VARIANT_WIM)
-                c->out_buffer_capacity += 6144;
-
-        c->out_chunk.data = c->out_buffer =
-            props->alloc_func(props->userdata, c->out_buffer_capacity);
+                format = LZX_FORMAT_WIM;
+        else if (c->extended_lengths)
+                format = LZX_FORMAT_DELTA;
+        else
+                format = LZX_FORMAT_CAB;
+        is_16_bit = lzx_is_16_bit(c->window_size);
 
-        if (!c->out_buffer)
-                goto oom2;
+        if (c->variant == LIBLZX_VARIANT_WIM)
+                c->e8_file_size = LZX_WIM_MAGIC_FILESIZE;
+        c->e8_auto = (props->auto_e8 && c->variant != LIBLZX_VARIANT_WIM);
 
-        if (props->compression_level <= MAX_FAST_LEVEL) {
+        if (compression_level <= MAX_FAST_LEVEL) {
 
-                /* Fast compression: Use lazy parsing. */
-                if (lzx_is_16_bit(props->window_size)) {
+                /* Fast compression or large window: Use lazy parsing. */
+                if (is_16_bit) {
                         c->reset = lzx_reset_lazy_16;
-                        c->impl = lzx_compress_lazy_16;
                         c->cull = lzx_cull_lazy_16;
+                        c->prime = lzx_prime_lazy_16;
                 } else {
                         c->reset = lzx_reset_lazy_32;
-                        c->impl = lzx_compress_lazy_32;
                         c->cull = lzx_cull_lazy_32;
+                        c->prime = lzx_prime_lazy_32;
                 }
 
+                c->impl = lzx_lazy_impls[format][is_16_bit];
+
                 /* Scale max_search_depth and nice_match_length with the
                  * compression level. */
-                c->max_search_depth = (60 * props->compression_level) / 20;
-                c->nice_match_length = (80 * props->compression_level) / 20;
+                c->max_search_depth = (60 * compression_level) / 20;
+                c->nice_match_length = (80 * compression_level) / 20;
 
                 /* lzx_compress_lazy() needs max_search_depth >= 2 because it
                  * halves the max_search_depth when attempting a lazy match, and
@@ -3478,49 +4071,139 @@ liblzx_compress_create(const struct liblzx_compress_properties *props)
         } else {
 
                 /* Normal / high compression: Use near-optimal parsing. */
-                if (lzx_is_16_bit(c->window_size)) {
+                if (lzx_use_suffix_array(compression_level,
+                                         streaming)) {
+                        c->reset = lzx_reset_near_optimal_sa;
+                        c->impl = is_16_bit ?
+                                  lzx_compress_near_optimal_sa_wim_16 :
+                                  lzx_compress_near_optimal_sa_wim_32;
+                        c->cull = lzx_cull_near_optimal_sa;
+                        c->prime = lzx_prime_near_optimal_sa;
+                } else if (is_16_bit) {
                         c->reset = lzx_reset_near_optimal_16;
-                        c->impl = lzx_compress_near_optimal_16;
+                        c->impl = lzx_near_optimal_impls[format][1];
                         c->cull = lzx_cull_near_optimal_16;
+                        c->prime = lzx_prime_near_optimal_16;
                 } else {
                         c->reset = lzx_reset_near_optimal_32;
-                        c->impl = lzx_compress_near_optimal_32;
+                        c->impl = lzx_near_optimal_impls[format][0];
                         c->cull = lzx_cull_near_optimal_32;
+                        c->prime = lzx_prime_near_optimal_32;
                 }
 
                 /* Scale max_search_depth and nice_match_length with the
                  * compression level. */
-                c->max_search_depth = lzx_bt_max_search_depth(props->compression_level);
-                c->nice_match_length = (48 * props->compression_level) / 50;
+                c->max_search_depth = lzx_bt_max_search_depth(compression_level);
+                c->nice_match_length = (48 * compression_level) / 50;
 
                 /* Also scale num_optim_passes with the compression level.  But
                  * the more passes there are, the less they help --- so don't
                  * add them linearly.  */
                 c->num_optim_passes = 1;
-                c->num_optim_passes += (props->compression_level >= 45);
-                c->num_optim_passes += (props->compression_level >= 70);
-                c->num_optim_passes += (props->compression_level >= 100);
-                c->num_optim_passes += (props->compression_level >= 150);
-                c->num_optim_passes += (props->compression_level >= 200);
-                c->num_optim_passes += (props->compression_level >= 300);
+                c->num_optim_passes += (compression_level >= 45);
+                c->num_optim_passes += (compression_level >= 70);
+                c->num_optim_passes += (compression_level >= 100);
+                c->num_optim_passes += (compression_level >= 150);
+                c->num_optim_passes += (compression_level >= 200);
+                c->num_optim_passes += (compression_level >= 300);
 
                 /* max_search_depth must be at least 1. */
                 c->max_search_depth = max_uint(c->max_search_depth, 1);
         }
 
-        /* Prepare the offset => offset slot mapping. */
-        lzx_init_offset_slot_tabs(c);
-
         lzx_reset(c);
 
         return c;
+}
 
-oom2:
-        props->free_func(props->userdata, c->in_buffer);
-oom1:
-        props->free_func(props->userdata, c);
-oom0:
-        return NULL;
+/*
+ * Guess whether the start of a stream is x86 machine code.  In code, most E8
+ * bytes are CALL instructions whose target is in the file, so the relative
+ * offset that follows is small, with a top byte of 0x00 or 0xFF, and doesn't
+ * point outside of the file.  In other data, the bytes after E8 are arbitrary.
+ */
+static bool
+lzx_looks_like_x86(const uint8_t *data, uint32_t size, uint32_t e8_file_size)
+{
+        const uint8_t *p = data;
+        const uint8_t *tail;
+        uint32_t num_e8 = 0;
+        uint32_t num_calls = 0;
+
+        if (size <= LZX_E8_FILTER_TAIL_SIZE)
+                return false;
+
+        tail = &data[size - LZX_E8_FILTER_TAIL_SIZE];
+        while ((p = memchr(p, 0xE8, tail - p)) != NULL) {
+                int32_t rel_offset = (int32_t)get_unaligned_le32(p + 1);
+                int32_t input_pos = (int32_t)(p - data);
+
+                num_e8++;
+                if ((rel_offset >> 24 == 0 || rel_offset >> 24 == -1) &&
+                    rel_offset >= -input_pos &&
+                    rel_offset < (int32_t)e8_file_size - input_pos) {
+                        num_calls++;
+                        p += 5;
+                } else {
+                        p++;
+                }
+                if (p >= tail)
+                        break;
+        }
+
+        return num_calls * E8_DETECT_MIN_CALL_RATIO >= num_e8 &&
+               num_calls >= 1 + size / E8_DETECT_BYTES_PER_CALL;
+}
+
+/*
+ * E8-preprocess the pending input as far as it can be done before more input
+ * is added.  Each chunk is translated on its own, and calls that start in its
+ * last 10 bytes aren't translated, so this stops 10 bytes before the end of the
+ * input if the chunk isn't complete.  That's also where the translation of the
+ * last chunk stops if it turns out to be shorter, so no byte is ever translated
+ * twice or undone.
+ */
+static void
+lzx_preprocess_input(struct liblzx_compressor *c)
+{
+        uint8_t *in = (uint8_t *)c->in_buffer + c->in_prefix_size;
+        uint32_t pos = c->in_preprocessed;
+
+        if (c->e8_pending) {
+                /* Decide from the first chunk, or from all the input if it's
+                 * shorter */
+                if (c->in_used < c->chunk_size && !c->flushing)
+                        return;
+                c->e8_enabled = lzx_looks_like_x86(in,
+                                                   min_u32(c->in_used,
+                                                           c->chunk_size),
+                                                   c->e8_file_size);
+                c->e8_pending = false;
+        }
+
+        if (!c->e8_enabled) {
+                c->in_preprocessed = c->in_used;
+                return;
+        }
+
+        for (;;) {
+                uint32_t chunk_end = pos - pos % c->chunk_size + c->chunk_size;
+                uint32_t end = min_u32(chunk_end, c->in_used);
+
+                if (c->e8_chunk_offset + (pos - pos % c->chunk_size) >=
+                    0x40000000)
+                        pos = end;
+                else if (end - pos > LZX_E8_FILTER_TAIL_SIZE)
+                        pos += lzx_preprocess(in + pos, end - pos,
+                                              c->e8_chunk_offset + pos,
+                                              c->e8_file_size);
+
+                if (end != chunk_end)
+                        break;
+                pos = chunk_end;
+        }
+
+        c->in_preprocessed = pos;
 }
 
 /* Compress a buffer of data. */
@@ -3529,33 +4212,14 @@ lzx_compress_chunk(struct liblzx_compressor *c)
 {
         struct lzx_output_bitstream os;
         size_t result;
-        bool e8_preprocess_enabled = (c->e8_chunk_offset < 0x40000000);
-        bool next_e8_preprocess_enabled =
-            (c->e8_chunk_offset + c->chunk_size < 0x40000000);
         uint32_t chunk_size = min_u32(c->chunk_size, c->in_used);
-        uint32_t next_chunk_preprocess_size = 0;
 
         uint8_t *in = (uint8_t *)c->in_buffer + c->in_prefix_size;
 
-        /* Preprocess the input data. */
-        if (e8_preprocess_enabled) {
-                lzx_preprocess(in, chunk_size, c->e8_chunk_offset,
-                               c->e8_file_size);
-        }
-
-        if (c->in_used > c->chunk_size && next_e8_preprocess_enabled) {
-                next_chunk_preprocess_size =
-                    min_u32(LZX_MAX_MATCH_LEN + LZX_E8_FILTER_TAIL_SIZE,
-                            c->in_used - c->chunk_size);
-        }
-
-        /* Preprocess enough of the next block input data for the
-           matchfinder */
-        if (next_chunk_preprocess_size > 0) {
-                lzx_preprocess(in + c->chunk_size, next_chunk_preprocess_size,
-                               c->e8_chunk_offset + c->chunk_size,
-                               c->e8_file_size);
-        }
+        /* The chunk and the start of the next one were preprocessed as the
+         * input was added, unless the input ended before E8 preprocessing
+         * was decided. */
+        lzx_preprocess_input(c);
 
         /* Initialize the output bitstream. */
         lzx_init_output(&os, c->out_buffer, c->out_buffer_capacity);
@@ -3563,22 +4227,24 @@ lzx_compress_chunk(struct liblzx_compressor *c)
         /* Call the compression level-specific compress() function. */
         (*c->impl)(c, in, chunk_size, c->in_used, &os);
 
-        /* Undo next block preprocessing */
-        if (next_chunk_preprocess_size > 0) {
-                lzx_postprocess(in + c->chunk_size, next_chunk_preprocess_size,
-                               c->e8_chunk_offset + c->chunk_size,
-                               c->e8_file_size);
-        }
-
         /* Flush the output bitstream. */
         result = lzx_flush_output(&os);
 
+        /* In WIM, each chunk is compressed as a stream of its own, so start
+         * over.  There's no lookahead, so the input buffer is now empty. */
+        if (c->variant == LIBLZX_VARIANT_WIM) {
+                c->in_used -= chunk_size;
+                lzx_reset(c);
+                return result;
+        }
+
         /* Update the E8 chunk offset. */
         c->e8_chunk_offset += (uint32_t)chunk_size;
 
         /* Update the prefix and used amounts. */
         c->in_prefix_size += (uint32_t)chunk_size;
         c->in_used -= chunk_size;
+        c->in_preprocessed -= min_u32(c->in_preprocessed, chunk_size);
 
         if (c->in_prefix_size >= c->window_size * 2) {
                 uint32_t cull_amount = (c->in_prefix_size - c->window_size);
@@ -3597,39 +4263,257 @@ lzx_compress_chunk(struct liblzx_compressor *c)
         return result;
 }
 
+void
+liblzx_compress_reset(liblzx_compressor_t *c)
+{
+        c->first_block = true;
+        c->out_chunk.size = 0;
+        c->flushing = false;
+        c->in_used = 0;
+
+        lzx_reset(c);
+}
+
+uint32_t
+liblzx_compress_get_e8_file_size(const liblzx_compressor_t *c)
+{
+        return c->e8_enabled ? c->e8_file_size : 0;
+}
+
 void
 liblzx_compress_destroy(liblzx_compressor_t *c)
 {
-        c->free_func(c->alloc_userdata, c->out_buffer);
-        c->free_func(c->alloc_userdata, c->in_buffer);
-        c->free_func(c->alloc_userdata, c);
+        lzx_free_compressor(c);
 }
 
-size_t
-liblzx_compress_add_input(liblzx_compressor_t *c, const void *in_data,
-                          size_t in_data_size)
+/*
+ * Copy the live portions of the input and output buffers of 'src' into those
+ * of 'dst'.  The compressor structures themselves must already be identical
+ * apart from the buffer pointers.
+ */
+static void
+lzx_copy_buffers(struct liblzx_compressor *dst,
+                 const struct liblzx_compressor *src)
+{
+        /* Only the window prefix and the pending input are meaningful; the
+         * rest of in_buffer is rewritten before it is read again. */
+        memcpy(dst->in_buffer, src->in_buffer,
+               src->in_prefix_size + src->in_used);
+        memcpy(dst->out_buffer, src->out_buffer, src->out_chunk.size);
+        dst->out_chunk.data = dst->out_buffer;
+}
+
+liblzx_compressor_t *
+liblzx_compress_clone(const liblzx_compressor_t *c)
+{
+        struct liblzx_compressor *clone;
+        void *alloc_base;
+        void *in_buffer;
+        void *out_buffer;
+
+        clone = lzx_alloc_compressor(c->alloc_func, c->aligned_alloc_func,
+                                     c->free_func, c->alloc_userdata,
+                                     c->alloc_size, c->in_buffer_capacity,
+                                     c->out_buffer_capacity);
+        if (!clone)
+                return NULL;
+
+        /* This copies the window position, matchfinder tables, LRU queue,
+         * previous block's codes and E8 offset in one go. */
+        alloc_base = clone->alloc_base;
+        in_buffer = clone->in_buffer;
+        out_buffer = clone->out_buffer;
+        memcpy(clone, c, c->alloc_size);
+        clone->alloc_base = alloc_base;
+        clone->in_buffer = in_buffer;
+        clone->out_buffer = out_buffer;
+
+        lzx_copy_buffers(clone, c);
+
+        return clone;
+}
+
+enum liblzx_error
+liblzx_compress_restore(liblzx_compressor_t *c,
+                        const liblzx_compressor_t *snapshot)
+{
+        void *alloc_base = c->alloc_base;
+        void *in_buffer = c->in_buffer;
+        void *out_buffer = c->out_buffer;
+        liblzx_alloc_func_t alloc_func = c->alloc_func;
+        liblzx_free_func_t free_func = c->free_func;
+        liblzx_aligned_alloc_func_t aligned_alloc_func = c->aligned_alloc_func;
+        void *alloc_userdata = c->alloc_userdata;
+        liblzx_submit_func_t submit_func = c->submit_func;
+        liblzx_wait_func_t wait_func = c->wait_func;
+        void *executor_userdata = c->executor_userdata;
+
+        if (c == snapshot)
+                return LIBLZX_ERR_NONE;
+
+        /* The snapshot must have been created with the same properties, so
+         * that the structure, matchfinder and buffers have the same layout. */
+        if (c->alloc_size != snapshot->alloc_size ||
+            c->in_buffer_capacity != snapshot->in_buffer_capacity ||
+            c->out_buffer_capacity != snapshot->out_buffer_capacity ||
+            c->impl != snapshot->impl)
+                return LIBLZX_ERR_INVALID_PARAM;
+
+        memcpy(c, snapshot, snapshot->alloc_size);
+
+        c->alloc_base = alloc_base;
+        c->in_buffer = in_buffer;
+        c->out_buffer = out_buffer;
+        c->alloc_func = alloc_func;
+        c->free_func = free_func;
+        c->aligned_alloc_func = aligned_alloc_func;
+        c->alloc_userdata = alloc_userdata;
+        c->submit_func = submit_func;
+        c->wait_func = wait_func;
+        c->executor_userdata = executor_userdata;
+
+        lzx_copy_buffers(c, snapshot);
+
+        return LIBLZX_ERR_NONE;
+}
+
+/*
+ * Add LZX DELTA reference data to the window.  The reference data is placed
+ * ahead of the data to compress, where it's visible to the matchfinder but is
+ * never output and isn't E8-preprocessed, matching what the decompressor has in
+ * its window.
+ */
+static size_t
+lzx_add_delta_source(struct liblzx_compressor *c, const void *in_data,
+                     size_t in_data_size)
+{
+        size_t fill_amount = min_size(in_data_size, c->delta_source_remaining);
+
+        memcpy((uint8_t *)c->in_buffer + c->in_prefix_size, in_data,
+               fill_amount);
+
+        c->in_prefix_size += (uint32_t)fill_amount;
+        c->delta_source_remaining -= (uint32_t)fill_amount;
+
+        /* Once all of it is present, run it through the matchfinder. */
+        if (c->delta_source_remaining == 0)
+                (*c->prime)(c, c->in_prefix_size);
+
+        return fill_amount;
+}
+
+/*
+ * Copy input data into the input buffer and return the number of bytes
+ * digested.  Returns true in *chunk_full if there's now a complete chunk to
+ * compress.
+ */
+static size_t
+lzx_add_input(struct liblzx_compressor *c, const void *in_data,
+              size_t in_data_size, bool *chunk_full)
 {
         uint32_t max_used = 0;
+        size_t source_amount = 0;
         size_t fill_amount = 0;
+        size_t copied, piece_size;
 
+        *chunk_full = false;
         if (c->out_chunk.size > 0 || c->flushing)
                 return 0;
 
-        max_used = min_uint(c->in_buffer_capacity - c->in_prefix_size,
-                            c->chunk_size + LZX_MAX_MATCH_LEN +
-                                LZX_E8_FILTER_TAIL_SIZE);
+        if (c->delta_source_remaining > 0) {
+                source_amount = lzx_add_delta_source(c, in_data, in_data_size);
+                in_data = (const uint8_t *)in_data + source_amount;
+                in_data_size -= source_amount;
+        }
+
+        /* Matches in a streaming chunk can extend into the next one, and the
+         * E8 filter needs to see its start.  WIM chunks stand alone. */
+        if (c->variant == LIBLZX_VARIANT_WIM)
+                max_used = min_uint(c->in_buffer_capacity, c->chunk_size);
+        else
+                max_used = min_uint(c->in_buffer_capacity - c->in_prefix_size,
+                                    c->chunk_size + LZX_MAX_MATCH_LEN +
+                                        LZX_E8_FILTER_TAIL_SIZE);
         fill_amount = min_size(in_data_size, max_used - c->in_used);
 
-        memcpy(((uint8_t *)c->in_buffer) + c->in_prefix_size + c->in_used, in_data,
-               fill_amount);
+        /* Preprocess the input as it's copied, a piece at a time so that it's
+         * still in the cache. */
+        for (copied = 0; copied < fill_amount; copied += piece_size) {
+                piece_size = min_size(fill_amount - copied,
+                                      LZX_PREPROCESS_PIECE_SIZE);
+                memcpy((uint8_t *)c->in_buffer + c->in_prefix_size + c->in_used,
+                       (const uint8_t *)in_data + copied, piece_size);
+                c->in_used += (uint32_t)piece_size;
+                lzx_preprocess_input(c);
+        }
 
-        c->in_used += fill_amount;
+        *chunk_full = (c->in_used == max_used);
+
+        return source_amount + fill_amount;
+}
 
-        if (c->in_used == max_used) {
+size_t
+liblzx_compress_add_input(liblzx_compressor_t *c, const void *in_data,
+                          size_t in_data_size)
+{
+        bool chunk_full;
+        size_t digested = lzx_add_input(c, in_data, in_data_size, &chunk_full);
+
+        if (chunk_full) {
                 c->out_chunk.size = lzx_compress_chunk(c);
         }
 
-        return fill_amount;
+        return digested;
+}
+
+/* Compress the chunk of a compressor. */
+static void
+lzx_compress_chunk_task(void *arg)
+{
+        struct liblzx_compressor *c = arg;
+
+        c->out_chunk.size = lzx_compress_chunk(c);
+        c->in_task = false;
+}
+
+/* Compress the chunk of @c on the executor of @executor, or right away if it
+ * has none.  Returns true if a task was submitted. */
+static bool
+lzx_start_chunk_task(const struct liblzx_compressor *executor,
+                     struct liblzx_compressor *c)
+{
+        if (!executor->submit_func) {
+                lzx_compress_chunk_task(c);
+                return false;
+        }
+        c->in_task = true;
+        executor->submit_func(executor->executor_userdata,
+                              lzx_compress_chunk_task, c);
+        return true;
+}
+
+void
+liblzx_compress_add_input_multi(liblzx_compressor_t *const *streams,
+                                const void *const *in_data,
+                                const size_t *in_data_size,
+                                size_t *in_data_digested, size_t num_streams)
+{
+        bool submitted = false;
+        size_t i;
+
+        for (i = 0; i < num_streams; i++) {
+                struct liblzx_compressor *c = streams[i];
+                bool chunk_full;
+
+                in_data_digested[i] = lzx_add_input(c, in_data[i],
+                                                    in_data_size[i],
+                                                    &chunk_full);
+                if (chunk_full)
+                        submitted |= lzx_start_chunk_task(streams[0], c);
+        }
+
+        if (submitted)
+                streams[0]->wait_func(streams[0]->executor_userdata);
 }
 
 const liblzx_output_chunk_t *
@@ -21,6 +21,11 @@
 #define LZX_NUM_PRIMARY_LENS            7
 #define LZX_NUM_LEN_HEADERS             (LZX_NUM_PRIMARY_LENS + 1)
 
+/* In LZX DELTA, a match of length LZX_MAX_MATCH_LEN is followed by an
+ * extended length.  Its shortest form is a 0 bit followed by 8 bits giving the
+ * number of additional bytes.  */
+#define LZX_DELTA_SHORT_EXTENDED_LEN_BITS       9
+
 /* The first length which requires a length symbol.  */
 #define LZX_MIN_SECONDARY_LEN           (LZX_MIN_MATCH_LEN + LZX_NUM_PRIMARY_LENS)
 
@@ -36,14 +41,21 @@
 #define LZX_MIN_WINDOW_SIZE             (1UL << LZX_MIN_WINDOW_ORDER)  /* 32768   */
 #define LZX_MAX_WINDOW_SIZE             (1UL << LZX_MAX_WINDOW_ORDER)  /* 2097152 */
 
+/* LZX DELTA allows larger windows than CAB LZX.  */
+#define LZX_DELTA_MAX_WINDOW_ORDER      25
+#define LZX_DELTA_MAX_WINDOW_SIZE       (1UL << LZX_DELTA_MAX_WINDOW_ORDER) /* 33554432 */
+
 /* Maximum number of offset slots.  (The actual number of offset slots depends
  * on the window size.)  */
 #define LZX_MAX_OFFSET_SLOTS            50
+#define LZX_DELTA_MAX_OFFSET_SLOTS      290
 
 /* Maximum number of symbols in the main code.  (The actual number of symbols in
  * the main code depends on the window size.)  */
 #define LZX_MAINCODE_MAX_NUM_SYMBOLS        \
         (LZX_NUM_CHARS + (LZX_MAX_OFFSET_SLOTS * LZX_NUM_LEN_HEADERS))
+#define LZX_DELTA_MAINCODE_MAX_NUM_SYMBOLS        \
+        (LZX_NUM_CHARS + (LZX_DELTA_MAX_OFFSET_SLOTS * LZX_NUM_LEN_HEADERS))
 
 /* Number of symbols in the length code.  */
 #define LZX_LENCODE_NUM_SYMBOLS         (LZX_NUM_LENS - LZX_NUM_PRIMARY_LENS)
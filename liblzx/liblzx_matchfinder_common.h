@@ -78,6 +78,20 @@ lz_hash(uint32_t seq, unsigned num_bits)
         return (uint32_t)(seq * 0x1E35A7BD) >> (32 - num_bits);
 }
 
+/*
+ * Like lz_hash(), but also return the product bits just below the hash value in
+ * the bits of @tag_mask, which must not overlap the low @num_bits bits.  Two
+ * sequences with different tags are different, so a matchfinder that stores
+ * the tag alongside each position can reject a candidate without loading it.
+ */
+static attrib_forceinline uint32_t
+lz_hash_tagged(uint32_t seq, unsigned num_bits, uint32_t tag_mask)
+{
+        uint32_t product = (uint32_t)(seq * 0x1E35A7BD);
+
+        return (product >> (32 - num_bits)) | ((product << num_bits) & tag_mask);
+}
+
 /*
  * Return the number of bytes at @matchptr that match the bytes at @strptr, up
  * to a maximum of @max_len.  Initially, @start_len bytes are matched.
@@ -0,0 +1,676 @@
+/*
+ * sa_matchfinder.h - Lempel-Ziv matchfinding with a suffix array
+ *
+ * Copyright (C) 2025 Eric Lasota
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * This is a matchfinder based on a suffix array (sa).
+ *
+ * Unlike the hash chains and binary trees matchfinders, which are built up
+ * incrementally while the input buffer is processed, this matchfinder indexes
+ * the whole buffer up front.  It sorts all suffixes of the buffer with the
+ * SA-IS algorithm, computes the longest common prefix (LCP) between each pair
+ * of adjacent suffixes, then uses the LCP array to build the tree of "LCP
+ * intervals": each node is a range of the suffix array whose suffixes share a
+ * prefix of the node's length, and its parent is the smallest enclosing range
+ * with a shorter shared prefix.  Each position's leaf hangs off the deepest
+ * interval containing it.
+ *
+ * The buffer is then processed sequentially.  Each node remembers the most
+ * recent position visited below it.  At each position, walking from its leaf
+ * to the root visits one node per distinct match length, and the position
+ * remembered by each node is the closest previous occurrence of that prefix.
+ * This yields exactly the matches that a binary trees matchfinder with
+ * unlimited search depth would return: the smallest offset for each distinct
+ * length.  The walk also replaces each node's position with the current one.
+ *
+ * Lengths are capped at the caller's maximum match length, which bounds the
+ * depth of the tree and therefore the work at each position, no matter how
+ * repetitive the data is.
+ *
+ * The index is built over a fixed buffer, so this matchfinder is only suitable
+ * when each buffer is compressed independently.  It needs about 12 bytes of
+ * memory per byte of buffer.
+ *
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef _LIBLZX_SA_MATCHFINDER_H
+#define _LIBLZX_SA_MATCHFINDER_H
+
+#include "liblzx_minmax.h"
+#include "liblzx_types.h"
+
+/* Note: 'struct lz_match' is defined by bt_matchfinder.h, which must be
+ * included first. */
+
+/* The number of bits used for the parent node index of a node; the match
+ * length takes the remaining high bits.  */
+#define SA_MATCHFINDER_NODE_BITS        23
+#define SA_MATCHFINDER_NODE_MASK        (((uint32_t)1 << SA_MATCHFINDER_NODE_BITS) - 1)
+
+/* The largest buffer that can be indexed, and the largest match length.  */
+#define SA_MATCHFINDER_MAX_BUFSIZE      ((size_t)1 << SA_MATCHFINDER_NODE_BITS)
+#define SA_MATCHFINDER_MAX_LEN          ((1U << (32 - SA_MATCHFINDER_NODE_BITS)) - 1)
+
+/* Matches shorter than this are never reported.  */
+#define SA_MATCHFINDER_MIN_LEN          2
+
+/* Scratch space beyond the three per-position arrays for suffix sorting of
+ * small buffers, in 32-bit words.  */
+#define SA_MATCHFINDER_PAD              1024
+
+#define SA_MATCHFINDER_INVALID_POS      0xFFFFFFFF
+
+struct sa_matchfinder {
+
+        /* The maximum buffer size this matchfinder was sized for  */
+        uint32_t capacity;
+
+        /*
+         * Three arrays of 'capacity + 1' entries each, followed by
+         * SA_MATCHFINDER_PAD words of scratch space:
+         *
+         * - The most recent position visited below each node, indexed by
+         *   node.  Holds the suffix array while the index is built.
+         *
+         * - The index of the deepest node containing each position, indexed
+         *   by position.  Holds the LCP array while the index is built.
+         *
+         * - Each node's match length and parent node index, indexed by node.
+         *   Node 0 is the root.
+         */
+        uint32_t storage[];
+};
+
+static attrib_forceinline uint32_t *
+sa_matchfinder_last_pos(struct sa_matchfinder *mf)
+{
+        return &mf->storage[0];
+}
+
+static attrib_forceinline uint32_t *
+sa_matchfinder_leaf_nodes(struct sa_matchfinder *mf)
+{
+        return &mf->storage[(size_t)mf->capacity + 1];
+}
+
+static attrib_forceinline uint32_t *
+sa_matchfinder_nodes(struct sa_matchfinder *mf)
+{
+        return &mf->storage[((size_t)mf->capacity + 1) * 2];
+}
+
+/* Return the number of bytes that must be allocated for a 'sa_matchfinder' that
+ * can work with buffers up to the specified size.  */
+static attrib_forceinline size_t
+sa_matchfinder_size(size_t max_bufsize)
+{
+        return sizeof(struct sa_matchfinder) +
+               ((max_bufsize + 1) * 3 + SA_MATCHFINDER_PAD) * sizeof(uint32_t);
+}
+
+/* Prepare the matchfinder for buffers up to the specified size.  */
+static attrib_forceinline void
+sa_matchfinder_init(struct sa_matchfinder *mf, size_t max_bufsize)
+{
+        mf->capacity = (uint32_t)max_bufsize;
+}
+
+/*
+ * Suffix sorting with SA-IS, from G. Nong, S. Zhang and W. H. Chan, "Two
+ * Efficient Algorithms for Linear Time Suffix Array Construction".
+ *
+ * The string @s has @n characters with values in [0, @k] and must end with a
+ * unique smallest character.  The top level sorts bytes (@cs == 1) followed by
+ * a virtual terminator, so its characters are the byte values plus one.  The
+ * recursive levels sort 32-bit names (@cs == 4).
+ *
+ * @t must have room for the type flags of this level and of all deeper levels,
+ * n / 8 + 1 bytes per level, and @bkt must have room for k + 1 entries for the
+ * largest k of any level.
+ *
+ * @cs should be a compile-time constant.
+ */
+#define SAIS_CHR(i)                                                           \
+        (cs == 1 ? ((i) == n - 1 ? 0 : (int32_t)((const uint8_t *)s)[i] + 1) \
+                 : ((const int32_t *)s)[i])
+#define SAIS_TGET(i)            ((t[(i) >> 3] >> ((i) & 7)) & 1)
+#define SAIS_TSET(i, b)                                                       \
+        (t[(i) >> 3] = (uint8_t)((t[(i) >> 3] & ~(1 << ((i) & 7))) |         \
+                                 ((b) << ((i) & 7))))
+#define SAIS_IS_LMS(i)          ((i) > 0 && SAIS_TGET(i) && !SAIS_TGET((i) - 1))
+
+static attrib_forceinline void
+sais_get_buckets(const void *s, int32_t n, int32_t k, int cs, int32_t *bkt,
+                 bool end)
+{
+        int32_t i, sum = 0;
+
+        for (i = 0; i <= k; i++)
+                bkt[i] = 0;
+        for (i = 0; i < n; i++)
+                bkt[SAIS_CHR(i)]++;
+        for (i = 0; i <= k; i++) {
+                sum += bkt[i];
+                bkt[i] = end ? sum : sum - bkt[i];
+        }
+}
+
+static attrib_forceinline void
+sais_induce(const void *s, int32_t *sa, int32_t n, int32_t k, int cs,
+            const uint8_t *t, int32_t *bkt)
+{
+        int32_t i, j;
+
+        /* Place the L-type suffixes, left to right from the bucket heads. */
+        sais_get_buckets(s, n, k, cs, bkt, false);
+        for (i = 0; i < n; i++) {
+                j = sa[i] - 1;
+                if (j >= 0 && !SAIS_TGET(j))
+                        sa[bkt[SAIS_CHR(j)]++] = j;
+        }
+
+        /* Place the S-type suffixes, right to left from the bucket tails. */
+        sais_get_buckets(s, n, k, cs, bkt, true);
+        for (i = n - 1; i >= 0; i--) {
+                j = sa[i] - 1;
+                if (j >= 0 && SAIS_TGET(j))
+                        sa[--bkt[SAIS_CHR(j)]] = j;
+        }
+}
+
+static void
+sais_32(const int32_t *s, int32_t *sa, int32_t n, int32_t k, uint8_t *t,
+        int32_t *bkt);
+
+static attrib_forceinline void
+sais(const void *s, int32_t *sa, int32_t n, int32_t k, int cs, uint8_t *t,
+     int32_t *bkt)
+{
+        int32_t *s1;
+        int32_t n1, name, prev;
+        int32_t i, j;
+
+        /* Classify each suffix as S-type (1) or L-type (0). */
+        SAIS_TSET(n - 2, 0);
+        SAIS_TSET(n - 1, 1);
+        for (i = n - 3; i >= 0; i--) {
+                int32_t c0 = SAIS_CHR(i);
+                int32_t c1 = SAIS_CHR(i + 1);
+
+                SAIS_TSET(i, (c0 < c1 || (c0 == c1 && SAIS_TGET(i + 1))));
+        }
+
+        /* Sort the LMS substrings by inducing from their unsorted starts. */
+        sais_get_buckets(s, n, k, cs, bkt, true);
+        for (i = 0; i < n; i++)
+                sa[i] = -1;
+        for (i = 1; i < n; i++) {
+                if (SAIS_IS_LMS(i))
+                        sa[--bkt[SAIS_CHR(i)]] = i;
+        }
+        sais_induce(s, sa, n, k, cs, t, bkt);
+
+        /* Gather the sorted LMS substrings at the front. */
+        n1 = 0;
+        for (i = 0; i < n; i++) {
+                if (SAIS_IS_LMS(sa[i]))
+                        sa[n1++] = sa[i];
+        }
+
+        /* Name the LMS substrings in sorted order.  LMS positions are at
+         * least two apart, so position / 2 identifies each one. */
+        for (i = n1; i < n; i++)
+                sa[i] = -1;
+        name = 0;
+        prev = -1;
+        for (i = 0; i < n1; i++) {
+                int32_t pos = sa[i];
+                bool diff = false;
+                int32_t d;
+
+                for (d = 0; d < n; d++) {
+                        if (prev == -1 ||
+                            SAIS_CHR(pos + d) != SAIS_CHR(prev + d) ||
+                            SAIS_TGET(pos + d) != SAIS_TGET(prev + d)) {
+                                diff = true;
+                                break;
+                        } else if (d > 0 && (SAIS_IS_LMS(pos + d) ||
+                                             SAIS_IS_LMS(prev + d))) {
+                                break;
+                        }
+                }
+                if (diff) {
+                        name++;
+                        prev = pos;
+                }
+                sa[n1 + pos / 2] = name - 1;
+        }
+        for (i = n - 1, j = n - 1; i >= n1; i--) {
+                if (sa[i] >= 0)
+                        sa[j--] = sa[i];
+        }
+
+        /* Sort the reduced string of names, recursing unless they're all
+         * distinct. */
+        s1 = sa + n - n1;
+        if (name < n1) {
+                sais_32(s1, sa, n1, name - 1, t + (n >> 3) + 1, bkt);
+        } else {
+                for (i = 0; i < n1; i++)
+                        sa[s1[i]] = i;
+        }
+
+        /* Induce the full suffix array from the sorted LMS suffixes. */
+        sais_get_buckets(s, n, k, cs, bkt, true);
+        for (i = 1, j = 0; i < n; i++) {
+                if (SAIS_IS_LMS(i))
+                        s1[j++] = i;
+        }
+        for (i = 0; i < n1; i++)
+                sa[i] = s1[sa[i]];
+        for (i = n1; i < n; i++)
+                sa[i] = -1;
+        for (i = n1 - 1; i >= 0; i--) {
+                j = sa[i];
+                sa[i] = -1;
+                sa[--bkt[SAIS_CHR(j)]] = j;
+        }
+        sais_induce(s, sa, n, k, cs, t, bkt);
+}
+
+static void
+sais_8(const uint8_t *s, int32_t *sa, int32_t n, uint8_t *t, int32_t *bkt)
+{
+        sais(s, sa, n, 256, 1, t, bkt);
+}
+
+static void
+sais_32(const int32_t *s, int32_t *sa, int32_t n, int32_t k, uint8_t *t,
+        int32_t *bkt)
+{
+        sais(s, sa, n, k, 4, t, bkt);
+}
+
+#undef SAIS_CHR
+#undef SAIS_TGET
+#undef SAIS_TSET
+#undef SAIS_IS_LMS
+
+/*
+ * The index is built in four stages, which can be run one after another with
+ * sa_matchfinder_build().  The last three stages work on independent ranges of
+ * the buffer, so they can also be split across threads, provided that each
+ * stage is complete for the whole buffer before the next one starts:
+ *
+ * 1. sa_matchfinder_sort() sorts the suffixes.
+ * 2. sa_matchfinder_link() links each suffix to the one sorted before it, for
+ *    a range of the suffix array.
+ * 3. sa_matchfinder_compute_lcp() computes the LCP of each suffix with the one
+ *    it's linked to, for a range of positions.
+ * 4. sa_matchfinder_build_tree() builds the tree of LCP intervals, for a range
+ *    of the suffix array.  The range must consist of whole subtrees of the
+ *    root; sa_matchfinder_next_subtree() finds where they start.
+ */
+
+/* Sort the suffixes of the buffer @in of @in_size bytes, which must not exceed
+ * the size the matchfinder was initialized for.  */
+static void
+sa_matchfinder_sort(struct sa_matchfinder *mf, const uint8_t *in,
+                    uint32_t in_size)
+{
+        /* Sort the suffixes into last_pos, using the other two arrays as
+         * scratch space.  The virtual terminator sorts first, so the suffix
+         * array of the buffer itself starts at the second entry. */
+        int32_t *bkt = (int32_t *)sa_matchfinder_leaf_nodes(mf);
+        uint8_t *t = (uint8_t *)(bkt + max_u32(257, in_size / 2 + 2));
+
+        assert(in_size <= mf->capacity);
+        assert(mf->capacity <= SA_MATCHFINDER_MAX_BUFSIZE);
+
+        sais_8(in, (int32_t *)sa_matchfinder_last_pos(mf),
+               (int32_t)in_size + 1, t, bkt);
+}
+
+/* Link the suffixes at indices [@begin, @end) of the suffix array to the ones
+ * sorted before them.  */
+static void
+sa_matchfinder_link(struct sa_matchfinder *mf, uint32_t begin, uint32_t end)
+{
+        const int32_t *sa = (const int32_t *)sa_matchfinder_last_pos(mf) + 1;
+        uint32_t * const leaf_nodes = sa_matchfinder_leaf_nodes(mf);
+        uint32_t i;
+
+        if (begin == 0) {
+                leaf_nodes[sa[0]] = SA_MATCHFINDER_INVALID_POS;
+                begin++;
+        }
+        for (i = begin; i < end; i++)
+                leaf_nodes[sa[i]] = sa[i - 1];
+}
+
+/*
+ * Compute the LCP of each suffix at positions [@begin, @end) of the buffer with
+ * the suffix it was linked to, capped at @max_len.  Each is at least one less
+ * than that of the preceding position, so the total work is linear.  A range
+ * starts from scratch, which costs at most @max_len extra comparisons but gives
+ * the same result.
+ */
+static void
+sa_matchfinder_compute_lcp(struct sa_matchfinder *mf, const uint8_t *in,
+                           uint32_t in_size, uint32_t max_len,
+                           uint32_t begin, uint32_t end)
+{
+        uint32_t * const leaf_nodes = sa_matchfinder_leaf_nodes(mf);
+        uint32_t i, h;
+
+        assert(max_len <= SA_MATCHFINDER_MAX_LEN);
+
+        h = 0;
+        for (i = begin; i < end; i++) {
+                uint32_t prev = leaf_nodes[i];
+
+                if (prev == SA_MATCHFINDER_INVALID_POS) {
+                        h = 0;
+                } else {
+                        uint32_t limit = min_u32(max_len,
+                                                 in_size - max_u32(i, prev));
+
+                        while (h < limit && in[i + h] == in[prev + h])
+                                h++;
+                }
+                leaf_nodes[i] = h;
+                if (h > 0)
+                        h--;
+        }
+}
+
+/*
+ * Return the index of the first suffix at or after index @i of the suffix array
+ * of a buffer of @in_size bytes which starts a subtree of the root, or @in_size
+ * if there's none.  The LCP array must have been computed.
+ */
+static uint32_t
+sa_matchfinder_next_subtree(struct sa_matchfinder *mf, uint32_t in_size,
+                            uint32_t i)
+{
+        const int32_t *sa = (const int32_t *)sa_matchfinder_last_pos(mf) + 1;
+        const uint32_t * const leaf_nodes = sa_matchfinder_leaf_nodes(mf);
+
+        while (i < in_size && i > 0 &&
+               leaf_nodes[sa[i]] >= SA_MATCHFINDER_MIN_LEN)
+                i++;
+        return i;
+}
+
+/*
+ * Build the tree of LCP intervals in one pass over the suffixes at indices
+ * [@begin, @end) of the suffix array, where both ends are either an end of the
+ * suffix array or the start of a subtree of the root.  Afterwards, and once all
+ * of the suffix array has been covered, the positions of the buffer must be
+ * visited in order with sa_matchfinder_get_matches() or
+ * sa_matchfinder_skip_byte().
+ */
+static void
+sa_matchfinder_build_tree(struct sa_matchfinder *mf, uint32_t begin,
+                          uint32_t end)
+{
+        uint32_t * const last_pos = sa_matchfinder_last_pos(mf);
+        uint32_t * const leaf_nodes = sa_matchfinder_leaf_nodes(mf);
+        uint32_t * const nodes = sa_matchfinder_nodes(mf);
+        const int32_t *sa = (const int32_t *)last_pos + 1;
+        uint32_t stack_len[SA_MATCHFINDER_MAX_LEN + 1];
+        uint32_t stack_node[SA_MATCHFINDER_MAX_LEN + 1];
+        uint32_t first_node;
+        uint32_t num_nodes;
+        uint32_t top;
+        uint32_t i;
+
+        /*
+         * The range opens at most one node per suffix after the first, so
+         * its nodes are numbered from begin + 1 and never collide with those
+         * of other ranges.  Their last_pos entries overlap the range's part of
+         * the suffix array, which is no longer needed once they're reset.
+         */
+        first_node = begin + 1;
+        num_nodes = first_node;
+
+        if (begin == 0) {
+                nodes[0] = 0;
+                last_pos[0] = SA_MATCHFINDER_INVALID_POS;
+        }
+
+        /*
+         * The stack holds the open intervals, with strictly increasing lengths,
+         * from the root at the bottom.  Each boundary between adjacent suffixes
+         * closes the intervals deeper than its LCP, and each suffix belongs to
+         * the deeper of the intervals on either side of it.  Once a suffix's
+         * leaf is known, its LCP entry has already been consumed and is
+         * replaced.  Lengths below SA_MATCHFINDER_MIN_LEN fold into the root,
+         * which is where the range ends.
+         */
+        stack_len[0] = 0;
+        stack_node[0] = 0;
+        top = 0;
+
+        for (i = begin + 1; i <= end; i++) {
+                uint32_t len = 0;
+                uint32_t leaf_node;
+
+                if (i < end) {
+                        len = leaf_nodes[sa[i]];
+                        if (len < SA_MATCHFINDER_MIN_LEN)
+                                len = 0;
+                }
+
+                leaf_node = (len > stack_len[top]) ? num_nodes :
+                                                     stack_node[top];
+
+                while (len < stack_len[top]) {
+                        uint32_t node = stack_node[top];
+                        uint32_t node_len = stack_len[top];
+
+                        top--;
+
+                        /* If the enclosing interval is deeper than the one
+                         * below on the stack, it starts here. */
+                        if (len > stack_len[top]) {
+                                top++;
+                                stack_len[top] = len;
+                                stack_node[top] = num_nodes++;
+                        }
+
+                        nodes[node] = (node_len << SA_MATCHFINDER_NODE_BITS) |
+                                      stack_node[top];
+                }
+
+                leaf_nodes[sa[i - 1]] = leaf_node;
+
+                if (len > stack_len[top]) {
+                        top++;
+                        stack_len[top] = len;
+                        stack_node[top] = num_nodes++;
+                }
+        }
+
+        /* No position has been visited yet. */
+        for (i = first_node; i < num_nodes; i++)
+                last_pos[i] = SA_MATCHFINDER_INVALID_POS;
+}
+
+/*
+ * Index the buffer @in of @in_size bytes, which must not exceed the size the
+ * matchfinder was initialized for.  Matches are limited to @max_len bytes,
+ * which must not exceed SA_MATCHFINDER_MAX_LEN.  Afterwards, the positions of
+ * the buffer must be visited in order with sa_matchfinder_get_matches() or
+ * sa_matchfinder_skip_byte().
+ *
+ * This runs in time linear in @in_size.
+ */
+static void
+sa_matchfinder_build(struct sa_matchfinder *mf, const uint8_t *in,
+                     uint32_t in_size, uint32_t max_len)
+{
+        if (in_size == 0)
+                return;
+
+        sa_matchfinder_sort(mf, in, in_size);
+        sa_matchfinder_link(mf, 0, in_size);
+        sa_matchfinder_compute_lcp(mf, in, in_size, max_len, 0, in_size);
+        sa_matchfinder_build_tree(mf, 0, in_size);
+}
+
+/* Advance the suffix array matchfinder by one byte, optionally recording
+ * matches.  @record_matches should be a compile-time constant.  */
+static attrib_forceinline struct lz_match *
+sa_matchfinder_advance_one_byte(struct sa_matchfinder * const mf,
+                                const uint32_t min_pos,
+                                const uint32_t cur_pos,
+                                const uint32_t max_produce_len,
+                                uint32_t * const best_len_ret,
+                                struct lz_match *lz_matchptr,
+                                const bool record_matches)
+{
+        uint32_t * const last_pos = sa_matchfinder_last_pos(mf);
+        const uint32_t * const nodes = sa_matchfinder_nodes(mf);
+        struct lz_match * const lz_matchstart = lz_matchptr;
+        uint32_t prev_match_pos = SA_MATCHFINDER_INVALID_POS;
+        uint32_t node = sa_matchfinder_leaf_nodes(mf)[cur_pos];
+
+        /* Walk from the deepest node up to the root, which yields matches in
+         * order of decreasing length and non-increasing offset.  */
+        while (node != 0) {
+                const uint32_t info = nodes[node];
+                const uint32_t match_pos = last_pos[node];
+
+                last_pos[node] = cur_pos;
+
+                if (record_matches &&
+                    match_pos != SA_MATCHFINDER_INVALID_POS &&
+                    match_pos >= min_pos && match_pos != prev_match_pos) {
+                        uint32_t len = min_u32(info >> SA_MATCHFINDER_NODE_BITS,
+                                               max_produce_len);
+
+                        /* A shorter match was truncated to the same length
+                         * but is closer, so it replaces the longer one.  */
+                        if (lz_matchptr != lz_matchstart &&
+                            lz_matchptr[-1].length == len) {
+                                lz_matchptr[-1].offset = cur_pos - match_pos;
+                        } else {
+                                lz_matchptr->length = len;
+                                lz_matchptr->offset = cur_pos - match_pos;
+                                lz_matchptr++;
+                        }
+                        prev_match_pos = match_pos;
+                }
+
+                node = info & SA_MATCHFINDER_NODE_MASK;
+        }
+
+        if (!record_matches)
+                return lz_matchptr;
+
+        /* Put the matches in order of increasing length.  */
+        {
+                struct lz_match *lo = lz_matchstart;
+                struct lz_match *hi = lz_matchptr - 1;
+
+                *best_len_ret = (lz_matchptr != lz_matchstart) ?
+                                lz_matchstart->length : 0;
+
+                while (lo < hi) {
+                        struct lz_match tmp = *lo;
+                        *lo++ = *hi;
+                        *hi-- = tmp;
+                }
+        }
+
+        return lz_matchptr;
+}
+
+/*
+ * Retrieve a list of matches with the current position.
+ *
+ * @mf
+ *        The matchfinder structure.
+ * @min_pos
+ *        The smallest position, relative to the start of the indexed buffer,
+ *        that a match may start at.
+ * @cur_pos
+ *        The current position relative to the start of the indexed buffer.
+ *        Positions must be visited in order.
+ * @max_produce_len
+ *        Longer matches are truncated to this length.
+ * @best_len_ret
+ *        The length of the longest match is written here, or 0 if there were no
+ *        matches.
+ * @lz_matchptr
+ *        An array in which this function will record the matches.  The recorded
+ *        matches will be sorted by strictly increasing length and (non-strictly)
+ *        increasing offset.  Each match has the smallest offset possible for
+ *        its length.
+ *
+ * The return value is a pointer to the next available slot in the @lz_matchptr
+ * array.  (If no matches were found, this will be the same as @lz_matchptr.)
+ */
+static attrib_forceinline struct lz_match *
+sa_matchfinder_get_matches(struct sa_matchfinder *mf,
+                           uint32_t min_pos,
+                           uint32_t cur_pos,
+                           uint32_t max_produce_len,
+                           uint32_t *best_len_ret,
+                           struct lz_match *lz_matchptr)
+{
+        return sa_matchfinder_advance_one_byte(mf,
+                                               min_pos,
+                                               cur_pos,
+                                               max_produce_len,
+                                               best_len_ret,
+                                               lz_matchptr,
+                                               true);
+}
+
+/*
+ * Advance the matchfinder, but don't record any matches.
+ *
+ * This is very similar to sa_matchfinder_get_matches() because the nodes above
+ * the position must still be updated.
+ */
+static attrib_forceinline void
+sa_matchfinder_skip_byte(struct sa_matchfinder *mf, uint32_t cur_pos)
+{
+        uint32_t dummy;
+
+        sa_matchfinder_advance_one_byte(mf,
+                                        0,
+                                        cur_pos,
+                                        0,
+                                        &dummy,
+                                        NULL,
+                                        false);
+}
+
+#endif /* _LIBLZX_SA_MATCHFINDER_H */
@@ -14,6 +14,9 @@
 /* Calculate 'n / d', but round up instead of down.  */
 #define DIV_ROUND_UP(n, d)        (((n) + (d) - 1) / (d))
 
+/* Round 'n' up to a multiple of 'a', which must be a power of 2.  */
+#define ALIGN(n, a)                (((n) + (a) - 1) & ~((a) - 1))
+
 /* Get the number of elements of an array type.  */
 #define ARRAY_LEN(array)        (sizeof(array) / sizeof((array)[0]))
 
@@ -17,6 +17,16 @@
 #include <algorithm>
 #include <limits>
 
+// liblzx TCOMP extension, see wine/dlls/cabinet/cabinet.h
+#ifndef tcompMASK_LZX_PARTITION
+#define tcompMASK_LZX_PARTITION 0x00F0
+#define tcompSHIFT_LZX_PARTITION 4
+#endif
+
+// CFDATA checksum, wine/dlls/cabinet/checksum.c is built into minicab for
+// the checksum benchmark
+extern "C" UINT32 cab_checksum(const void *data, UINT bytes, UINT32 csum);
+
 wchar_t *ConvertToUTF16(const char *path)
 {
 	int requiredSize = ::MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, path, -1, nullptr, 0);
@@ -127,6 +137,10 @@ struct Context
 	BOOL GetTempFile(char *pszTempName, int cbTempName);
 	BOOL GetNextCabinet(PCCAB pccab, ULONG  cbPrevCab);
 	ContextFile *GetOpenInfo(LPSTR pszName, USHORT *pdate, USHORT *ptime, USHORT *pattribs, int *err);
+	void AddBlock(ULONG compressedSize, ULONG uncompressedSize);
+
+	uint64_t m_compressedSize;
+	uint64_t m_uncompressedSize;
 };
 
 int Context::FilePlaced(PCCAB pccab, LPSTR pszFile, long cbFile, BOOL fContinuation)
@@ -306,6 +320,12 @@ ContextFile *Context::GetOpenInfo(LPSTR pszName, USHORT *pdate, USHORT *ptime, U
 	return result;
 }
 
+void Context::AddBlock(ULONG compressedSize, ULONG uncompressedSize)
+{
+	m_compressedSize += compressedSize;
+	m_uncompressedSize += uncompressedSize;
+}
+
 struct DContext
 {
 public:
@@ -494,6 +514,9 @@ BOOL CtxGetNextCabinet(PCCAB pccab, ULONG  cbPrevCab, void *pv)
 
 long CtxStatus(UINT typeStatus, ULONG cb1, ULONG cb2, void *pv)
 {
+	if (typeStatus == statusFile)
+		static_cast<Context *>(pv)->AddBlock(cb1, cb2);
+
 	return 0;
 }
 
@@ -541,7 +564,7 @@ long CtxDSeek(INT_PTR hf, long dist, int seektype)
 	return reinterpret_cast<ContextFile *>(hf)->Seek(dist, seektype, &err);
 }
 
-int AddFile(HFCI fci, const wchar_t *path, size_t pathLength, size_t truncateSize)
+int AddFile(HFCI fci, const wchar_t *path, size_t pathLength, size_t truncateSize, TCOMP tcomp)
 {
 	char *convertedPath = ConvertToUTF8(path);
 	char *convertedName = ConvertToUTF8(path + truncateSize);
@@ -550,8 +573,6 @@ int AddFile(HFCI fci, const wchar_t *path, size_t pathLength, size_t truncateSiz
 
 	if (convertedPath && convertedName)
 	{
-		TCOMP tcomp = (tcompTYPE_LZX | tcompLZX_WINDOW_HI);
-		//TCOMP tcomp = tcompTYPE_MSZIP;
 		succeeded = FCIAddFile(fci, convertedPath, convertedName, FALSE, CtxGetNextCabinet, CtxStatus, CtxGetOpenInfo, tcomp);
 	}
 
@@ -563,7 +584,7 @@ int AddFile(HFCI fci, const wchar_t *path, size_t pathLength, size_t truncateSiz
 	return succeeded ? 0 : -1;
 }
 
-int RecursiveAddDir(HFCI fci, const wchar_t *path, size_t pathLength, size_t truncateSize)
+int RecursiveAddDir(HFCI fci, const wchar_t *path, size_t pathLength, size_t truncateSize, TCOMP tcomp)
 {
 	int result = 0;
 
@@ -611,9 +632,9 @@ int RecursiveAddDir(HFCI fci, const wchar_t *path, size_t pathLength, size_t tru
 			extendedPath[extPathLen] = L'\0';
 
 			if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-				result = RecursiveAddDir(fci, extendedPath, extPathLen, truncateSize);
+				result = RecursiveAddDir(fci, extendedPath, extPathLen, truncateSize, tcomp);
 			else
-				result = AddFile(fci, extendedPath, extPathLen, truncateSize);
+				result = AddFile(fci, extendedPath, extPathLen, truncateSize, tcomp);
 
 			free(extendedPath);
 		}
@@ -630,7 +651,7 @@ int RecursiveAddDir(HFCI fci, const wchar_t *path, size_t pathLength, size_t tru
 }
 
 
-int RecursiveAdd(HFCI fci, const wchar_t *path)
+int RecursiveAdd(HFCI fci, const wchar_t *path, TCOMP tcomp)
 {
 	DWORD attribs = GetFileAttributesW(path);
 
@@ -642,7 +663,7 @@ int RecursiveAdd(HFCI fci, const wchar_t *path)
 	if (attribs & FILE_ATTRIBUTE_DIRECTORY)
 	{
 		size_t truncateSize = wcslen(path) + 1;
-		return RecursiveAddDir(fci, path, pathLength, truncateSize);
+		return RecursiveAddDir(fci, path, pathLength, truncateSize, tcomp);
 	}
 	else
 	{
@@ -658,15 +679,90 @@ int RecursiveAdd(HFCI fci, const wchar_t *path)
 			}
 		}
 
-		return AddFile(fci, path, pathLength, truncateSize);
+		return AddFile(fci, path, pathLength, truncateSize, tcomp);
 	}
 }
 
+// Measures the throughput of the CFDATA checksum over 32KB blocks, the size
+// FCI and FDI call it with for all but the last block of a folder.  The data
+// is 1MB by default, so that it stays in the cache like the blocks that were
+// just compressed or read, and it's checksummed repeatedly in each pass.
+int BenchmarkChecksum(const wchar_t *megabytes)
+{
+	const UINT blockSize = 32768;
+	const int numPasses = 10;
+	const size_t passSize = static_cast<size_t>(256) * 1048576;
+
+	size_t dataSize = static_cast<size_t>(megabytes ? wcstoul(megabytes, nullptr, 10) : 1) * 1048576;
+	if (dataSize == 0)
+	{
+		fprintf(stderr, "Invalid size");
+		return -1;
+	}
+
+	const size_t numRounds = std::max<size_t>(passSize / dataSize, 1);
+
+	uint8_t *data = static_cast<uint8_t *>(malloc(dataSize));
+	if (!data)
+		return -1;
+
+	// Same data on every run, so the checksums can be compared
+	uint32_t state = 0x12345678;
+	for (size_t i = 0; i < dataSize; i++)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		data[i] = static_cast<uint8_t>(state);
+	}
+
+	LARGE_INTEGER startTime, endTime, frequency;
+	QueryPerformanceFrequency(&frequency);
+
+	double bestSeconds = std::numeric_limits<double>::infinity();
+	UINT32 csum = 0;
+
+	for (int pass = 0; pass < numPasses; pass++)
+	{
+		UINT32 passCsum = 0;
+
+		QueryPerformanceCounter(&startTime);
+		for (size_t round = 0; round < numRounds; round++)
+		{
+			for (size_t offset = 0; offset < dataSize; offset += blockSize)
+			{
+				const UINT size = static_cast<UINT>(std::min<size_t>(blockSize, dataSize - offset));
+				passCsum += cab_checksum(data + offset, size, 0);
+			}
+		}
+		QueryPerformanceCounter(&endTime);
+
+		const double seconds = static_cast<double>(endTime.QuadPart - startTime.QuadPart) / static_cast<double>(frequency.QuadPart);
+		bestSeconds = std::min(bestSeconds, seconds);
+		csum = passCsum;
+	}
+
+	free(data);
+
+	const size_t checksummedSize = dataSize * numRounds;
+	const double throughput = (bestSeconds > 0.0) ? static_cast<double>(checksummedSize) / (bestSeconds * 1073741824.0) : 0.0;
+
+	printf("Checksummed %llu bytes of %llu byte data in %u byte blocks, best of %d passes %.4f s, %.2f GB/s, checksum %08x\n",
+		static_cast<unsigned long long>(checksummedSize), static_cast<unsigned long long>(dataSize), blockSize,
+		numPasses, bestSeconds, throughput, csum);
+
+	return 0;
+}
+
 int wmain(int argc, const wchar_t **argv)
 {
+	// The checksum benchmark doesn't use a cabinet
+	if (argc >= 2 && argv[1][0] == L's')
+		return BenchmarkChecksum((argc > 2) ? argv[2] : nullptr);
+
 	if (argc < 5)
 	{
-		fprintf(stderr, "minicab <mode> <cab folder> <cab name> <directory>");
+		fprintf(stderr, "minicab <mode> <cab folder> <cab name> <directory> [partition]\nminicab s [megabytes]");
 		return -1;
 	}
 
@@ -677,6 +773,7 @@ int wmain(int argc, const wchar_t **argv)
 	const wchar_t *cabName = argv[3];
 	const wchar_t *inFolder = argv[4];
 	const wchar_t *outFolder = argv[4];
+	const wchar_t *partition = (argc > 5) ? argv[5] : nullptr;
 
 	if (mode[0] != L'd' && mode[0] != L'c' && mode[0] != L't')
 	{
@@ -688,13 +785,22 @@ int wmain(int argc, const wchar_t **argv)
 	{
 		if (argc < 6)
 		{
-			fprintf(stderr, "minicab t <cab folder> <cab name> <in directory> <out directory>");
+			fprintf(stderr, "minicab t <cab folder> <cab name> <in directory> <out directory> [partition]");
 			return -1;
 		}
 
 		outFolder = argv[5];
+		partition = (argc > 6) ? argv[6] : nullptr;
 	}
 
+	// Partition is 0-15, see tcompMASK_LZX_PARTITION.  Smaller folders
+	// compress in parallel but lose some compression.
+	TCOMP tcomp = (tcompTYPE_LZX | tcompLZX_WINDOW_HI);
+	//TCOMP tcomp = tcompTYPE_MSZIP;
+
+	if (partition)
+		tcomp |= (static_cast<TCOMP>(wcstoul(partition, nullptr, 10)) << tcompSHIFT_LZX_PARTITION) & tcompMASK_LZX_PARTITION;
+
 	wchar_t *cabFolderBuffer = nullptr;
 
 	{
@@ -747,9 +853,13 @@ int wmain(int argc, const wchar_t **argv)
 		cabParams.cb = CAB_MAX_SIZE;
 		cabParams.cbFolderThresh = CAB_MAX_SIZE - 16;
 
+		LARGE_INTEGER startTime, endTime, frequency;
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&startTime);
+
 		HFCI fci = FCICreate(&erf, CtxFilePlaced, CtxAlloc, CtxFree, CtxOpen, CtxRead, CtxWrite, CtxClose, CtxSeek, CtxDelete, CtxGetTempFile, &cabParams, &ctx);
 
-		int result = RecursiveAdd(fci, inFolder);
+		int result = RecursiveAdd(fci, inFolder, tcomp);
 
 		if (result == 0)
 		{
@@ -761,6 +871,17 @@ int wmain(int argc, const wchar_t **argv)
 
 		if (result != 0)
 			return result;
+
+		QueryPerformanceCounter(&endTime);
+
+		// Ratio and throughput, for comparing partition sizes
+		const double seconds = static_cast<double>(endTime.QuadPart - startTime.QuadPart) / static_cast<double>(frequency.QuadPart);
+		const double ratio = ctx.m_uncompressedSize ? static_cast<double>(ctx.m_compressedSize) / static_cast<double>(ctx.m_uncompressedSize) : 0.0;
+		const double throughput = (seconds > 0.0) ? static_cast<double>(ctx.m_uncompressedSize) / (seconds * 1048576.0) : 0.0;
+
+		printf("Compressed %llu bytes to %llu bytes, ratio %.4f, %.3f s, %.2f MB/s\n",
+			static_cast<unsigned long long>(ctx.m_uncompressedSize), static_cast<unsigned long long>(ctx.m_compressedSize),
+			ratio, seconds, throughput);
 	}
 	
 	if (mode[0] == L'd' || mode[0] == L't')
@@ -22,6 +22,7 @@
 #define __WINE_CABINET_H
 
 #include <stdarg.h>
+#include <zlib.h>
 
 #include "windef.h"
 #include "winbase.h"
@@ -37,6 +38,7 @@ typedef unsigned char cab_UBYTE; /* 8 bits  */
 typedef UINT16        cab_UWORD; /* 16 bits */
 typedef UINT32        cab_ULONG; /* 32 bits */
 typedef INT32         cab_LONG;  /* 32 bits */
+typedef UINT64        cab_UQUAD; /* 64 bits */
 
 typedef UINT32        cab_off_t;
 
@@ -45,6 +47,7 @@ typedef UINT32        cab_off_t;
 # define CHAR_BIT (8)
 #endif
 #define CAB_ULONG_BITS (sizeof(cab_ULONG) * CHAR_BIT)
+#define CAB_UQUAD_BITS (sizeof(cab_UQUAD) * CHAR_BIT)
 
 /* structure offsets */
 #define cfhead_Signature         (0x00)
@@ -97,36 +100,27 @@ typedef UINT32        cab_off_t;
 #define cffile_A_EXEC                  (0x40)
 #define cffile_A_NAME_IS_UTF           (0x80)
 
+/* TCOMP extension: LZX doesn't use the Quantum level bits, so they set the
+ * uncompressed size at which FCIAddFile starts a new folder, which lets large
+ * cabinets be compressed in parallel.  0 disables it, 1-14 start a new folder
+ * after (window size << (n - 1)) bytes and 15 picks a size based on the
+ * window size and the number of processors.  The bits aren't stored in the
+ * cabinet. */
+#define tcompMASK_LZX_PARTITION        (0x00F0)
+#define tcompSHIFT_LZX_PARTITION       (4)
+#define tcompLZX_PARTITION_AUTO        (0x00F0)
+#define LZXPartitionFromTCOMP(tc) (((tc) & tcompMASK_LZX_PARTITION) >> tcompSHIFT_LZX_PARTITION)
+
 /****************************************************************************/
 /* our archiver information / state */
 
 /* MSZIP stuff */
 #define ZIPWSIZE 	0x8000  /* window size */
-#define ZIPLBITS	9	/* bits in base literal/length lookup table */
-#define ZIPDBITS	6	/* bits in base distance lookup table */
-#define ZIPBMAX		16      /* maximum bit length of any code */
-#define ZIPN_MAX	288     /* maximum number of codes in any set */
-
-struct Ziphuft {
-  cab_UBYTE e;                /* number of extra bits or operation */
-  cab_UBYTE b;                /* number of bits in this code or subcode */
-  union {
-    cab_UWORD n;              /* literal, length base, or distance base */
-    struct Ziphuft *t;        /* pointer to next level of table */
-  } v;
-};
 
 struct ZIPstate {
-    cab_ULONG window_posn;      /* current offset within the window        */
-    cab_ULONG bb;               /* bit buffer */
-    cab_ULONG bk;               /* bits in bit buffer */
-    cab_ULONG ll[288+32];       /* literal/length and distance code lengths */
-    cab_ULONG c[ZIPBMAX+1];     /* bit length count table */
-    cab_LONG  lx[ZIPBMAX+1];    /* memory for l[-1..ZIPBMAX-1] */
-    struct Ziphuft *u[ZIPBMAX];	/* table stack */
-    cab_ULONG v[ZIPN_MAX];      /* values in order of bit length */
-    cab_ULONG x[ZIPBMAX+1];     /* bit offsets, then code stack */
-    cab_UBYTE *inpos;
+    z_stream stream;            /* raw inflate stream of the folder        */
+    cab_UWORD dict_size;        /* size of the previous block in outbuf,   */
+                                /* the dictionary of the next one          */
 };
   
 /* Quantum stuff */
@@ -188,7 +182,10 @@ struct QTMstate {
 #define LZX_LENTABLE_SAFETY (64) /* we allow length table decoding overruns */
 
 #define LZX_DECLARE_TABLE(tbl) \
-  cab_UWORD tbl##_table[(1<<LZX_##tbl##_TABLEBITS) + (LZX_##tbl##_MAXSYMBOLS<<1)];\
+  cab_ULONG tbl##_table[1<<LZX_##tbl##_TABLEBITS];\
+  cab_UWORD tbl##_sorted[LZX_##tbl##_MAXSYMBOLS];\
+  cab_ULONG tbl##_limit[17]; \
+  cab_UWORD tbl##_first[17]; \
   cab_UBYTE tbl##_len  [LZX_##tbl##_MAXSYMBOLS + LZX_LENTABLE_SAFETY]
 
 struct LZXstate {
@@ -214,9 +211,10 @@ struct LZXstate {
 };
 
 struct lzx_bits {
-  cab_ULONG bb;
+  cab_UQUAD bb;
   int bl;
   cab_UBYTE *ip;
+  const cab_UBYTE *ep;
 };
 
 /* CAB data blocks are <= 32768 bytes in uncompressed form. Uncompressed
@@ -381,10 +379,10 @@ typedef struct cds_forward {
  * READ_BITS(var,n)  takes N bits from the buffer and puts them in var
  *
  * ENSURE_BITS(n)    ensures there are at least N bits in the bit buffer.
- *                   it can guarantee up to 17 bits (i.e. it can read in
- *                   16 new bits when there is down to 1 bit in the buffer,
- *                   and it can read 32 bits when there are 0 bits in the
- *                   buffer).
+ *                   it can guarantee up to 32 bits: the 64-bit buffer is
+ *                   refilled with two 16-bit words at a time whenever it
+ *                   holds fewer bits than needed.  Words past endinp read
+ *                   as zeroes, and running out of those is an error.
  * PEEK_BITS(n)      extracts (without removing) N bits from the bit buffer
  * REMOVE_BITS(n)    removes N bits from the bit buffer
  *
@@ -396,13 +394,16 @@ typedef struct cds_forward {
 #define INIT_BITSTREAM do { bitsleft = 0; bitbuf = 0; } while (0)
 
 /* Quantum reads bytes in normal order; LZX is little-endian order */
-#define ENSURE_BITS(n)                                                    \
-  while (bitsleft < (n)) {                                                \
-    bitbuf |= ((inpos[1]<<8)|inpos[0]) << (CAB_ULONG_BITS-16 - bitsleft); \
-    bitsleft += 16; inpos+=2;                                             \
-  }
+#define ENSURE_BITS(n) do {                                               \
+  if (bitsleft < (n)) {                                                   \
+    if (inpos >= endinp + 4) return DECR_ILLEGALDATA;                     \
+    bitbuf |= (cab_UQUAD) lzx_read_words(inpos, endinp)                   \
+              << (CAB_UQUAD_BITS-32 - bitsleft);                          \
+    bitsleft += 32; inpos += 4;                                           \
+  }                                                                       \
+} while (0)
 
-#define PEEK_BITS(n)   (bitbuf >> (CAB_ULONG_BITS - (n)))
+#define PEEK_BITS(n)   (bitbuf >> (CAB_UQUAD_BITS - (n)))
 #define REMOVE_BITS(n) ((bitbuf <<= (n)), (bitsleft -= (n)))
 
 #define READ_BITS(v,n) do {                                             \
@@ -423,6 +424,10 @@ typedef struct cds_forward {
 #define SYMTABLE(tbl)    (LZX(tbl##_table))
 #define LENTABLE(tbl)    (LZX(tbl##_len))
 
+#define SORTTABLE(tbl)   (LZX(tbl##_sorted))
+#define LIMITTABLE(tbl)  (LZX(tbl##_limit))
+#define FIRSTTABLE(tbl)  (LZX(tbl##_first))
+
 /* BUILD_TABLE(tablename) builds a huffman lookup table from code lengths.
  * In reality, it just calls make_decode_table() with the appropriate
  * values - they're all fixed by some #defines anyway, so there's no point
@@ -430,24 +435,40 @@ typedef struct cds_forward {
  */
 #define BUILD_TABLE(tbl)                                                \
   if (make_decode_table(                                                \
-    MAXSYMBOLS(tbl), TABLEBITS(tbl), LENTABLE(tbl), SYMTABLE(tbl)       \
+    MAXSYMBOLS(tbl), TABLEBITS(tbl), LENTABLE(tbl), SYMTABLE(tbl),      \
+    SORTTABLE(tbl), LIMITTABLE(tbl), FIRSTTABLE(tbl)                    \
   )) { return DECR_ILLEGALDATA; }
 
+/* Huffman table entries hold the code length and symbol of the code that
+ * their index starts with.  In the main tree, when that code is a literal
+ * and the rest of the index starts with another literal, the entry also
+ * holds the second literal and the length of both codes.
+ */
+#define ENTRY_LEN(e)     ((e) & 0x1F)
+#define ENTRY_SYM(e)     (((e) >> 5) & 0x3FF)
+#define ENTRY_SYM2(e)    (((e) >> 15) & 0xFF)
+#define ENTRY_LEN2(e)    ((e) >> 23)
+
+/* DECODE_HUFFSYM(tablename) puts the table entry for the next huffman
+ * symbol of the bitstream in i, without removing its bits.  codes of up
+ * to TABLEBITS(tbl) bits take a single lookup.
+ */
+#define DECODE_HUFFSYM(tbl) do {                                        \
+  ENSURE_BITS(16);                                                      \
+  if (!ENTRY_LEN(i = SYMTABLE(tbl)[PEEK_BITS(TABLEBITS(tbl))])) {       \
+    i = decode_long_code(SORTTABLE(tbl), LIMITTABLE(tbl),               \
+      FIRSTTABLE(tbl), TABLEBITS(tbl), PEEK_BITS(16));                  \
+    if (!i) { return DECR_ILLEGALDATA; }                                \
+  }                                                                     \
+} while (0)
+
 /* READ_HUFFSYM(tablename, var) decodes one huffman symbol from the
  * bitstream using the stated table and puts it in var.
  */
 #define READ_HUFFSYM(tbl,var) do {                                      \
-  ENSURE_BITS(16);                                                      \
-  hufftbl = SYMTABLE(tbl);                                              \
-  if ((i = hufftbl[PEEK_BITS(TABLEBITS(tbl))]) >= MAXSYMBOLS(tbl)) {    \
-    j = 1 << (CAB_ULONG_BITS - TABLEBITS(tbl));                         \
-    do {                                                                \
-      j >>= 1; i <<= 1; i |= (bitbuf & j) ? 1 : 0;                      \
-      if (!j) { return DECR_ILLEGALDATA; }                              \
-    } while ((i = hufftbl[i]) >= MAXSYMBOLS(tbl));                      \
-  }                                                                     \
-  j = LENTABLE(tbl)[(var) = i];                                         \
-  REMOVE_BITS(j);                                                       \
+  DECODE_HUFFSYM(tbl);                                                  \
+  REMOVE_BITS(ENTRY_LEN(i));                                            \
+  (var) = ENTRY_SYM(i);                                                 \
 } while (0)
 
 /* READ_LENGTHS(tablename, first, last) reads in code lengths for symbols
@@ -455,36 +476,13 @@ typedef struct cds_forward {
  * own special LZX way.
  */
 #define READ_LENGTHS(tbl,first,last,fn) do { \
-  lb.bb = bitbuf; lb.bl = bitsleft; lb.ip = inpos; \
+  lb.bb = bitbuf; lb.bl = bitsleft; lb.ip = inpos; lb.ep = endinp; \
   if (fn(LENTABLE(tbl),(first),(last),&lb,decomp_state)) { \
     return DECR_ILLEGALDATA; \
   } \
   bitbuf = lb.bb; bitsleft = lb.bl; inpos = lb.ip; \
 } while (0)
 
-/* Tables for deflate from PKZIP's appnote.txt. */
-
-#define THOSE_ZIP_CONSTS                                                           \
-static const cab_UBYTE Zipborder[] = /* Order of the bit length code lengths */    \
-{ 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};               \
-static const cab_UWORD Zipcplens[] = /* Copy lengths for literal codes 257..285 */ \
-{ 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51,             \
- 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 0, 0};                              \
-static const cab_UWORD Zipcplext[] = /* Extra bits for literal codes 257..285 */   \
-{ 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,             \
-  4, 5, 5, 5, 5, 0, 99, 99}; /* 99==invalid */                                     \
-static const cab_UWORD Zipcpdist[] = /* Copy offsets for distance codes 0..29 */   \
-{ 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,             \
-513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};          \
-static const cab_UWORD Zipcpdext[] = /* Extra bits for distance codes */           \
-{ 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10,            \
-10, 11, 11, 12, 12, 13, 13};                                                       \
-/* And'ing with Zipmask[n] masks the lower n bits */                               \
-static const cab_UWORD Zipmask[17] = {                                             \
- 0x0000, 0x0001, 0x0003, 0x0007, 0x000f, 0x001f, 0x003f, 0x007f, 0x00ff,           \
- 0x01ff, 0x03ff, 0x07ff, 0x0fff, 0x1fff, 0x3fff, 0x7fff, 0xffff                    \
-}
-
 /* SESSION Operation */
 #define EXTRACT_FILLFILELIST  0x00000001
 #define EXTRACT_EXTRACTFILES  0x00000002
@@ -507,4 +505,7 @@ typedef struct {
     struct FILELIST *FilterList;
 } SESSION;
 
+/* checksum.c */
+cab_ULONG cab_checksum( const void *data, UINT bytes, cab_ULONG csum );
+
 #endif /* __WINE_CABINET_H */
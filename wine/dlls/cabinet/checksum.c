@@ -0,0 +1,115 @@
+/*
+ * checksum.c
+ *
+ * CFDATA checksum shared by FCI and FDI
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <Windows.h>
+#include <string.h>
+
+#include "windef.h"
+#include "winbase.h"
+#include "winternl.h"
+#include "cabinet.h"
+
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#  define CAB_CHECKSUM_SSE2
+#elif defined(__SSE2__) || defined(_M_X64)
+#  include <emmintrin.h>
+#  define CAB_CHECKSUM_SSE2
+#endif
+
+#ifdef CAB_CHECKSUM_SSE2
+/* XOR the two 64-bit halves of a vector */
+static inline UINT64 fold_m128( __m128i v )
+{
+    v = _mm_xor_si128( v, _mm_unpackhi_epi64( v, v ));
+    /* _mm_cvtsi128_si64 is only available on 64-bit targets */
+    return (UINT64)(UINT)_mm_cvtsi128_si32( v ) |
+           ((UINT64)(UINT)_mm_cvtsi128_si32( _mm_srli_si128( v, 4 )) << 32);
+}
+#endif
+
+/***********************************************************************
+ * cab_checksum (internal)
+ *
+ * The checksum is the XOR of all the little-endian 32-bit words of the data,
+ * followed by the 1 to 3 remaining bytes in reverse order.  Since XOR doesn't
+ * depend on the order of the words, the bulk of the data is reduced in
+ * vector or 64-bit lanes that are folded into a single word at the end.
+ */
+cab_ULONG cab_checksum( const void *data, UINT bytes, cab_ULONG csum )
+{
+    const cab_UBYTE *p = data;
+    cab_ULONG ul, v32;
+    UINT64 acc64 = 0, v64;
+    UINT i;
+
+#if defined(__AVX2__)
+    if (bytes >= 64)
+    {
+        __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+
+        for (; bytes >= 64; p += 64, bytes -= 64)
+        {
+            acc0 = _mm256_xor_si256( acc0, _mm256_loadu_si256( (const __m256i *)p ));
+            acc1 = _mm256_xor_si256( acc1, _mm256_loadu_si256( (const __m256i *)(p + 32) ));
+        }
+        acc0 = _mm256_xor_si256( acc0, acc1 );
+        acc64 = fold_m128( _mm_xor_si128( _mm256_castsi256_si128( acc0 ),
+                                          _mm256_extracti128_si256( acc0, 1 )));
+    }
+#elif defined(CAB_CHECKSUM_SSE2)
+    if (bytes >= 32)
+    {
+        __m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128();
+
+        for (; bytes >= 32; p += 32, bytes -= 32)
+        {
+            acc0 = _mm_xor_si128( acc0, _mm_loadu_si128( (const __m128i *)p ));
+            acc1 = _mm_xor_si128( acc1, _mm_loadu_si128( (const __m128i *)(p + 16) ));
+        }
+        acc64 = fold_m128( _mm_xor_si128( acc0, acc1 ));
+    }
+#endif
+
+    for (; bytes >= 8; p += 8, bytes -= 8)
+    {
+        memcpy( &v64, p, sizeof(v64) );
+        acc64 ^= v64;
+    }
+    if (bytes >= 4)
+    {
+        memcpy( &v32, p, sizeof(v32) );
+        acc64 ^= v32;
+        p += 4;
+        bytes -= 4;
+    }
+
+    /* the words were loaded in host order, so on big endian hosts the folded
+     * word is byte swapped */
+#ifdef WORDS_BIGENDIAN
+    csum ^= RtlUlongByteSwap( (cab_ULONG)(acc64 ^ (acc64 >> 32)) );
+#else
+    csum ^= (cab_ULONG)(acc64 ^ (acc64 >> 32));
+#endif
+
+    ul = 0;
+    for (i = 0; i < bytes; i++) ul = (ul << 8) | p[i];
+    return csum ^ ul;
+}
@@ -106,10 +106,27 @@ typedef struct {
   /* compressed data */
 } CFDATA;
 
+/* piece of the in-memory data of a temp file */
+struct temp_segment
+{
+    struct temp_segment *next;
+    cab_ULONG            size;
+    cab_ULONG            used;
+    unsigned char        data[1];
+};
+
+/* Compressed data waiting to be written to the cabinet.  It is kept in memory
+ * until the FCI exceeds FCI_TEMP_MEMORY_LIMIT, then the file that grows past
+ * it is moved to a temp file from the caller's callbacks. */
 struct temp_file
 {
-    INT_PTR   handle;
-    char      name[CB_MAX_FILENAME];
+    INT_PTR              handle;       /* -1 while the data is in memory */
+    char                 name[CB_MAX_FILENAME];
+    BOOL                 open;
+    struct temp_segment *head;
+    struct temp_segment *tail;
+    struct temp_segment *pos;          /* read position in memory */
+    cab_ULONG            pos_offset;
 };
 
 struct folder
@@ -118,7 +135,7 @@ struct folder
     struct list      files_list;
     struct list      blocks_list;
     struct temp_file data;
-    cab_ULONG        data_start;
+    cab_ULONG        data_size;
     cab_UWORD        data_count;
     TCOMP            compression;
 };
@@ -142,6 +159,83 @@ struct data_block
     cab_UWORD   uncompressed;
 };
 
+/* data block buffer handed to a compression job */
+struct job_block
+{
+    struct list   entry;
+    cab_UWORD     size;          /* uncompressed size on input, compressed size on output */
+    BOOL          ready;         /* compressed, only meaningful in out_list */
+    unsigned char data[2 * CAB_BLOCKMAX];
+};
+
+/* compression state of one worker of a job */
+struct job_lane
+{
+    struct list   entry;
+    z_stream      stream;        /* MSZIP only, reset for every block */
+    unsigned char data_out[2 * CAB_BLOCKMAX];
+};
+
+/* compression of the data of one folder, either on thread pool workers or on
+ * the calling thread.  MSZIP blocks are independent, so they are compressed by
+ * up to one worker per lane at once; the other types use a single lane.
+ * Blocks in in_list, out_list and spare_list, the lanes, the counters of
+ * running workers and blocks being compressed, and the ending and done flags
+ * are protected by the FCI jobs_lock. */
+struct folder_job
+{
+    struct list      entry;
+    struct FCI_Int  *fci;
+    struct folder   *folder;        /* NULL while the folder is still open */
+    TCOMP            compression;
+    cab_UWORD      (*compress)(struct folder_job *, struct job_lane *, const unsigned char *, cab_UWORD);
+    cab_UWORD      (*flush)(struct folder_job *, struct job_lane *);
+    struct liblzx_compressor *lzx_compressor;
+    PTP_WORK         work;          /* NULL to compress on the calling thread */
+    struct list      in_list;       /* blocks waiting to be compressed */
+    struct list      out_list;      /* blocks being compressed and compressed blocks, in folder order */
+    struct list      spare_list;    /* consumed blocks kept for the output of the final flush */
+    struct list      lanes;         /* lanes not used by a running worker */
+    unsigned int     lane_count;
+    unsigned int     queued;        /* number of blocks in in_list */
+    unsigned int     compressing;   /* number of blocks being compressed */
+    unsigned int     running;       /* number of workers started */
+    cab_ULONG        blocks_in;
+    cab_ULONG        blocks_stored;
+    cab_ULONG        size_in;       /* uncompressed size of all queued blocks */
+    cab_ULONG        size_stored;   /* uncompressed size of all stored blocks */
+    cab_UWORD        last_size;
+    BOOL             ending;
+    BOOL             done;
+};
+
+/* size of the reads from the source files */
+#define FCI_READ_SIZE (1024 * 1024)
+
+/* maximum number of blocks queued to a job running on the thread pool, enough
+ * to keep the workers busy while the next read is done */
+#define JOB_QUEUE_MAX (FCI_READ_SIZE / CAB_BLOCKMAX)
+
+/* total size of the temp files that can be kept in memory */
+#ifndef FCI_TEMP_MEMORY_LIMIT
+#define FCI_TEMP_MEMORY_LIMIT (64 * 1024 * 1024)
+#endif
+
+/* size range of the in-memory segments of a temp file, they double as it grows */
+#define TEMP_SEGMENT_MIN (64 * 1024)
+#define TEMP_SEGMENT_MAX (1024 * 1024)
+
+/* automatic LZX folder size, in windows (window size << (n - 1)) */
+#define LZX_PARTITION_AUTO 3
+
+enum job_wait
+{
+    JOB_WAIT_ALL,   /* all queued data is compressed */
+    JOB_WAIT_OPEN,  /* all queued data of the open folder is compressed */
+    JOB_WAIT_SLOT,  /* another job can be started */
+    JOB_WAIT_QUEUE, /* another block can be queued to the open folder */
+};
+
 typedef struct FCI_Int
 {
   unsigned int       magic;
@@ -169,7 +263,6 @@ typedef struct FCI_Int
   char               szPrevDisk[CB_MAX_DISK_NAME];   /* disk name of previous cabinet */
   unsigned char      data_in[CAB_BLOCKMAX];          /* uncompressed data blocks */
   unsigned char      data_out[2 * CAB_BLOCKMAX];     /* compressed data blocks */
-  BOOL               have_data_out;
   cab_UWORD          cdata_in;
   ULONG              cCompressedBytesInFolder;
   cab_UWORD          cFolders;
@@ -190,10 +283,16 @@ typedef struct FCI_Int
   cab_ULONG          pending_data_size;   /* size of data not yet assigned to a folder */
   cab_ULONG          folders_data_size;   /* total size of data contained in the current folders */
   TCOMP              compression;
-  cab_UWORD        (*compress)(struct FCI_Int *);
-  cab_UWORD        (*flush)(struct FCI_Int *);
-  void             (*compress_shutdown)(struct FCI_Int *);
-  struct liblzx_compressor *lzx_compressor;
+  cab_ULONG          partition_size;      /* uncompressed folder size that starts a new folder */
+  struct folder_job  *job;                /* job of the open folder */
+  struct list        jobs_list;           /* jobs that haven't stored all their blocks yet */
+  unsigned int       job_count;
+  unsigned int       max_jobs;
+  struct list        free_blocks;         /* job block buffers available for reuse */
+  SRWLOCK            jobs_lock;
+  CONDITION_VARIABLE jobs_cond;
+  cab_ULONG          temp_memory;         /* size of the in-memory segments of all temp files */
+  unsigned char      *read_buffer;        /* FCI_READ_SIZE bytes, allocated on first use */
 } FCI_Int;
 
 #define FCI_INT_MAGIC 0xfcfcfc05
@@ -235,10 +334,44 @@ static cab_ULONG get_header_size( FCI_Int *fci )
     return ret;
 }
 
+static void init_temp_file( struct temp_file *file )
+{
+    file->handle = -1;
+    file->open   = FALSE;
+    file->head   = NULL;
+    file->tail   = NULL;
+    file->pos    = NULL;
+}
+
+/* start a temp file, in memory */
 static BOOL create_temp_file( FCI_Int *fci, struct temp_file *file )
 {
+    init_temp_file( file );
+    file->open = TRUE;
+    return TRUE;
+}
+
+static void free_temp_segments( FCI_Int *fci, struct temp_file *file )
+{
+    struct temp_segment *segment, *next;
+
+    for (segment = file->head; segment; segment = next)
+    {
+        next = segment->next;
+        fci->temp_memory -= segment->size;
+        fci->free( segment );
+    }
+    file->head = file->tail = file->pos = NULL;
+}
+
+/* move the in-memory data of a temp file to a real file */
+static BOOL spill_temp_file( FCI_Int *fci, struct temp_file *file )
+{
+    struct temp_segment *segment;
     int err;
 
+    TRACE( "moving temp data to disk, %u bytes in memory\n", fci->temp_memory );
+
     if (!fci->gettemp( file->name, CB_MAX_FILENAME, fci->pv ))
     {
         set_error( fci, FCIERR_TEMP_FILE, ERROR_FUNCTION_FAILED );
@@ -250,6 +383,112 @@ static BOOL create_temp_file( FCI_Int *fci, struct temp_file *file )
         set_error( fci, FCIERR_TEMP_FILE, err );
         return FALSE;
     }
+    for (segment = file->head; segment; segment = segment->next)
+    {
+        if (fci->write( file->handle, segment->data, segment->used, &err, fci->pv ) != segment->used)
+        {
+            set_error( fci, FCIERR_TEMP_FILE, err );
+            return FALSE;
+        }
+    }
+    free_temp_segments( fci, file );
+    return TRUE;
+}
+
+static BOOL write_temp_file( FCI_Int *fci, struct temp_file *file, const void *data, cab_ULONG size )
+{
+    struct temp_segment *segment;
+    cab_ULONG len;
+    int err;
+
+    while (size && file->handle == -1)
+    {
+        if (!(segment = file->tail) || segment->used == segment->size)
+        {
+            len = segment ? min( segment->size * 2, TEMP_SEGMENT_MAX ) : TEMP_SEGMENT_MIN;
+            if (fci->temp_memory + len > FCI_TEMP_MEMORY_LIMIT)
+            {
+                if (!spill_temp_file( fci, file )) return FALSE;
+                break;
+            }
+            if (!(segment = fci->alloc( FIELD_OFFSET( struct temp_segment, data[len] ))))
+            {
+                set_error( fci, FCIERR_ALLOC_FAIL, ERROR_NOT_ENOUGH_MEMORY );
+                return FALSE;
+            }
+            segment->next = NULL;
+            segment->size = len;
+            segment->used = 0;
+            if (file->tail) file->tail->next = segment;
+            else file->head = segment;
+            file->tail = segment;
+            fci->temp_memory += len;
+        }
+        len = min( size, segment->size - segment->used );
+        memcpy( segment->data + segment->used, data, len );
+        segment->used += len;
+        data = (const char *)data + len;
+        size -= len;
+    }
+    if (size && fci->write( file->handle, (void *)data, size, &err, fci->pv ) != size)
+    {
+        set_error( fci, FCIERR_TEMP_FILE, err );
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL seek_temp_file( FCI_Int *fci, struct temp_file *file, cab_ULONG pos )
+{
+    int err;
+
+    if (file->handle != -1)
+    {
+        if (fci->seek( file->handle, pos, SEEK_SET, &err, fci->pv ) != pos)
+        {
+            set_error( fci, FCIERR_TEMP_FILE, err );
+            return FALSE;
+        }
+        return TRUE;
+    }
+    for (file->pos = file->head; file->pos && pos > file->pos->used; file->pos = file->pos->next)
+        pos -= file->pos->used;
+    file->pos_offset = pos;
+    return TRUE;
+}
+
+static BOOL read_temp_file( FCI_Int *fci, struct temp_file *file, void *data, cab_ULONG size )
+{
+    cab_ULONG len;
+    int err;
+
+    if (file->handle != -1)
+    {
+        if (fci->read( file->handle, data, size, &err, fci->pv ) != size)
+        {
+            set_error( fci, FCIERR_TEMP_FILE, err );
+            return FALSE;
+        }
+        return TRUE;
+    }
+    while (size)
+    {
+        if (file->pos && file->pos_offset == file->pos->used)
+        {
+            file->pos = file->pos->next;
+            file->pos_offset = 0;
+        }
+        if (!file->pos)
+        {
+            set_error( fci, FCIERR_TEMP_FILE, ERROR_FUNCTION_FAILED );
+            return FALSE;
+        }
+        len = min( size, file->pos->used - file->pos_offset );
+        memcpy( data, file->pos->data + file->pos_offset, len );
+        file->pos_offset += len;
+        data = (char *)data + len;
+        size -= len;
+    }
     return TRUE;
 }
 
@@ -257,6 +496,8 @@ static BOOL close_temp_file( FCI_Int *fci, struct temp_file *file )
 {
     int err;
 
+    free_temp_segments( fci, file );
+    file->open = FALSE;
     if (file->handle == -1) return TRUE;
     if (fci->close( file->handle, &err, fci->pv ) == -1)
     {
@@ -314,93 +555,625 @@ static void free_file( FCI_Int *fci, struct file *file )
     fci->free( file );
 }
 
-/* creates new data blocks for the data in fci->data_in */
-static BOOL add_data_blocks( FCI_Int *fci, BOOL is_last_block, PFNFCISTATUS status_callback )
+static cab_UWORD compress_NONE( struct folder_job *job, struct job_lane *lane,
+                                const unsigned char *data, cab_UWORD size )
 {
-    int err;
-    struct data_block *block;
-    cab_UWORD compressed_size = 0;
-    cab_UWORD uncompressed_size = fci->cdata_in;
+    memcpy( lane->data_out, data, size );
+    return size;
+}
 
-    if (!uncompressed_size)
+static void *zalloc( void *opaque, unsigned int items, unsigned int size )
+{
+    FCI_Int *fci = opaque;
+    return fci->alloc( items * size );
+}
+
+static void zfree( void *opaque, void *ptr )
+{
+    FCI_Int *fci = opaque;
+    fci->free( ptr );
+}
+
+/* the deflate state is allocated once per lane, so that compressing a block
+ * doesn't call the allocation callbacks and can be done on a worker thread */
+static BOOL init_MSZIP( struct folder_job *job, struct job_lane *lane )
+{
+    lane->stream.zalloc = zalloc;
+    lane->stream.zfree  = zfree;
+    lane->stream.opaque = job->fci;
+    if (deflateInit2( &lane->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) != Z_OK)
     {
-        if (fci->cDataBlocksIn == 0 || !is_last_block) return TRUE;
+        set_error( job->fci, FCIERR_ALLOC_FAIL, ERROR_NOT_ENOUGH_MEMORY );
+        return FALSE;
     }
+    return TRUE;
+}
 
-    if (fci->data.handle == -1 && !create_temp_file( fci, &fci->data )) return FALSE;
+static cab_UWORD compress_MSZIP( struct folder_job *job, struct job_lane *lane,
+                                 const unsigned char *data, cab_UWORD size )
+{
+    z_stream *stream = &lane->stream;
+
+    /* every block is a separate deflate stream */
+    deflateReset( stream );
+    stream->next_in   = (Bytef *)data;
+    stream->avail_in  = size;
+    stream->next_out  = lane->data_out + 2;
+    stream->avail_out = sizeof(lane->data_out) - 2;
+    /* insert the signature */
+    lane->data_out[0] = 'C';
+    lane->data_out[1] = 'K';
+    deflate( stream, Z_FINISH );
+    return stream->total_out + 2;
+}
 
-    if (uncompressed_size)
-    {
-        compressed_size = fci->compress( fci );
+static void *compress_LZX_alloc_callback(void *userdata, size_t size)
+{
+    FCI_Int *fci = (FCI_Int *)userdata;
 
-        fci->cdata_in = 0;
-        fci->cDataBlocksIn++;
-    }
+    return fci->alloc((ULONG)size);
+}
+
+static void compress_LZX_free_callback(void *userdata, void *ptr)
+{
+    FCI_Int *fci = (FCI_Int *)userdata;
+
+    fci->free(ptr);
+}
 
-    if (compressed_size == 0 && is_last_block && fci->flush)
+static BOOL init_LZX(struct folder_job *job)
+{
+    int window_size_bits = LZXCompressionWindowFromTCOMP(job->compression);
+    liblzx_compress_properties_t props;
+
+    memset(&props, 0, sizeof(props));
+    props.lzx_variant = LIBLZX_VARIANT_CAB_DELTA;
+    props.window_size = 1 << window_size_bits;
+    props.chunk_granularity = CAB_BLOCKMAX;
+    props.compression_level = 70;
+    props.e8_file_size = LIBLZX_CONST_DEFAULT_E8_FILE_SIZE;
+    props.alloc_func = compress_LZX_alloc_callback;
+    props.free_func = compress_LZX_free_callback;
+    props.userdata = job->fci;
+
+    job->lzx_compressor = liblzx_compress_create(&props);
+
+    if (!job->lzx_compressor)
     {
-        compressed_size = fci->flush( fci );
+        set_error(job->fci, FCIERR_ALLOC_FAIL, ERROR_OUTOFMEMORY);
+        return FALSE;
     }
 
-    while (compressed_size > 0)
+    return TRUE;
+}
+
+static cab_UWORD compress_LZX(struct folder_job *job, struct job_lane *lane,
+                              const unsigned char *data, cab_UWORD size)
+{
+    size_t in_digested = 0;
+    size_t compressed_size = 0;
+    const liblzx_output_chunk_t *out_chunk = NULL;
+
+    while (in_digested < size)
     {
-        if (!(block = fci->alloc( sizeof(*block) )))
+        in_digested += liblzx_compress_add_input(job->lzx_compressor, data + in_digested, size - in_digested);
+
+        if (out_chunk)
         {
-            set_error( fci, FCIERR_ALLOC_FAIL, ERROR_NOT_ENOUGH_MEMORY );
-            return FALSE;
+            /* After producing an output chunk, all data should be digestable. */
+            assert(in_digested == size);
+            break;
         }
 
-        if (is_last_block && fci->cDataBlocksIn - 1 == fci->cDataBlocksOut)
+        out_chunk = liblzx_compress_get_next_chunk(job->lzx_compressor);
+
+        if (out_chunk)
         {
-            block->uncompressed = uncompressed_size;
+            compressed_size = out_chunk->size;
+            memcpy(lane->data_out, out_chunk->data, compressed_size);
+            liblzx_compress_release_next_chunk(job->lzx_compressor);
         }
-        else
+    }
+
+    return compressed_size;
+}
+
+static cab_UWORD flush_LZX(struct folder_job *job, struct job_lane *lane)
+{
+    const liblzx_output_chunk_t *out_chunk = NULL;
+    cab_UWORD compressed_size = 0;
+
+    liblzx_compress_end_input(job->lzx_compressor);
+    out_chunk = liblzx_compress_get_next_chunk(job->lzx_compressor);
+
+    if (out_chunk == NULL)
+    {
+        return 0;
+    }
+
+    compressed_size = out_chunk->size;
+    memcpy(lane->data_out, out_chunk->data, out_chunk->size);
+
+    liblzx_compress_release_next_chunk(job->lzx_compressor);
+
+    return compressed_size;
+}
+
+/* compress the queued blocks of a job, on a thread pool worker or on the calling thread */
+static void process_job_blocks( struct folder_job *job )
+{
+    FCI_Int *fci = job->fci;
+    struct job_lane *lane;
+    struct job_block *block;
+    cab_UWORD size;
+
+    AcquireSRWLockExclusive( &fci->jobs_lock );
+    lane = LIST_ENTRY( job->lanes.next, struct job_lane, entry );
+    list_remove( &lane->entry );
+    while (!job->done)
+    {
+        if (!list_empty( &job->in_list ))
         {
-            block->uncompressed = CAB_BLOCKMAX;
+            block = LIST_ENTRY( job->in_list.next, struct job_block, entry );
+            list_remove( &block->entry );
+            job->queued--;
+            /* keep the place of the block, other lanes may finish theirs first */
+            block->ready = FALSE;
+            list_add_tail( &job->out_list, &block->entry );
+            job->compressing++;
+            ReleaseSRWLockExclusive( &fci->jobs_lock );
+
+            size = job->compress( job, lane, block->data, block->size );
+            if (size) memcpy( block->data, lane->data_out, size );
+
+            AcquireSRWLockExclusive( &fci->jobs_lock );
+            job->compressing--;
+            if (!size)
+            {
+                /* LZX output lags behind by one block, the final flush reuses this one */
+                list_remove( &block->entry );
+                list_add_tail( &job->spare_list, &block->entry );
+                WakeAllConditionVariable( &fci->jobs_cond );
+                continue;
+            }
         }
+        else if (job->ending && !job->compressing)
+        {
+            block = NULL;
+            if (!list_empty( &job->spare_list ))
+            {
+                block = LIST_ENTRY( job->spare_list.next, struct job_block, entry );
+                list_remove( &block->entry );
+            }
+            ReleaseSRWLockExclusive( &fci->jobs_lock );
 
-        block->compressed = compressed_size;
+            size = job->flush ? job->flush( job, lane ) : 0;
+            assert( !size || block );
+            if (size) memcpy( block->data, lane->data_out, size );
 
-        if (fci->write( fci->data.handle, fci->data_out,
-                        block->compressed, &err, fci->pv ) != block->compressed)
-        {
-            set_error( fci, FCIERR_TEMP_FILE, err );
-            fci->free( block );
-            return FALSE;
+            AcquireSRWLockExclusive( &fci->jobs_lock );
+            if (!size)
+            {
+                if (block) list_add_tail( &job->spare_list, &block->entry );
+                job->done = TRUE;
+                break;
+            }
+            list_add_tail( &job->out_list, &block->entry );
         }
+        else break;
 
-        fci->pending_data_size += sizeof(CFDATA) + fci->ccab.cbReserveCFData + block->compressed;
+        block->size  = size;
+        block->ready = TRUE;
+        WakeAllConditionVariable( &fci->jobs_cond );
+    }
+    list_add_tail( &job->lanes, &lane->entry );
+    job->running--;
+    WakeAllConditionVariable( &fci->jobs_cond );
+    ReleaseSRWLockExclusive( &fci->jobs_lock );
+}
+
+static void CALLBACK job_work_callback( PTP_CALLBACK_INSTANCE instance, void *context, PTP_WORK work )
+{
+    process_job_blocks( context );
+}
+
+static void release_job_blocks( FCI_Int *fci, struct list *blocks )
+{
+    struct job_block *block, *block_next;
+
+    LIST_FOR_EACH_ENTRY_SAFE( block, block_next, blocks, struct job_block, entry )
+    {
+        list_remove( &block->entry );
+        list_add_tail( &fci->free_blocks, &block->entry );
+    }
+}
+
+static void free_job_lanes( FCI_Int *fci, struct folder_job *job )
+{
+    struct job_lane *lane, *lane_next;
+
+    LIST_FOR_EACH_ENTRY_SAFE( lane, lane_next, &job->lanes, struct job_lane, entry )
+    {
+        if ((job->compression & tcompMASK_TYPE) == tcompTYPE_MSZIP) deflateEnd( &lane->stream );
+        list_remove( &lane->entry );
+        fci->free( lane );
+    }
+}
+
+static void free_job( FCI_Int *fci, struct folder_job *job )
+{
+    if (job->work)
+    {
+        WaitForThreadpoolWorkCallbacks( job->work, FALSE );
+        CloseThreadpoolWork( job->work );
+    }
+    release_job_blocks( fci, &job->in_list );
+    release_job_blocks( fci, &job->out_list );
+    release_job_blocks( fci, &job->spare_list );
+    free_job_lanes( fci, job );
+    if (job->lzx_compressor) liblzx_compress_destroy( job->lzx_compressor );
+    if (fci->job == job) fci->job = NULL;
+    list_remove( &job->entry );
+    fci->job_count--;
+    fci->free( job );
+}
+
+/* write a compressed block to the temp file of its folder */
+static BOOL store_job_block( FCI_Int *fci, struct folder_job *job, struct job_block *job_block,
+                             PFNFCISTATUS status_callback )
+{
+    struct folder *folder = job->folder;
+    struct data_block *block;
+    cab_ULONG size = sizeof(CFDATA) + fci->ccab.cbReserveCFData + job_block->size;
+
+    list_add_tail( &fci->free_blocks, &job_block->entry );
+
+    if (!(block = fci->alloc( sizeof(*block) )))
+    {
+        set_error( fci, FCIERR_ALLOC_FAIL, ERROR_NOT_ENOUGH_MEMORY );
+        return FALSE;
+    }
+    /* only the last block of a folder can be partial */
+    block->compressed = job_block->size;
+    if (job->ending && job->blocks_stored + 1 == job->blocks_in)
+        block->uncompressed = job->last_size;
+    else
+        block->uncompressed = CAB_BLOCKMAX;
+
+    if (!write_temp_file( fci, folder ? &folder->data : &fci->data, job_block->data, block->compressed ))
+    {
+        fci->free( block );
+        return FALSE;
+    }
+
+    job->blocks_stored++;
+    job->size_stored += block->uncompressed;
+    if (folder)
+    {
+        /* the folder has been closed while it was still being compressed */
+        folder->data_size += size;
+        folder->data_count++;
+        fci->folders_data_size += size;
+        list_add_tail( &folder->blocks_list, &block->entry );
+    }
+    else
+    {
+        fci->pending_data_size += size;
         fci->cCompressedBytesInFolder += block->compressed;
         fci->cDataBlocksOut++;
         list_add_tail( &fci->blocks_list, &block->entry );
+    }
+
+    if (status_callback( statusFile, block->compressed, block->uncompressed, fci->pv ) == -1)
+    {
+        set_error( fci, FCIERR_USER_ABORT, 0 );
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* the next block of a job in folder order, if it has been compressed */
+static struct job_block *get_ready_block( struct folder_job *job )
+{
+    struct job_block *block;
+
+    if (list_empty( &job->out_list )) return NULL;
+    block = LIST_ENTRY( job->out_list.next, struct job_block, entry );
+    return block->ready ? block : NULL;
+}
+
+/* store the blocks compressed so far and free the jobs that are done */
+static BOOL collect_job_blocks( FCI_Int *fci, PFNFCISTATUS status_callback )
+{
+    struct folder_job *job, *job_next;
+    struct job_block *block;
+    BOOL done;
 
-        if (status_callback( statusFile, block->compressed, block->uncompressed, fci->pv ) == -1)
+    LIST_FOR_EACH_ENTRY_SAFE( job, job_next, &fci->jobs_list, struct folder_job, entry )
+    {
+        for (;;)
         {
-            set_error( fci, FCIERR_USER_ABORT, 0 );
+            AcquireSRWLockExclusive( &fci->jobs_lock );
+            done = job->done;
+            if ((block = get_ready_block( job ))) list_remove( &block->entry );
+            ReleaseSRWLockExclusive( &fci->jobs_lock );
+
+            if (!block) break;
+            if (!store_job_block( fci, job, block, status_callback )) return FALSE;
+        }
+        if (done) free_job( fci, job );
+    }
+    return TRUE;
+}
+
+static BOOL job_busy( const struct folder_job *job )
+{
+    return job->running || !list_empty( &job->in_list ) || (job->ending && !job->done);
+}
+
+/* check the condition of a wait, with the jobs lock held */
+static BOOL jobs_ready( FCI_Int *fci, enum job_wait wait )
+{
+    struct folder_job *job;
+
+    switch (wait)
+    {
+    case JOB_WAIT_ALL:
+        LIST_FOR_EACH_ENTRY( job, &fci->jobs_list, struct folder_job, entry )
+            if (job_busy( job )) return FALSE;
+        return TRUE;
+    case JOB_WAIT_OPEN:
+        return !fci->job || !job_busy( fci->job );
+    case JOB_WAIT_SLOT:
+        return fci->job_count < fci->max_jobs;
+    case JOB_WAIT_QUEUE:
+        return fci->job->queued < JOB_QUEUE_MAX;
+    }
+    return TRUE;
+}
+
+/* store compressed blocks as they complete until the wait condition is met */
+static BOOL wait_for_jobs( FCI_Int *fci, enum job_wait wait, PFNFCISTATUS status_callback )
+{
+    struct folder_job *job;
+    BOOL ready, pending;
+
+    for (;;)
+    {
+        AcquireSRWLockExclusive( &fci->jobs_lock );
+        for (;;)
+        {
+            ready = jobs_ready( fci, wait );
+            pending = FALSE;
+            LIST_FOR_EACH_ENTRY( job, &fci->jobs_list, struct folder_job, entry )
+                if (job->done || get_ready_block( job )) pending = TRUE;
+            if (ready || pending) break;
+            SleepConditionVariableSRW( &fci->jobs_cond, &fci->jobs_lock, INFINITE, 0 );
+        }
+        ReleaseSRWLockExclusive( &fci->jobs_lock );
+
+        if (!collect_job_blocks( fci, status_callback )) return FALSE;
+        if (ready) return TRUE;
+    }
+}
+
+/* The size checks of FCIAddFile and fci_flush_folder need the compressed size of
+ * the queued data.  Only wait for it if the worst case could change their outcome. */
+static BOOL sync_jobs( FCI_Int *fci, BOOL force, PFNFCISTATUS status_callback )
+{
+    struct folder_job *job;
+    ULONGLONG block_max = sizeof(CFDATA) + fci->ccab.cbReserveCFData + sizeof(fci->data_out);
+    ULONGLONG size;
+
+    if (!collect_job_blocks( fci, status_callback )) return FALSE;
+    if (list_empty( &fci->jobs_list )) return TRUE;
+
+    size = get_header_size( fci ) + fci->ccab.cbReserveCFFolder + sizeof(CFFOLDER) +
+           fci->folders_size + fci->files_size + fci->placed_files_size +
+           fci->folders_data_size + fci->pending_data_size +
+           sizeof(CFFILE) + CB_MAX_FILENAME + CB_MAX_CABINET_NAME + CB_MAX_DISK_NAME;
+    LIST_FOR_EACH_ENTRY( job, &fci->jobs_list, struct folder_job, entry )
+        size += (job->blocks_in - job->blocks_stored) * block_max;
+
+    if (force || fci->fNextCab || fci->fGetNextCabInVain || fci->ccab.cb < size)
+        return wait_for_jobs( fci, JOB_WAIT_ALL, status_callback );
+
+    /* the folder threshold only matters while the folder is open */
+    job = fci->job;
+    if (job && !job->ending &&
+        fci->ccab.cbFolderThresh <= fci->cCompressedBytesInFolder +
+        (ULONGLONG)(job->blocks_in - job->blocks_stored) * sizeof(fci->data_out))
+        return wait_for_jobs( fci, JOB_WAIT_OPEN, status_callback );
+
+    return TRUE;
+}
+
+static BOOL create_job( FCI_Int *fci, PFNFCISTATUS status_callback )
+{
+    struct folder_job *job;
+    struct job_lane *lane;
+    unsigned int i;
+
+    /* limit the number of folders being compressed at once */
+    if (!wait_for_jobs( fci, JOB_WAIT_SLOT, status_callback )) return FALSE;
+
+    if (!(job = fci->alloc( sizeof(*job) )))
+    {
+        set_error( fci, FCIERR_ALLOC_FAIL, ERROR_NOT_ENOUGH_MEMORY );
+        return FALSE;
+    }
+    memset( job, 0, sizeof(*job) );
+    job->fci = fci;
+    job->compression = fci->compression;
+    list_init( &job->in_list );
+    list_init( &job->out_list );
+    list_init( &job->spare_list );
+    list_init( &job->lanes );
+    job->lane_count = 1;
+
+    switch (fci->compression & tcompMASK_TYPE)
+    {
+    case tcompTYPE_MSZIP:
+        job->compress = compress_MSZIP;
+        if (fci->max_jobs > 1)
+        {
+            job->work = CreateThreadpoolWork( job_work_callback, job, NULL );
+            if (job->work) job->lane_count = min( fci->max_jobs, JOB_QUEUE_MAX );
+        }
+        break;
+    case tcompTYPE_LZX:
+        if (!init_LZX( job ))
+        {
+            fci->free( job );
             return FALSE;
         }
+        job->compress = compress_LZX;
+        job->flush    = flush_LZX;
+        if (fci->max_jobs > 1) job->work = CreateThreadpoolWork( job_work_callback, job, NULL );
+        break;
+    default:
+        /* not worth the overhead of a worker */
+        job->compress = compress_NONE;
+        break;
+    }
 
-        if (is_last_block && fci->flush)
+    /* all the allocations are done here, the workers only compress */
+    for (i = 0; i < job->lane_count; i++)
+    {
+        if (!(lane = fci->alloc( sizeof(*lane) )))
+            set_error( fci, FCIERR_ALLOC_FAIL, ERROR_NOT_ENOUGH_MEMORY );
+        else if (job->compress == compress_MSZIP && !init_MSZIP( job, lane ))
         {
-            compressed_size = fci->flush( fci );
+            fci->free( lane );
+            lane = NULL;
         }
-        else
+        if (!lane)
         {
-            compressed_size = 0;
+            if (job->work) CloseThreadpoolWork( job->work );
+            free_job_lanes( fci, job );
+            if (job->lzx_compressor) liblzx_compress_destroy( job->lzx_compressor );
+            fci->free( job );
+            return FALSE;
         }
+        list_add_tail( &job->lanes, &lane->entry );
     }
 
+    list_add_tail( &fci->jobs_list, &job->entry );
+    fci->job_count++;
+    fci->job = job;
     return TRUE;
 }
 
+static struct job_block *get_job_block( FCI_Int *fci )
+{
+    struct job_block *block;
+
+    if (!list_empty( &fci->free_blocks ))
+    {
+        block = LIST_ENTRY( fci->free_blocks.next, struct job_block, entry );
+        list_remove( &block->entry );
+        return block;
+    }
+    if (!(block = fci->alloc( sizeof(*block) )))
+        set_error( fci, FCIERR_ALLOC_FAIL, ERROR_NOT_ENOUGH_MEMORY );
+    return block;
+}
+
+/* queue a block of the open folder for compression */
+static BOOL queue_job_block( FCI_Int *fci, const unsigned char *data, cab_UWORD size,
+                             BOOL is_last_block, PFNFCISTATUS status_callback )
+{
+    struct folder_job *job = fci->job;
+    struct job_block *block = NULL;
+
+    if (size)
+    {
+        if (job->work && !wait_for_jobs( fci, JOB_WAIT_QUEUE, status_callback )) return FALSE;
+        if (!(block = get_job_block( fci ))) return FALSE;
+        memcpy( block->data, data, size );
+        block->size = size;
+    }
+
+    AcquireSRWLockExclusive( &fci->jobs_lock );
+    if (block)
+    {
+        list_add_tail( &job->in_list, &block->entry );
+        job->queued++;
+        job->blocks_in++;
+        job->size_in += size;
+        job->last_size = size;
+    }
+    job->ending = is_last_block;
+    if (!job->work) job->running++;
+    else
+    {
+        /* start a worker for each queued block that isn't picked up by a running
+         * one, at least one to finish the job, and no more than one per lane */
+        while (job->running < job->lane_count && job->running <= job->queued)
+        {
+            job->running++;
+            SubmitThreadpoolWork( job->work );
+        }
+    }
+    ReleaseSRWLockExclusive( &fci->jobs_lock );
+
+    if (!job->work) process_job_blocks( job );
+    return collect_job_blocks( fci, status_callback );
+}
+
+/* uncompressed size at which FCIAddFile starts a new LZX folder, 0 for none */
+static cab_ULONG get_partition_size( FCI_Int *fci, TCOMP compression )
+{
+    unsigned int window_bits = LZXCompressionWindowFromTCOMP( compression );
+    unsigned int partition = LZXPartitionFromTCOMP( compression );
+
+    if (partition == LZXPartitionFromTCOMP( tcompLZX_PARTITION_AUTO ))
+    {
+        /* smaller folders lose some compression, which only pays off if
+         * they can be compressed in parallel */
+        if (fci->max_jobs <= 1) return 0;
+        partition = LZX_PARTITION_AUTO;
+    }
+    if (!partition) return 0;
+    if (window_bits + partition - 1 >= 31) return 1u << 31;
+    return 1u << (window_bits + partition - 1);
+}
+
+/* queues the data in data_in for compression and stores the blocks compressed so far */
+static BOOL add_data_blocks( FCI_Int *fci, BOOL is_last_block, PFNFCISTATUS status_callback )
+{
+    cab_UWORD uncompressed_size = fci->cdata_in;
+
+    if (!uncompressed_size)
+    {
+        if (fci->cDataBlocksIn == 0 || !is_last_block) return TRUE;
+    }
+
+    if (!fci->data.open && !create_temp_file( fci, &fci->data )) return FALSE;
+    if (!fci->job && !create_job( fci, status_callback )) return FALSE;
+
+    if (uncompressed_size)
+    {
+        fci->cdata_in = 0;
+        fci->cDataBlocksIn++;
+    }
+
+    return queue_job_block( fci, fci->data_in, uncompressed_size, is_last_block, status_callback );
+}
+
 /* add compressed blocks for all the data that can be read from the file */
 static BOOL add_file_data( FCI_Int *fci, char *sourcefile, char *filename, BOOL execute,
                            PFNFCIGETOPENINFO get_open_info, PFNFCISTATUS status_callback )
 {
-    int err, len;
+    int err, len, pos, size;
     INT_PTR handle;
     struct file *file;
 
+    if (!fci->read_buffer && !(fci->read_buffer = fci->alloc( FCI_READ_SIZE )))
+    {
+        set_error( fci, FCIERR_ALLOC_FAIL, ERROR_NOT_ENOUGH_MEMORY );
+        return FALSE;
+    }
     if (!(file = add_file( fci, filename ))) return FALSE;
 
     handle = get_open_info( sourcefile, &file->date, &file->time, &file->attribs, &err, fci->pv );
@@ -412,20 +1185,31 @@ static BOOL add_file_data( FCI_Int *fci, char *sourcefile, char *filename, BOOL
     }
     if (execute) file->attribs |= _A_EXEC;
 
+    /* read in large pieces, the blocks queued from the previous read are
+     * compressed by the workers in the meantime */
     for (;;)
     {
-        len = fci->read( handle, fci->data_in + fci->cdata_in,
-                         CAB_BLOCKMAX - fci->cdata_in, &err, fci->pv );
+        len = fci->read( handle, fci->read_buffer, FCI_READ_SIZE, &err, fci->pv );
         if (!len) break;
 
         if (len == -1)
         {
+            fci->close( handle, &err, fci->pv );
             set_error( fci, FCIERR_READ_SRC, err );
             return FALSE;
         }
         file->size += len;
-        fci->cdata_in += len;
-        if (fci->cdata_in == CAB_BLOCKMAX && !add_data_blocks( fci, FALSE, status_callback )) return FALSE;
+        for (pos = 0; pos < len; pos += size)
+        {
+            size = min( len - pos, CAB_BLOCKMAX - fci->cdata_in );
+            memcpy( fci->data_in + fci->cdata_in, fci->read_buffer + pos, size );
+            fci->cdata_in += size;
+            if (fci->cdata_in == CAB_BLOCKMAX && !add_data_blocks( fci, FALSE, status_callback ))
+            {
+                fci->close( handle, &err, fci->pv );
+                return FALSE;
+            }
+        }
     }
     fci->close( handle, &err, fci->pv );
     return TRUE;
@@ -446,8 +1230,8 @@ static struct folder *add_folder( FCI_Int *fci )
         set_error( fci, FCIERR_ALLOC_FAIL, ERROR_NOT_ENOUGH_MEMORY );
         return NULL;
     }
-    folder->data.handle = -1;
-    folder->data_start  = fci->folders_data_size;
+    init_temp_file( &folder->data );
+    folder->data_size   = 0;
     folder->data_count  = 0;
     folder->compression = fci->compression;
     list_init( &folder->files_list );
@@ -487,72 +1271,21 @@ static void reset_cabinet( FCI_Int *fci )
     fci->folders_data_size = 0;
 }
 
-static cab_ULONG fci_get_checksum( const void *pv, UINT cb, cab_ULONG seed )
-{
-  cab_ULONG     csum;
-  cab_ULONG     ul;
-  int           cUlong;
-  const BYTE    *pb;
-
-  csum = seed;
-  cUlong = cb / 4;
-  pb = pv;
-
-  while (cUlong-- > 0) {
-    ul = *pb++;
-    ul |= (((cab_ULONG)(*pb++)) <<  8);
-    ul |= (((cab_ULONG)(*pb++)) << 16);
-    ul |= (((cab_ULONG)(*pb++)) << 24);
-    csum ^= ul;
-  }
-
-  ul = 0;
-  switch (cb % 4) {
-    case 3:
-      ul |= (((ULONG)(*pb++)) << 16);
-      /* fall through */
-    case 2:
-      ul |= (((ULONG)(*pb++)) <<  8);
-      /* fall through */
-    case 1:
-      ul |= *pb;
-      /* fall through */
-    default:
-      break;
-  }
-  csum ^= ul;
-
-  return csum;
-}
-
 /* copy all remaining data block to a new temp file */
-static BOOL copy_data_blocks( FCI_Int *fci, INT_PTR handle, cab_ULONG start_pos,
+static BOOL copy_data_blocks( FCI_Int *fci, struct temp_file *file, cab_ULONG start_pos,
                               struct temp_file *temp, PFNFCISTATUS status_callback )
 {
     struct data_block *block;
-    int err;
 
-    if (fci->seek( handle, start_pos, SEEK_SET, &err, fci->pv ) != start_pos)
-    {
-        set_error( fci, FCIERR_TEMP_FILE, err );
-        return FALSE;
-    }
+    if (!seek_temp_file( fci, file, start_pos )) return FALSE;
     if (!create_temp_file( fci, temp )) return FALSE;
 
     LIST_FOR_EACH_ENTRY( block, &fci->blocks_list, struct data_block, entry )
     {
-        if (fci->read( handle, fci->data_out, block->compressed,
-                       &err, fci->pv ) != block->compressed)
+        if (!read_temp_file( fci, file, fci->data_out, block->compressed ) ||
+            !write_temp_file( fci, temp, fci->data_out, block->compressed ))
         {
             close_temp_file( fci, temp );
-            set_error( fci, FCIERR_TEMP_FILE, err );
-            return FALSE;
-        }
-        if (fci->write( temp->handle, fci->data_out, block->compressed,
-                        &err, fci->pv ) != block->compressed)
-        {
-            close_temp_file( fci, temp );
-            set_error( fci, FCIERR_TEMP_FILE, err );
             return FALSE;
         }
         fci->pending_data_size += sizeof(CFDATA) + fci->ccab.cbReserveCFData + block->compressed;
@@ -576,13 +1309,15 @@ static BOOL write_folders( FCI_Int *fci, INT_PTR handle, cab_ULONG header_size,
     int err;
     CFFOLDER *cffolder = (CFFOLDER *)fci->data_out;
     cab_ULONG folder_size = sizeof(CFFOLDER) + fci->ccab.cbReserveCFFolder;
+    cab_ULONG data_start = header_size;
 
     memset( cffolder, 0, folder_size );
 
     /* write the folders */
     LIST_FOR_EACH_ENTRY( folder, &fci->folders_list, struct folder, entry )
     {
-        cffolder->coffCabStart = fci_endian_ulong( folder->data_start + header_size );
+        cffolder->coffCabStart = fci_endian_ulong( data_start );
+        data_start += folder->data_size;
         cffolder->cCFData      = fci_endian_uword( folder->data_count );
         cffolder->typeCompress = fci_endian_uword( folder->compression );
         if (fci->write( handle, cffolder, folder_size, &err, fci->pv ) != folder_size)
@@ -656,21 +1391,17 @@ static BOOL write_data_blocks( FCI_Int *fci, INT_PTR handle, PFNFCISTATUS status
 
     LIST_FOR_EACH_ENTRY( folder, &fci->folders_list, struct folder, entry )
     {
-        if (fci->seek( folder->data.handle, 0, SEEK_SET, &err, fci->pv ) != 0)
-        {
-            set_error( fci, FCIERR_CAB_FILE, err );
-            return FALSE;
-        }
+        if (!seek_temp_file( fci, &folder->data, 0 )) return FALSE;
         LIST_FOR_EACH_ENTRY( block, &folder->blocks_list, struct data_block, entry )
         {
-            len = fci->read( folder->data.handle, data, block->compressed, &err, fci->pv );
-            if (len != block->compressed) return FALSE;
+            if (!read_temp_file( fci, &folder->data, data, block->compressed )) return FALSE;
+            len = block->compressed;
 
             cfdata->cbData = fci_endian_uword( block->compressed );
             cfdata->cbUncomp = fci_endian_uword( block->uncompressed );
-            cfdata->csum = fci_endian_ulong( fci_get_checksum( &cfdata->cbData,
-                                                               header_size - FIELD_OFFSET(CFDATA, cbData),
-                                                               fci_get_checksum( data, len, 0 )));
+            cfdata->csum = fci_endian_ulong( cab_checksum( &cfdata->cbData,
+                                                           header_size - FIELD_OFFSET(CFDATA, cbData),
+                                                           cab_checksum( data, len, 0 )));
 
             fci->statusFolderCopied += len;
             len += header_size;
@@ -816,7 +1547,7 @@ static BOOL add_data_to_folder( FCI_Int *fci, struct folder *folder, cab_ULONG *
 
     /* move the temp file into the folder structure */
     folder->data = fci->data;
-    fci->data.handle = -1;
+    init_temp_file( &fci->data );
     fci->pending_data_size = 0;
 
     LIST_FOR_EACH_ENTRY_SAFE( block, next, &fci->blocks_list, struct data_block, entry )
@@ -857,6 +1588,7 @@ static BOOL add_data_to_folder( FCI_Int *fci, struct folder *folder, cab_ULONG *
         start_pos += new->compressed;
         current_size += sizeof(CFDATA) + fci->ccab.cbReserveCFData + new->compressed;
         fci->folders_data_size += sizeof(CFDATA) + fci->ccab.cbReserveCFData + new->compressed;
+        folder->data_size += sizeof(CFDATA) + fci->ccab.cbReserveCFData + new->compressed;
         fci->statusFolderCopied += new->compressed;
         (*payload) += new->uncompressed;
 
@@ -877,7 +1609,7 @@ static BOOL add_data_to_folder( FCI_Int *fci, struct folder *folder, cab_ULONG *
     }
 
     if (list_empty( &fci->blocks_list )) return TRUE;
-    return copy_data_blocks( fci, folder->data.handle, start_pos, &fci->data, status_callback );
+    return copy_data_blocks( fci, &folder->data, start_pos, &fci->data, status_callback );
 }
 
 /* add all pending files to folder */
@@ -948,162 +1680,6 @@ static BOOL add_files_to_folder( FCI_Int *fci, struct folder *folder, cab_ULONG
     return TRUE;
 }
 
-static cab_UWORD compress_NONE( FCI_Int *fci )
-{
-    memcpy( fci->data_out, fci->data_in, fci->cdata_in );
-    return fci->cdata_in;
-}
-
-static void shutdown_NONE(FCI_Int *fci)
-{
-}
-
-static void *zalloc( void *opaque, unsigned int items, unsigned int size )
-{
-    FCI_Int *fci = opaque;
-    return fci->alloc( items * size );
-}
-
-static void zfree( void *opaque, void *ptr )
-{
-    FCI_Int *fci = opaque;
-    fci->free( ptr );
-}
-
-static cab_UWORD compress_MSZIP( FCI_Int *fci )
-{
-    z_stream stream;
-
-    stream.zalloc = zalloc;
-    stream.zfree  = zfree;
-    stream.opaque = fci;
-    if (deflateInit2( &stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) != Z_OK)
-    {
-        set_error( fci, FCIERR_ALLOC_FAIL, ERROR_NOT_ENOUGH_MEMORY );
-        return 0;
-    }
-    stream.next_in   = fci->data_in;
-    stream.avail_in  = fci->cdata_in;
-    stream.next_out  = fci->data_out + 2;
-    stream.avail_out = sizeof(fci->data_out) - 2;
-    /* insert the signature */
-    fci->data_out[0] = 'C';
-    fci->data_out[1] = 'K';
-    deflate( &stream, Z_FINISH );
-    deflateEnd( &stream );
-    fci->have_data_out = TRUE;
-    return stream.total_out + 2;
-}
-
-static void shutdown_MSZIP( FCI_Int *fci )
-{
-}
-
-static void shutdown_LZX(FCI_Int *fci)
-{
-    liblzx_compress_destroy(fci->lzx_compressor);
-    fci->lzx_compressor = NULL;
-}
-
-static void *compress_LZX_alloc_callback(void *userdata, size_t size)
-{
-    FCI_Int *fci = (FCI_Int *)userdata;
-
-    return fci->alloc((ULONG)size);
-}
-
-static void compress_LZX_free_callback(void *userdata, void *ptr)
-{
-    FCI_Int *fci = (FCI_Int *)userdata;
-
-    fci->free(ptr);
-}
-
-static cab_UWORD compress_LZX(FCI_Int *fci)
-{
-    size_t in_digested = 0;
-    size_t compressed_size = 0;
-    const liblzx_output_chunk_t *out_chunk = NULL;
-
-    if (fci->cDataBlocksIn == 0) {
-        /* First block, restart compression */
-        int window_size_bits = LZXCompressionWindowFromTCOMP(fci->compression);
-        liblzx_compress_properties_t props;
-
-        if (fci->lzx_compressor)
-        {
-            liblzx_compress_destroy(fci->lzx_compressor);
-            fci->lzx_compressor = NULL;
-        }
-
-        memset(&props, 0, sizeof(props));
-        props.lzx_variant = LIBLZX_VARIANT_CAB_DELTA;
-        props.window_size = 1 << window_size_bits;
-        props.chunk_granularity = CAB_BLOCKMAX;
-        props.compression_level = 70;
-        props.e8_file_size = LIBLZX_CONST_DEFAULT_E8_FILE_SIZE;
-        props.alloc_func = compress_LZX_alloc_callback;
-        props.free_func = compress_LZX_free_callback;
-        props.userdata = fci;
-
-        fci->lzx_compressor = liblzx_compress_create(&props);
-
-        if (!fci->lzx_compressor)
-        {
-            set_error(fci, FCIERR_ALLOC_FAIL, ERROR_OUTOFMEMORY);
-            return 0;
-        }
-    }
-
-    while (in_digested < fci->cdata_in)
-    {
-        in_digested += liblzx_compress_add_input(fci->lzx_compressor, fci->data_in + in_digested, fci->cdata_in - in_digested);
-
-        if (out_chunk)
-        {
-            /* After producing an output chunk, all data should be digestable. */
-            assert(in_digested == fci->cdata_in);
-            break;
-        }
-
-        out_chunk = liblzx_compress_get_next_chunk(fci->lzx_compressor);
-
-        if (out_chunk)
-        {
-            compressed_size = out_chunk->size;
-            memcpy(fci->data_out, out_chunk->data, compressed_size);
-            liblzx_compress_release_next_chunk(fci->lzx_compressor);
-
-            fci->have_data_out = TRUE;
-        }
-    }
-
-    return compressed_size;
-}
-
-cab_UWORD flush_LZX(FCI_Int *fci)
-{
-    const liblzx_output_chunk_t *out_chunk = NULL;
-    cab_UWORD compressed_size = 0;
-
-    liblzx_compress_end_input(fci->lzx_compressor);
-    out_chunk = liblzx_compress_get_next_chunk(fci->lzx_compressor);
-
-    if (out_chunk == NULL)
-    {
-        return 0;
-    }
-
-    compressed_size = out_chunk->size;
-    memcpy(fci->data_out, out_chunk->data, out_chunk->size);
-
-    liblzx_compress_release_next_chunk(fci->lzx_compressor);
-
-    fci->have_data_out = TRUE;
-
-    return compressed_size;
-}
-
 /***********************************************************************
  *		FCICreate (CABINET.10)
  *
@@ -1165,6 +1741,7 @@ HFCI __cdecl FCICreate(
 	void *pv)
 {
   FCI_Int *p_fci_internal;
+  SYSTEM_INFO system_info;
 
   if (!perf) {
     SetLastError(ERROR_BAD_ARGUMENTS);
@@ -1206,13 +1783,19 @@ HFCI __cdecl FCICreate(
   p_fci_internal->ccab = *pccab;
   p_fci_internal->pccab = pccab;
   p_fci_internal->pv = pv;
-  p_fci_internal->data.handle = -1;
-  p_fci_internal->compress = compress_NONE;
-  p_fci_internal->compress_shutdown = shutdown_NONE;
+  init_temp_file( &p_fci_internal->data );
 
   list_init( &p_fci_internal->folders_list );
   list_init( &p_fci_internal->files_list );
   list_init( &p_fci_internal->blocks_list );
+  list_init( &p_fci_internal->jobs_list );
+  list_init( &p_fci_internal->free_blocks );
+  InitializeSRWLock( &p_fci_internal->jobs_lock );
+  InitializeConditionVariable( &p_fci_internal->jobs_cond );
+
+  /* folders are compressed in parallel, up to one per processor */
+  GetSystemInfo( &system_info );
+  p_fci_internal->max_jobs = max( system_info.dwNumberOfProcessors, 1 );
 
   memcpy(p_fci_internal->szPrevCab, pccab->szCab, CB_MAX_CABINET_NAME);
   memcpy(p_fci_internal->szPrevDisk, pccab->szDisk, CB_MAX_DISK_NAME);
@@ -1266,6 +1849,7 @@ static BOOL fci_flush_folder( FCI_Int *p_fci_internal,
 
   /* START of COPY */
   if (!add_data_blocks( p_fci_internal, TRUE, pfnfcis )) return FALSE;
+  if (!sync_jobs( p_fci_internal, fGetNextCab, pfnfcis )) return FALSE;
 
   /* reset to get the number of data blocks of this folder which are */
   /* actually in this cabinet ( at least partially ) */
@@ -1372,6 +1956,14 @@ static BOOL fci_flush_folder( FCI_Int *p_fci_internal,
 
   if (!(folder = add_folder( p_fci_internal ))) return FALSE;
   if (!add_data_to_folder( p_fci_internal, folder, &payload, pfnfcis )) return FALSE;
+
+  /* the rest of the folder is stored as its compression job completes */
+  if (p_fci_internal->job) {
+    payload += p_fci_internal->job->size_in - p_fci_internal->job->size_stored;
+    p_fci_internal->job->folder = folder;
+    p_fci_internal->job = NULL;
+  }
+
   if (!add_files_to_folder( p_fci_internal, folder, payload )) return FALSE;
 
   /* reset CFFolder specific information */
@@ -1419,6 +2011,7 @@ static BOOL fci_flush_cabinet( FCI_Int *p_fci_internal,
   }
 
   /* create the cabinet */
+  if (!wait_for_jobs( p_fci_internal, JOB_WAIT_ALL, pfnfcis )) return FALSE;
   if (!write_cabinet( p_fci_internal, pfnfcis )) return FALSE;
 
   p_fci_internal->fPrevCab=TRUE;
@@ -1562,6 +2155,7 @@ BOOL __cdecl FCIAddFile(
 	TCOMP                 typeCompress)
 {
   cab_ULONG read_result;
+  TCOMP compression;
   FCI_Int *p_fci_internal = get_fci_ptr( hfci );
 
   if (!p_fci_internal) return FALSE;
@@ -1572,7 +2166,11 @@ BOOL __cdecl FCIAddFile(
     return FALSE;
   }
 
-  if (typeCompress != p_fci_internal->compression)
+  /* the partition bits only affect where folders are split */
+  compression = typeCompress;
+  if ((compression & tcompMASK_TYPE) == tcompTYPE_LZX) compression &= ~tcompMASK_LZX_PARTITION;
+
+  if (compression != p_fci_internal->compression)
   {
       if ((typeCompress & tcompMASK_TYPE) == tcompTYPE_LZX) {
           TCOMP window_size_bits = (typeCompress & tcompMASK_LZX_WINDOW);
@@ -1585,34 +2183,28 @@ BOOL __cdecl FCIAddFile(
 
       if (!FCIFlushFolder( hfci, pfnfcignc, pfnfcis )) return FALSE;
 
-      p_fci_internal->compress_shutdown(p_fci_internal);
-
       switch (typeCompress & tcompMASK_TYPE)
       {
       case tcompTYPE_MSZIP:
-          p_fci_internal->compression       = tcompTYPE_MSZIP;
-          p_fci_internal->compress          = compress_MSZIP;
-          p_fci_internal->flush             = NULL;
-          p_fci_internal->compress_shutdown = shutdown_MSZIP;
+          p_fci_internal->compression = tcompTYPE_MSZIP;
           break;
       case tcompTYPE_LZX:
-          p_fci_internal->compression       = typeCompress;
-          p_fci_internal->compress          = compress_LZX;
-          p_fci_internal->flush             = flush_LZX;
-          p_fci_internal->compress_shutdown = shutdown_LZX;
+          p_fci_internal->compression = compression;
           break;
       default:
           FIXME( "compression %x not supported, defaulting to none\n", typeCompress );
           /* fall through */
       case tcompTYPE_NONE:
-          p_fci_internal->compression       = tcompTYPE_NONE;
-          p_fci_internal->compress          = compress_NONE;
-          p_fci_internal->flush             = NULL;
-          p_fci_internal->compress_shutdown = shutdown_NONE;
+          p_fci_internal->compression = tcompTYPE_NONE;
           break;
       }
   }
 
+  if ((p_fci_internal->compression & tcompMASK_TYPE) == tcompTYPE_LZX)
+      p_fci_internal->partition_size = get_partition_size( p_fci_internal, typeCompress );
+  else
+      p_fci_internal->partition_size = 0;
+
   /* TODO check if pszSourceFile??? */
 
   if(p_fci_internal->fGetNextCabInVain && p_fci_internal->fNextCab) {
@@ -1627,6 +2219,8 @@ BOOL __cdecl FCIAddFile(
     return FALSE;
   }
 
+  if (!sync_jobs( p_fci_internal, FALSE, pfnfcis )) return FALSE;
+
   /* REUSE the variable read_result */
   read_result=get_header_size( p_fci_internal ) + p_fci_internal->ccab.cbReserveCFFolder;
 
@@ -1692,6 +2286,7 @@ BOOL __cdecl FCIAddFile(
 
   if (!add_file_data( p_fci_internal, pszSourceFile, pszFileName, fExecute, pfnfcigoi, pfnfcis ))
       return FALSE;
+  if (!sync_jobs( p_fci_internal, FALSE, pfnfcis )) return FALSE;
 
   /* REUSE the variable read_result */
   read_result = get_header_size( p_fci_internal ) + p_fci_internal->ccab.cbReserveCFFolder;
@@ -1768,6 +2363,13 @@ BOOL __cdecl FCIAddFile(
   if (p_fci_internal->cCompressedBytesInFolder >= p_fci_internal->ccab.cbFolderThresh)
       return FCIFlushFolder(hfci, pfnfcignc, pfnfcis);
 
+  /* start a new folder once the partition size has been reached, this doesn't */
+  /* have to wait for the compressed size like the FolderThreshold */
+  if (p_fci_internal->partition_size &&
+      p_fci_internal->cDataBlocksIn * CAB_BLOCKMAX + p_fci_internal->cdata_in >=
+      p_fci_internal->partition_size)
+      return FCIFlushFolder(hfci, pfnfcignc, pfnfcis);
+
   return TRUE;
 } /* end of FCIAddFile */
 
@@ -1888,6 +2490,8 @@ BOOL __cdecl FCIDestroy(HFCI hfci)
     struct folder *folder, *folder_next;
     struct file *file, *file_next;
     struct data_block *block, *block_next;
+    struct folder_job *job, *job_next;
+    struct job_block *job_block, *job_block_next;
     FCI_Int *p_fci_internal = get_fci_ptr( hfci );
 
     if (!p_fci_internal) return FALSE;
@@ -1896,6 +2500,17 @@ BOOL __cdecl FCIDestroy(HFCI hfci)
     /* and deleted */
     p_fci_internal->magic = 0;
 
+    LIST_FOR_EACH_ENTRY_SAFE( job, job_next, &p_fci_internal->jobs_list, struct folder_job, entry )
+    {
+        free_job( p_fci_internal, job );
+    }
+    LIST_FOR_EACH_ENTRY_SAFE( job_block, job_block_next, &p_fci_internal->free_blocks, struct job_block, entry )
+    {
+        list_remove( &job_block->entry );
+        p_fci_internal->free( job_block );
+    }
+    if (p_fci_internal->read_buffer) p_fci_internal->free( p_fci_internal->read_buffer );
+
     LIST_FOR_EACH_ENTRY_SAFE( folder, folder_next, &p_fci_internal->folders_list, struct folder, entry )
     {
         free_folder( p_fci_internal, folder );
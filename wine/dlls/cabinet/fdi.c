@@ -71,11 +71,12 @@
 #include "fdi.h"
 #include "cabinet.h"
 
+#include "wine/list.h"
 #include "wine/debug.h"
 
-WINE_DEFAULT_DEBUG_CHANNEL(cabinet);
+#include "liblzx.h"
 
-THOSE_ZIP_CONSTS;
+WINE_DEFAULT_DEBUG_CHANNEL(cabinet);
 
 struct fdi_file {
   struct fdi_file *next;               /* next file in sequence          */
@@ -123,6 +124,16 @@ typedef struct
   PFNCLOSE     close;
   PFNSEEK      seek;
   PERF         perf;
+  unsigned int       max_jobs;
+  struct list        jobs_list;   /* folders being decoded ahead, in cabinet order */
+  unsigned int       job_count;
+  struct fdi_folder *job_folder;  /* next folder to start a job for, NULL for none */
+  unsigned int       job_index;   /* index of job_folder in the cabinet */
+  struct list        free_blocks; /* job block buffers available for reuse */
+  SRWLOCK            jobs_lock;
+  CONDITION_VARIABLE jobs_cond;
+  struct list        checkpoints_list;  /* checkpoints of the LZX folders decoded so far */
+  cab_ULONG          checkpoint_memory; /* size of all the checkpoints */
 } FDI_Int;
 
 #define FDI_INT_MAGIC 0xfdfdfd05
@@ -158,17 +169,17 @@ typedef struct fdi_cds_fwd {
   cab_UBYTE extra_bits[51];
   USHORT  setID;                   /* Cabinet set ID */
   USHORT  iCabinet;                /* Cabinet number in set (0 based) */
+  cab_ULONG cabsize;               /* Cabinet size */
   struct fdi_cds_fwd *decomp_cab;
+  struct folder_job *job;          /* decoding job of the current folder    */
+  struct folder_checkpoints *checkpoints; /* of the current folder, if LZX  */
+  cab_ULONG decoded;               /* uncompressed size decoded in folder   */
   MORE_ISCAB_INFO mii;
   struct fdi_folder *firstfol; 
   struct fdi_file   *firstfile;
   struct fdi_cds_fwd *next;
 } fdi_decomp_state;
 
-#define ZIPNEEDBITS(n) {while(k<(n)){cab_LONG c=*(ZIP(inpos)++);\
-    b|=((cab_ULONG)c)<<k;k+=8;}}
-#define ZIPDUMPBITS(n) {b>>=(n);k-=(n);}
-
 /* endian-neutral reading of little-endian data */
 #define EndGetI32(a)  ((((a)[3])<<24)|(((a)[2])<<16)|(((a)[1])<<8)|((a)[0]))
 #define EndGetI16(a)  ((((a)[1])<<8)|((a)[0]))
@@ -264,112 +275,131 @@ static void QTMupdatemodel(struct QTMmodel *model, int sym) {
 /*************************************************************************
  * make_decode_table (internal)
  *
- * This function was coded by David Tritscher. It builds a fast huffman
- * decoding table out of just a canonical huffman code lengths table.
+ * Builds a fast huffman decoding table out of just a canonical huffman
+ * code lengths table.  Each entry holds the symbol and length of the code
+ * its index starts with (see ENTRY_SYM), so codes of up to nbits bits take
+ * one lookup; in the main tree, an entry can also hold a second literal.
+ * Entries for longer codes are 0, these are found by decode_long_code().
  *
  * PARAMS
  *   nsyms:  total number of symbols in this huffman tree.
  *   nbits:  any symbols with a code length of nbits or less can be decoded
  *           in one lookup of the table.
  *   length: A table to get code lengths from [0 to syms-1]
- *   table:  The table to fill up with decoded symbols and pointers.
+ *   table:  The table to fill up with decoded symbols.
+ *   sorted: Receives the symbols in code order.
+ *   limit:  Receives the 16-bit code following the codes of each length.
+ *   first:  Receives the index of the first sorted symbol of each length.
  *
  * RETURNS
  *   OK:    0
  *   error: 1
  */
 static int make_decode_table(cab_ULONG nsyms, cab_ULONG nbits,
-                             const cab_UBYTE *length, cab_UWORD *table) {
-  register cab_UWORD sym;
-  register cab_ULONG leaf;
-  register cab_UBYTE bit_num = 1;
-  cab_ULONG fill;
-  cab_ULONG pos         = 0; /* the current position in the decode table */
-  cab_ULONG table_mask  = 1 << nbits;
-  cab_ULONG bit_mask    = table_mask >> 1; /* don't do 0 length codes */
-  cab_ULONG next_symbol = bit_mask; /* base of allocation for long codes */
-
-  /* fill entries for codes short enough for a direct mapping */
-  while (bit_num <= nbits) {
-    for (sym = 0; sym < nsyms; sym++) {
-      if (length[sym] == bit_num) {
-        leaf = pos;
-
-        if((pos += bit_mask) > table_mask) return 1; /* table overrun */
-
-        /* fill all possible lookups of this symbol with the symbol itself */
-        fill = bit_mask;
-        while (fill-- > 0) table[leaf++] = sym;
-      }
-    }
-    bit_mask >>= 1;
-    bit_num++;
+                             const cab_UBYTE *length, cab_ULONG *table,
+                             cab_UWORD *sorted, cab_ULONG *limit,
+                             cab_UWORD *first) {
+  cab_UWORD count[17], next[17];
+  cab_ULONG sym, len, pos, leaf, fill, entry, code = 0;
+  cab_ULONG table_mask = (1 << nbits) - 1;
+  cab_LONG left = 1;
+
+  memset(count, 0, sizeof(count));
+  for (sym = 0; sym < nsyms; sym++) {
+    if (length[sym] > 16) return 1;
+    count[length[sym]]++;
   }
 
-  /* if there are any codes longer than nbits */
-  if (pos != table_mask) {
-    /* clear the remainder of the table */
-    for (sym = pos; sym < table_mask; sym++) table[sym] = 0;
-
-    /* give ourselves room for codes to grow by up to 16 more bits */
-    pos <<= 16;
-    table_mask <<= 16;
-    bit_mask = 1 << 15;
-
-    while (bit_num <= 16) {
-      for (sym = 0; sym < nsyms; sym++) {
-        if (length[sym] == bit_num) {
-          leaf = pos >> 16;
-          for (fill = 0; fill < bit_num - nbits; fill++) {
-            /* if this path hasn't been taken yet, 'allocate' two entries */
-            if (table[leaf] == 0) {
-              table[(next_symbol << 1)] = 0;
-              table[(next_symbol << 1) + 1] = 0;
-              table[leaf] = next_symbol++;
-            }
-            /* follow the path and select either left or right for next bit */
-            leaf = table[leaf] << 1;
-            if ((pos >> (15-fill)) & 1) leaf++;
-          }
-          table[leaf] = sym;
+  /* the code must be complete, unless all elements are 0 */
+  for (len = 1; len <= 16; len++) {
+    left = (left << 1) - count[len];
+    if (left < 0) return 1; /* over-subscribed */
+  }
+  if (left) {
+    if (count[0] != nsyms) return 1;
+    memset(table, 0, sizeof(*table) << nbits);
+    memset(limit, 0, sizeof(*limit) * 17);
+    return 0;
+  }
 
-          if ((pos += bit_mask) > table_mask) return 1; /* table overflow */
-        }
+  /* sort the symbols by code length, then by symbol */
+  next[0] = next[1] = 0;
+  for (len = 1; len < 16; len++) next[len + 1] = next[len] + count[len];
+  memcpy(first, next, sizeof(next));
+  for (sym = 0; sym < nsyms; sym++)
+    if (length[sym]) sorted[next[length[sym]]++] = sym;
+
+  /* assign the codes as left-justified 16-bit values, filling all possible
+   * lookups of the short ones */
+  limit[0] = 0;
+  for (len = 1, pos = 0; len <= 16; len++) {
+    for (fill = count[len]; fill > 0; fill--, pos++) {
+      if (len <= nbits) {
+        cab_ULONG end = (code >> (16 - nbits)) + (1 << (nbits - len));
+
+        entry = (sorted[pos] << 5) | len;
+        for (leaf = code >> (16 - nbits); leaf < end; leaf++) table[leaf] = entry;
       }
-      bit_mask >>= 1;
-      bit_num++;
+      code += 1 << (16 - len);
     }
+    limit[len] = code;
   }
 
-  /* full table? */
-  if (pos == table_mask) return 0;
-
-  /* either erroneous table, or all elements are 0 - let's find out. */
-  for (sym = 0; sym < nsyms; sym++) if (length[sym]) return 1;
+  /* the rest of the table leads to longer codes */
+  for (leaf = limit[nbits] >> (16 - nbits); leaf <= table_mask; leaf++) table[leaf] = 0;
+
+  /* pair up literals that fit in one lookup together */
+  if (nsyms > LZX_NUM_CHARS) {
+    for (leaf = 0; leaf <= table_mask; leaf++) {
+      entry = table[leaf];
+      len = ENTRY_LEN(entry);
+      if (!len || len >= nbits || ENTRY_SYM(entry) >= LZX_NUM_CHARS) continue;
+      code = table[(leaf << len) & table_mask];
+      if (ENTRY_LEN(code) && ENTRY_SYM(code) < LZX_NUM_CHARS &&
+          len + ENTRY_LEN(code) <= nbits) {
+        table[leaf] = entry | (ENTRY_SYM(code) << 15) | ((len + ENTRY_LEN(code)) << 23);
+      }
+    }
+  }
   return 0;
 }
 
 /*************************************************************************
- * checksum (internal)
+ * decode_long_code (internal)
+ *
+ * Decodes a code longer than nbits from the next 16 bits of input, using
+ * the symbols and limits from make_decode_table().  Returns the table entry
+ * for the code, or 0 if the bits aren't a code.
  */
-static cab_ULONG checksum(const cab_UBYTE *data, cab_UWORD bytes, cab_ULONG csum) {
-  int len;
-  cab_ULONG ul = 0;
+static cab_ULONG decode_long_code(const cab_UWORD *sorted, const cab_ULONG *limit,
+                                  const cab_UWORD *first, cab_ULONG nbits, cab_ULONG code) {
+  cab_ULONG len;
 
-  for (len = bytes >> 2; len--; data += 4) {
-    csum ^= ((data[0]) | (data[1]<<8) | (data[2]<<16) | (data[3]<<24));
+  for (len = nbits + 1; len <= 16; len++) {
+    if (code < limit[len])
+      return (sorted[first[len] + ((code - limit[len - 1]) >> (16 - len))] << 5) | len;
   }
+  return 0;
+}
 
-  switch (bytes & 3) {
-  case 3: ul |= *data++ << 16;
-  /* fall through */
-  case 2: ul |= *data++ <<  8;
-  /* fall through */
-  case 1: ul |= *data;
-  }
-  csum ^= ul;
+/*************************************************************************
+ * lzx_read_words (internal)
+ *
+ * Reads the next two little-endian 16-bit words of LZX input as one 32-bit
+ * value, first word in the high half.  Past the end of the input, the words
+ * read as zeroes.
+ */
+static inline cab_ULONG lzx_read_words(const cab_UBYTE *inpos, const cab_UBYTE *endinp) {
+  cab_UBYTE b[4];
+  int i;
 
-  return csum;
+  if (endinp - inpos >= 4) {
+    return ((cab_ULONG) inpos[1] << 24) | ((cab_ULONG) inpos[0] << 16) |
+           ((cab_ULONG) inpos[3] << 8) | inpos[2];
+  }
+  for (i = 0; i < 4; i++) b[i] = (inpos + i < endinp) ? inpos[i] : 0;
+  return ((cab_ULONG) b[1] << 24) | ((cab_ULONG) b[0] << 16) |
+         ((cab_ULONG) b[3] << 8) | b[2];
 }
 
 /***********************************************************************
@@ -423,6 +453,7 @@ HFDI __cdecl FDICreate(
 	PERF     perf)
 {
   FDI_Int *fdi;
+  SYSTEM_INFO system_info;
 
   TRACE("(pfnalloc == ^%p, pfnfree == ^%p, pfnopen == ^%p, pfnread == ^%p, pfnwrite == ^%p, "
         "pfnclose == ^%p, pfnseek == ^%p, cpuType == %d, perf == ^%p)\n",
@@ -457,6 +488,18 @@ HFDI __cdecl FDICreate(
      for the 16-bit versions in Windows anyhow... */
   fdi->perf = perf;
 
+  /* folders are decoded ahead in parallel, up to one per processor */
+  GetSystemInfo(&system_info);
+  fdi->max_jobs = max(system_info.dwNumberOfProcessors, 1);
+  list_init(&fdi->jobs_list);
+  fdi->job_count = 0;
+  fdi->job_folder = NULL;
+  list_init(&fdi->free_blocks);
+  InitializeSRWLock(&fdi->jobs_lock);
+  InitializeConditionVariable(&fdi->jobs_cond);
+  list_init(&fdi->checkpoints_list);
+  fdi->checkpoint_memory = 0;
+
   return (HFDI)fdi;
 }
 
@@ -859,547 +902,42 @@ static int NONEfdi_decomp(int inlen, int outlen, fdi_decomp_state *decomp_state)
   return DECR_OK;
 }
 
-/********************************************************
- * Ziphuft_free (internal)
- */
-static void fdi_Ziphuft_free(FDI_Int *fdi, struct Ziphuft *t)
+static void *zalloc(void *opaque, unsigned int items, unsigned int size)
 {
-  register struct Ziphuft *p, *q;
-
-  /* Go through linked list, freeing from the allocated (t[-1]) address. */
-  p = t;
-  while (p != NULL)
-  {
-    q = (--p)->v.t;
-    fdi->free(p);
-    p = q;
-  } 
+  FDI_Int *fdi = opaque;
+  return fdi->alloc(items * size);
 }
 
-/*********************************************************
- * fdi_Ziphuft_build (internal)
- */
-static cab_LONG fdi_Ziphuft_build(cab_ULONG *b, cab_ULONG n, cab_ULONG s, const cab_UWORD *d, const cab_UWORD *e,
-struct Ziphuft **t, cab_LONG *m, fdi_decomp_state *decomp_state)
+static void zfree(void *opaque, void *ptr)
 {
-  cab_ULONG a;                   	/* counter for codes of length k */
-  cab_ULONG el;                  	/* length of EOB code (value 256) */
-  cab_ULONG f;                   	/* i repeats in table every f entries */
-  cab_LONG g;                    	/* maximum code length */
-  cab_LONG h;                    	/* table level */
-  register cab_ULONG i;          	/* counter, current code */
-  register cab_ULONG j;          	/* counter */
-  register cab_LONG k;           	/* number of bits in current code */
-  cab_LONG *l;                  	/* stack of bits per table */
-  register cab_ULONG *p;         	/* pointer into ZIP(c)[],ZIP(b)[],ZIP(v)[] */
-  register struct Ziphuft *q;           /* points to current table */
-  struct Ziphuft r;                     /* table entry for structure assignment */
-  register cab_LONG w;                  /* bits before this table == (l * h) */
-  cab_ULONG *xp;                 	/* pointer into x */
-  cab_LONG y;                           /* number of dummy codes added */
-  cab_ULONG z;                   	/* number of entries in current table */
-
-  l = ZIP(lx)+1;
-
-  /* Generate counts for each bit length */
-  el = n > 256 ? b[256] : ZIPBMAX; /* set length of EOB code, if any */
-
-  for(i = 0; i < ZIPBMAX+1; ++i)
-    ZIP(c)[i] = 0;
-  p = b;  i = n;
-  do
-  {
-    ZIP(c)[*p]++; p++;               /* assume all entries <= ZIPBMAX */
-  } while (--i);
-  if (ZIP(c)[0] == n)                /* null input--all zero length codes */
-  {
-    *t = NULL;
-    *m = 0;
-    return 0;
-  }
-
-  /* Find minimum and maximum length, bound *m by those */
-  for (j = 1; j <= ZIPBMAX; j++)
-    if (ZIP(c)[j])
-      break;
-  k = j;                        /* minimum code length */
-  if ((cab_ULONG)*m < j)
-    *m = j;
-  for (i = ZIPBMAX; i; i--)
-    if (ZIP(c)[i])
-      break;
-  g = i;                        /* maximum code length */
-  if ((cab_ULONG)*m > i)
-    *m = i;
-
-  /* Adjust last length count to fill out codes, if needed */
-  for (y = 1 << j; j < i; j++, y <<= 1)
-    if ((y -= ZIP(c)[j]) < 0)
-      return 2;                 /* bad input: more codes than bits */
-  if ((y -= ZIP(c)[i]) < 0)
-    return 2;
-  ZIP(c)[i] += y;
-
-  /* Generate starting offsets LONGo the value table for each length */
-  ZIP(x)[1] = j = 0;
-  p = ZIP(c) + 1;  xp = ZIP(x) + 2;
-  while (--i)
-  {                 /* note that i == g from above */
-    *xp++ = (j += *p++);
-  }
-
-  /* Make a table of values in order of bit lengths */
-  p = b;  i = 0;
-  do{
-    if ((j = *p++) != 0)
-      ZIP(v)[ZIP(x)[j]++] = i;
-  } while (++i < n);
-
-
-  /* Generate the Huffman codes and for each, make the table entries */
-  ZIP(x)[0] = i = 0;                 /* first Huffman code is zero */
-  p = ZIP(v);                        /* grab values in bit order */
-  h = -1;                       /* no tables yet--level -1 */
-  w = l[-1] = 0;                /* no bits decoded yet */
-  ZIP(u)[0] = NULL;             /* just to keep compilers happy */
-  q = NULL;                     /* ditto */
-  z = 0;                        /* ditto */
-
-  /* go through the bit lengths (k already is bits in shortest code) */
-  for (; k <= g; k++)
-  {
-    a = ZIP(c)[k];
-    while (a--)
-    {
-      /* here i is the Huffman code of length k bits for value *p */
-      /* make tables up to required level */
-      while (k > w + l[h])
-      {
-        w += l[h++];            /* add bits already decoded */
-
-        /* compute minimum size table less than or equal to *m bits */
-        if ((z = g - w) > (cab_ULONG)*m)    /* upper limit */
-          z = *m;
-        if ((f = 1 << (j = k - w)) > a + 1)     /* try a k-w bit table */
-        {                       /* too few codes for k-w bit table */
-          f -= a + 1;           /* deduct codes from patterns left */
-          xp = ZIP(c) + k;
-          while (++j < z)       /* try smaller tables up to z bits */
-          {
-            if ((f <<= 1) <= *++xp)
-              break;            /* enough codes to use up j bits */
-            f -= *xp;           /* else deduct codes from patterns */
-          }
-        }
-        if ((cab_ULONG)w + j > el && (cab_ULONG)w < el)
-          j = el - w;           /* make EOB code end at table */
-        z = 1 << j;             /* table entries for j-bit table */
-        l[h] = j;               /* set table size in stack */
-
-        /* allocate and link in new table */
-        if (!(q = CAB(fdi)->alloc((z + 1)*sizeof(struct Ziphuft))))
-        {
-          if(h)
-            fdi_Ziphuft_free(CAB(fdi), ZIP(u)[0]);
-          return 3;             /* not enough memory */
-        }
-        *t = q + 1;             /* link to list for Ziphuft_free() */
-        *(t = &(q->v.t)) = NULL;
-        ZIP(u)[h] = ++q;             /* table starts after link */
-
-        /* connect to last table, if there is one */
-        if (h)
-        {
-          ZIP(x)[h] = i;              /* save pattern for backing up */
-          r.b = (cab_UBYTE)l[h-1];    /* bits to dump before this table */
-          r.e = (cab_UBYTE)(16 + j);  /* bits in this table */
-          r.v.t = q;                  /* pointer to this table */
-          j = (i & ((1 << w) - 1)) >> (w - l[h-1]);
-          ZIP(u)[h-1][j] = r;        /* connect to last table */
-        }
-      }
-
-      /* set up table entry in r */
-      r.b = (cab_UBYTE)(k - w);
-      if (p >= ZIP(v) + n)
-        r.e = 99;               /* out of values--invalid code */
-      else if (*p < s)
-      {
-        r.e = (cab_UBYTE)(*p < 256 ? 16 : 15);    /* 256 is end-of-block code */
-        r.v.n = *p++;           /* simple code is just the value */
-      }
-      else
-      {
-        r.e = (cab_UBYTE)e[*p - s];   /* non-simple--look up in lists */
-        r.v.n = d[*p++ - s];
-      }
-
-      /* fill code-like entries with r */
-      f = 1 << (k - w);
-      for (j = i >> w; j < z; j += f)
-        q[j] = r;
-
-      /* backwards increment the k-bit code i */
-      for (j = 1 << (k - 1); i & j; j >>= 1)
-        i ^= j;
-      i ^= j;
-
-      /* backup over finished tables */
-      while ((i & ((1 << w) - 1)) != ZIP(x)[h])
-        w -= l[--h];            /* don't need to update q */
-    }
-  }
-
-  /* return actual size of base table */
-  *m = l[0];
-
-  /* Return true (1) if we were given an incomplete table */
-  return y != 0 && g != 1;
+  FDI_Int *fdi = opaque;
+  fdi->free(ptr);
 }
 
-/*********************************************************
- * fdi_Zipinflate_codes (internal)
- */
-static cab_LONG fdi_Zipinflate_codes(const struct Ziphuft *tl, const struct Ziphuft *td,
-  cab_LONG bl, cab_LONG bd, fdi_decomp_state *decomp_state)
-{
-  register cab_ULONG e;     /* table entry flag/number of extra bits */
-  cab_ULONG n, d;           /* length and index for copy */
-  cab_ULONG w;              /* current window position */
-  const struct Ziphuft *t;  /* pointer to table entry */
-  cab_ULONG ml, md;         /* masks for bl and bd bits */
-  register cab_ULONG b;     /* bit buffer */
-  register cab_ULONG k;     /* number of bits in bit buffer */
-
-  /* make local copies of globals */
-  b = ZIP(bb);                       /* initialize bit buffer */
-  k = ZIP(bk);
-  w = ZIP(window_posn);                       /* initialize window position */
-
-  /* inflate the coded data */
-  ml = Zipmask[bl];           	/* precompute masks for speed */
-  md = Zipmask[bd];
-
-  for(;;)
-  {
-    ZIPNEEDBITS((cab_ULONG)bl)
-    if((e = (t = tl + (b & ml))->e) > 16)
-      do
-      {
-        if (e == 99)
-          return 1;
-        ZIPDUMPBITS(t->b)
-        e -= 16;
-        ZIPNEEDBITS(e)
-      } while ((e = (t = t->v.t + (b & Zipmask[e]))->e) > 16);
-    ZIPDUMPBITS(t->b)
-    if (e == 16)                /* then it's a literal */
-      CAB(outbuf)[w++] = (cab_UBYTE)t->v.n;
-    else                        /* it's an EOB or a length */
-    {
-      /* exit if end of block */
-      if(e == 15)
-        break;
-
-      /* get length of block to copy */
-      ZIPNEEDBITS(e)
-      n = t->v.n + (b & Zipmask[e]);
-      ZIPDUMPBITS(e);
-
-      /* decode distance of block to copy */
-      ZIPNEEDBITS((cab_ULONG)bd)
-      if ((e = (t = td + (b & md))->e) > 16)
-        do {
-          if (e == 99)
-            return 1;
-          ZIPDUMPBITS(t->b)
-          e -= 16;
-          ZIPNEEDBITS(e)
-        } while ((e = (t = t->v.t + (b & Zipmask[e]))->e) > 16);
-      ZIPDUMPBITS(t->b)
-      ZIPNEEDBITS(e)
-      d = w - t->v.n - (b & Zipmask[e]);
-      ZIPDUMPBITS(e)
-      do
-      {
-        d &= ZIPWSIZE - 1;
-        e = ZIPWSIZE - max(d, w);
-        e = min(e, n);
-        n -= e;
-        do
-        {
-          CAB(outbuf)[w++] = CAB(outbuf)[d++];
-        } while (--e);
-      } while (n);
-    }
-  }
-
-  /* restore the globals from the locals */
-  ZIP(window_posn) = w;              /* restore global window pointer */
-  ZIP(bb) = b;                       /* restore global bit buffer */
-  ZIP(bk) = k;
-
-  /* done */
-  return 0;
-}
-
-/***********************************************************
- * Zipinflate_stored (internal)
- */
-static cab_LONG fdi_Zipinflate_stored(fdi_decomp_state *decomp_state)
-/* "decompress" an inflated type 0 (stored) block. */
-{
-  cab_ULONG n;           /* number of bytes in block */
-  cab_ULONG w;           /* current window position */
-  register cab_ULONG b;  /* bit buffer */
-  register cab_ULONG k;  /* number of bits in bit buffer */
-
-  /* make local copies of globals */
-  b = ZIP(bb);                       /* initialize bit buffer */
-  k = ZIP(bk);
-  w = ZIP(window_posn);              /* initialize window position */
-
-  /* go to byte boundary */
-  n = k & 7;
-  ZIPDUMPBITS(n);
-
-  /* get the length and its complement */
-  ZIPNEEDBITS(16)
-  n = (b & 0xffff);
-  ZIPDUMPBITS(16)
-  ZIPNEEDBITS(16)
-  if (n != ((~b) & 0xffff))
-    return 1;                   /* error in compressed data */
-  ZIPDUMPBITS(16)
-
-  /* read and output the compressed data */
-  while(n--)
-  {
-    ZIPNEEDBITS(8)
-    CAB(outbuf)[w++] = (cab_UBYTE)b;
-    ZIPDUMPBITS(8)
-  }
-
-  /* restore the globals from the locals */
-  ZIP(window_posn) = w;              /* restore global window pointer */
-  ZIP(bb) = b;                       /* restore global bit buffer */
-  ZIP(bk) = k;
-  return 0;
-}
-
-/******************************************************
- * fdi_Zipinflate_fixed (internal)
- */
-static cab_LONG fdi_Zipinflate_fixed(fdi_decomp_state *decomp_state)
-{
-  struct Ziphuft *fixed_tl;
-  struct Ziphuft *fixed_td;
-  cab_LONG fixed_bl, fixed_bd;
-  cab_LONG i;                /* temporary variable */
-  cab_ULONG *l;
-
-  l = ZIP(ll);
-
-  /* literal table */
-  for(i = 0; i < 144; i++)
-    l[i] = 8;
-  for(; i < 256; i++)
-    l[i] = 9;
-  for(; i < 280; i++)
-    l[i] = 7;
-  for(; i < 288; i++)          /* make a complete, but wrong code set */
-    l[i] = 8;
-  fixed_bl = 7;
-  if((i = fdi_Ziphuft_build(l, 288, 257, Zipcplens, Zipcplext, &fixed_tl, &fixed_bl, decomp_state)))
-    return i;
-
-  /* distance table */
-  for(i = 0; i < 30; i++)      /* make an incomplete code set */
-    l[i] = 5;
-  fixed_bd = 5;
-  if((i = fdi_Ziphuft_build(l, 30, 0, Zipcpdist, Zipcpdext, &fixed_td, &fixed_bd, decomp_state)) > 1)
-  {
-    fdi_Ziphuft_free(CAB(fdi), fixed_tl);
-    return i;
-  }
-
-  /* decompress until an end-of-block code */
-  i = fdi_Zipinflate_codes(fixed_tl, fixed_td, fixed_bl, fixed_bd, decomp_state);
-
-  fdi_Ziphuft_free(CAB(fdi), fixed_td);
-  fdi_Ziphuft_free(CAB(fdi), fixed_tl);
-  return i;
-}
-
-/**************************************************************
- * fdi_Zipinflate_dynamic (internal)
+/********************************************************
+ * ZIPfdi_init (internal)
+ *
+ * The inflate state and its window are allocated once per folder, so that
+ * decoding a block doesn't call the allocation callbacks and can be done on
+ * a worker thread.
  */
-static cab_LONG fdi_Zipinflate_dynamic(fdi_decomp_state *decomp_state)
- /* decompress an inflated type 2 (dynamic Huffman codes) block. */
+static int ZIPfdi_init(fdi_decomp_state *decomp_state)
 {
-  cab_LONG i;          	/* temporary variables */
-  cab_ULONG j;
-  cab_ULONG *ll;
-  cab_ULONG l;           	/* last length */
-  cab_ULONG m;           	/* mask for bit lengths table */
-  cab_ULONG n;           	/* number of lengths to get */
-  struct Ziphuft *tl;           /* literal/length code table */
-  struct Ziphuft *td;           /* distance code table */
-  cab_LONG bl;                  /* lookup bits for tl */
-  cab_LONG bd;                  /* lookup bits for td */
-  cab_ULONG nb;          	/* number of bit length codes */
-  cab_ULONG nl;          	/* number of literal/length codes */
-  cab_ULONG nd;          	/* number of distance codes */
-  register cab_ULONG b;         /* bit buffer */
-  register cab_ULONG k;	        /* number of bits in bit buffer */
-
-  /* make local bit buffer */
-  b = ZIP(bb);
-  k = ZIP(bk);
-  ll = ZIP(ll);
-
-  /* read in table lengths */
-  ZIPNEEDBITS(5)
-  nl = 257 + (b & 0x1f);      /* number of literal/length codes */
-  ZIPDUMPBITS(5)
-  ZIPNEEDBITS(5)
-  nd = 1 + (b & 0x1f);        /* number of distance codes */
-  ZIPDUMPBITS(5)
-  ZIPNEEDBITS(4)
-  nb = 4 + (b & 0xf);         /* number of bit length codes */
-  ZIPDUMPBITS(4)
-  if(nl > 288 || nd > 32)
-    return 1;                   /* bad lengths */
-
-  /* read in bit-length-code lengths */
-  for(j = 0; j < nb; j++)
-  {
-    ZIPNEEDBITS(3)
-    ll[Zipborder[j]] = b & 7;
-    ZIPDUMPBITS(3)
-  }
-  for(; j < 19; j++)
-    ll[Zipborder[j]] = 0;
-
-  /* build decoding table for trees--single level, 7 bit lookup */
-  bl = 7;
-  if((i = fdi_Ziphuft_build(ll, 19, 19, NULL, NULL, &tl, &bl, decomp_state)) != 0)
-  {
-    if(i == 1)
-      fdi_Ziphuft_free(CAB(fdi), tl);
-    return i;                   /* incomplete code set */
-  }
-
-  /* read in literal and distance code lengths */
-  n = nl + nd;
-  m = Zipmask[bl];
-  i = l = 0;
-  while((cab_ULONG)i < n)
-  {
-    ZIPNEEDBITS((cab_ULONG)bl)
-    j = (td = tl + (b & m))->b;
-    ZIPDUMPBITS(j)
-    j = td->v.n;
-    if (j < 16)                 /* length of code in bits (0..15) */
-      ll[i++] = l = j;          /* save last length in l */
-    else if (j == 16)           /* repeat last length 3 to 6 times */
-    {
-      ZIPNEEDBITS(2)
-      j = 3 + (b & 3);
-      ZIPDUMPBITS(2)
-      if((cab_ULONG)i + j > n)
-        return 1;
-      while (j--)
-        ll[i++] = l;
-    }
-    else if (j == 17)           /* 3 to 10 zero length codes */
-    {
-      ZIPNEEDBITS(3)
-      j = 3 + (b & 7);
-      ZIPDUMPBITS(3)
-      if ((cab_ULONG)i + j > n)
-        return 1;
-      while (j--)
-        ll[i++] = 0;
-      l = 0;
-    }
-    else                        /* j == 18: 11 to 138 zero length codes */
-    {
-      ZIPNEEDBITS(7)
-      j = 11 + (b & 0x7f);
-      ZIPDUMPBITS(7)
-      if ((cab_ULONG)i + j > n)
-        return 1;
-      while (j--)
-        ll[i++] = 0;
-      l = 0;
-    }
-  }
-
-  /* free decoding table for trees */
-  fdi_Ziphuft_free(CAB(fdi), tl);
-
-  /* restore the global bit buffer */
-  ZIP(bb) = b;
-  ZIP(bk) = k;
-
-  /* build the decoding tables for literal/length and distance codes */
-  bl = ZIPLBITS;
-  if((i = fdi_Ziphuft_build(ll, nl, 257, Zipcplens, Zipcplext, &tl, &bl, decomp_state)) != 0)
-  {
-    if(i == 1)
-      fdi_Ziphuft_free(CAB(fdi), tl);
-    return i;                   /* incomplete code set */
+  static const Bytef dummy;
+  z_stream *stream = &ZIP(stream);
+
+  stream->zalloc = zalloc;
+  stream->zfree  = zfree;
+  stream->opaque = CAB(fdi);
+  if (inflateInit2(stream, -MAX_WBITS) != Z_OK) return DECR_NOMEMORY;
+
+  /* zlib allocates the window along with the first dictionary */
+  if (inflateSetDictionary(stream, &dummy, 1) != Z_OK) {
+    inflateEnd(stream);
+    return DECR_NOMEMORY;
   }
-  bd = ZIPDBITS;
-  fdi_Ziphuft_build(ll + nl, nd, 0, Zipcpdist, Zipcpdext, &td, &bd, decomp_state);
-
-  /* decompress until an end-of-block code */
-  if(fdi_Zipinflate_codes(tl, td, bl, bd, decomp_state))
-    return 1;
-
-  /* free the decoding tables, return */
-  fdi_Ziphuft_free(CAB(fdi), tl);
-  fdi_Ziphuft_free(CAB(fdi), td);
-  return 0;
-}
-
-/*****************************************************
- * fdi_Zipinflate_block (internal)
- */
-static cab_LONG fdi_Zipinflate_block(cab_LONG *e, fdi_decomp_state *decomp_state) /* e == last block flag */
-{ /* decompress an inflated block */
-  cab_ULONG t;           	/* block type */
-  register cab_ULONG b;     /* bit buffer */
-  register cab_ULONG k;     /* number of bits in bit buffer */
-
-  /* make local bit buffer */
-  b = ZIP(bb);
-  k = ZIP(bk);
-
-  /* read in last block bit */
-  ZIPNEEDBITS(1)
-  *e = (cab_LONG)b & 1;
-  ZIPDUMPBITS(1)
-
-  /* read in block type */
-  ZIPNEEDBITS(2)
-  t = b & 3;
-  ZIPDUMPBITS(2)
-
-  /* restore the global bit buffer */
-  ZIP(bb) = b;
-  ZIP(bk) = k;
-
-  /* inflate that block type */
-  if(t == 2)
-    return fdi_Zipinflate_dynamic(decomp_state);
-  if(t == 0)
-    return fdi_Zipinflate_stored(decomp_state);
-  if(t == 1)
-    return fdi_Zipinflate_fixed(decomp_state);
-  /* bad block type */
-  return 2;
+  ZIP(dict_size) = 0;
+  return DECR_OK;
 }
 
 /****************************************************
@@ -1407,26 +945,33 @@ static cab_LONG fdi_Zipinflate_block(cab_LONG *e, fdi_decomp_state *decomp_state
  */
 static int ZIPfdi_decomp(int inlen, int outlen, fdi_decomp_state *decomp_state)
 {
-  cab_LONG e;               /* last block flag */
+  z_stream *stream = &ZIP(stream);
+  int ret;
 
   TRACE("(inlen == %d, outlen == %d)\n", inlen, outlen);
 
-  ZIP(inpos) = CAB(inbuf);
-  ZIP(bb) = ZIP(bk) = ZIP(window_posn) = 0;
   if(outlen > ZIPWSIZE)
     return DECR_DATAFORMAT;
 
   /* CK = Chris Kirmse, official Microsoft purloiner */
-  if(ZIP(inpos)[0] != 0x43 || ZIP(inpos)[1] != 0x4B)
+  if(inlen < 2 || CAB(inbuf)[0] != 0x43 || CAB(inbuf)[1] != 0x4B)
     return DECR_ILLEGALDATA;
-  ZIP(inpos) += 2;
 
-  do {
-    if(fdi_Zipinflate_block(&e, decomp_state))
-      return DECR_ILLEGALDATA;
-  } while(!e);
+  /* every block is a separate deflate stream, which can refer to the data of
+   * the previous block of the folder, still in outbuf */
+  inflateReset(stream);
+  if (ZIP(dict_size) && inflateSetDictionary(stream, CAB(outbuf), ZIP(dict_size)) != Z_OK)
+    return DECR_ILLEGALDATA;
 
-  /* return success */
+  stream->next_in   = CAB(inbuf) + 2;
+  stream->avail_in  = inlen - 2;
+  stream->next_out  = CAB(outbuf);
+  stream->avail_out = outlen;
+  ret = inflate(stream, Z_FINISH);
+  if (ret != Z_STREAM_END || stream->avail_out)
+    return DECR_ILLEGALDATA;
+
+  ZIP(dict_size) = outlen;
   return DECR_OK;
 }
 
@@ -1560,13 +1105,13 @@ static int QTMfdi_decomp(int inlen, int outlen, fdi_decomp_state *decomp_state)
  */
 static int fdi_lzx_read_lens(cab_UBYTE *lens, cab_ULONG first, cab_ULONG last, struct lzx_bits *lb,
                   fdi_decomp_state *decomp_state) {
-  cab_ULONG i,j, x,y;
+  cab_ULONG i, x,y;
   int z;
 
-  register cab_ULONG bitbuf = lb->bb;
+  register cab_UQUAD bitbuf = lb->bb;
   register int bitsleft = lb->bl;
   cab_UBYTE *inpos = lb->ip;
-  cab_UWORD *hufftbl;
+  const cab_UBYTE *endinp = lb->ep;
   
   for (x = 0; x < 20; x++) {
     READ_BITS(y, 4);
@@ -1602,6 +1147,50 @@ static int fdi_lzx_read_lens(cab_UBYTE *lens, cab_ULONG first, cab_ULONG last, s
   return 0;
 }
 
+/*******************************************************
+ * lzx_copy_match (internal)
+ *
+ * Copies a match within the window.  Sources at least 8 bytes behind the
+ * destination are copied in words, with the last word overlapping the ones
+ * before it, a source 1 byte behind is a run of that byte, and other sources
+ * go byte by byte.  Never writes past the end of the match, since the window
+ * bytes after it are still needed for matches at the largest offsets.
+ */
+static inline void lzx_copy_match(cab_UBYTE *dest, const cab_UBYTE *src, int length) {
+  cab_UQUAD v;
+  cab_ULONG w;
+  int dist = dest - src;
+
+  if (dist >= 8) {
+    if (length >= 8) {
+      while (length > 8) {
+        memcpy(&v, src, sizeof(v)); memcpy(dest, &v, sizeof(v));
+        dest += 8; src += 8; length -= 8;
+      }
+      memcpy(&v, src + length - 8, sizeof(v)); memcpy(dest + length - 8, &v, sizeof(v));
+    }
+    else if (length >= 4) {
+      memcpy(&w, src, sizeof(w)); memcpy(dest, &w, sizeof(w));
+      memcpy(&w, src + length - 4, sizeof(w)); memcpy(dest + length - 4, &w, sizeof(w));
+    }
+    else if (length > 0) {
+      dest[0] = src[0]; dest[length >> 1] = src[length >> 1]; dest[length - 1] = src[length - 1];
+    }
+    return;
+  }
+  if (dist == 1) {
+    memset(dest, *src, length);
+    return;
+  }
+  if (src > dest) {
+    while (length >= 8) {
+      memcpy(&v, src, sizeof(v)); memcpy(dest, &v, sizeof(v));
+      dest += 8; src += 8; length -= 8;
+    }
+  }
+  while (length-- > 0) *dest++ = *src++;
+}
+
 /*******************************************************
  * LZXfdi_decomp(internal)
  */
@@ -1610,7 +1199,6 @@ static int LZXfdi_decomp(int inlen, int outlen, fdi_decomp_state *decomp_state)
   const cab_UBYTE *endinp = inpos + inlen;
   cab_UBYTE *window = LZX(window);
   cab_UBYTE *runsrc, *rundest;
-  cab_UWORD *hufftbl; /* used in READ_HUFFSYM macro as chosen decoding table */
 
   cab_ULONG window_posn = LZX(window_posn);
   cab_ULONG window_size = LZX(window_size);
@@ -1618,9 +1206,9 @@ static int LZXfdi_decomp(int inlen, int outlen, fdi_decomp_state *decomp_state)
   cab_ULONG R1 = LZX(R1);
   cab_ULONG R2 = LZX(R2);
 
-  register cab_ULONG bitbuf;
+  register cab_UQUAD bitbuf;
   register int bitsleft;
-  cab_ULONG match_offset, i,j,k; /* ijk used in READ_HUFFSYM macro */
+  cab_ULONG match_offset, i,j,k; /* i used in READ_HUFFSYM macro */
   struct lzx_bits lb; /* used in READ_LENGTHS macro */
 
   int togo = outlen, this_run, main_element, aligned_bits;
@@ -1671,10 +1259,15 @@ static int LZXfdi_decomp(int inlen, int outlen, fdi_decomp_state *decomp_state)
       case LZX_BLOCKTYPE_UNCOMPRESSED:
         LZX(intel_started) = 1; /* because we can't assume otherwise */
         ENSURE_BITS(16); /* get up to 16 pad bits into the buffer */
-        if (bitsleft > 16) inpos -= 2; /* and align the bitstream! */
-        R0 = inpos[0]|(inpos[1]<<8)|(inpos[2]<<16)|(inpos[3]<<24);inpos+=4;
-        R1 = inpos[0]|(inpos[1]<<8)|(inpos[2]<<16)|(inpos[3]<<24);inpos+=4;
-        R2 = inpos[0]|(inpos[1]<<8)|(inpos[2]<<16)|(inpos[3]<<24);inpos+=4;
+        /* and align the bitstream: the whole words in the buffer haven't
+         * been used, except for a whole word of padding */
+        inpos -= (bitsleft >> 4) << 1;
+        if (!(bitsleft & 15)) inpos += 2;
+        if (inpos + 12 > endinp) return DECR_ILLEGALDATA;
+        R0 = inpos[0]|(inpos[1]<<8)|(inpos[2]<<16)|((cab_ULONG)inpos[3]<<24);inpos+=4;
+        R1 = inpos[0]|(inpos[1]<<8)|(inpos[2]<<16)|((cab_ULONG)inpos[3]<<24);inpos+=4;
+        R2 = inpos[0]|(inpos[1]<<8)|(inpos[2]<<16)|((cab_ULONG)inpos[3]<<24);inpos+=4;
+        INIT_BITSTREAM;
         break;
 
       default:
@@ -1684,15 +1277,11 @@ static int LZXfdi_decomp(int inlen, int outlen, fdi_decomp_state *decomp_state)
 
     /* buffer exhaustion check */
     if (inpos > endinp) {
-      /* it's possible to have a file where the next run is less than
-       * 16 bits in size. In this case, the READ_HUFFSYM() macro used
-       * in building the tables will exhaust the buffer, so we should
-       * allow for this, but not allow those accidentally read bits to
-       * be used (so we check that there are at least 16 bits
-       * remaining - in this boundary case they aren't really part of
-       * the compressed data)
+      /* the words read past the end of the input are zeroes, which the
+       * tables may have peeked at (the last codes can be shorter than
+       * 16 bits) but must not have used
        */
-      if (inpos > (endinp+2) || bitsleft < 16) return DECR_ILLEGALDATA;
+      if ((cab_ULONG)(inpos - endinp) * 8 > (cab_ULONG)bitsleft) return DECR_ILLEGALDATA;
     }
 
     while ((this_run = LZX(block_remaining)) > 0 && togo > 0) {
@@ -1709,170 +1298,100 @@ static int LZXfdi_decomp(int inlen, int outlen, fdi_decomp_state *decomp_state)
       switch (LZX(block_type)) {
 
       case LZX_BLOCKTYPE_VERBATIM:
+      case LZX_BLOCKTYPE_ALIGNED:
         while (this_run > 0) {
-          READ_HUFFSYM(MAINTREE, main_element);
+          DECODE_HUFFSYM(MAINTREE);
+
+          if (ENTRY_LEN2(i) && this_run >= 2) {
+            /* two literals */
+            window[window_posn++] = ENTRY_SYM(i);
+            window[window_posn++] = ENTRY_SYM2(i);
+            REMOVE_BITS(ENTRY_LEN2(i));
+            this_run -= 2;
+            continue;
+          }
+          REMOVE_BITS(ENTRY_LEN(i));
+          main_element = ENTRY_SYM(i);
 
           if (main_element < LZX_NUM_CHARS) {
             /* literal: 0 to LZX_NUM_CHARS-1 */
             window[window_posn++] = main_element;
             this_run--;
+            continue;
           }
-          else {
-            /* match: LZX_NUM_CHARS + ((slot<<3) | length_header (3 bits)) */
-            main_element -= LZX_NUM_CHARS;
-  
-            match_length = main_element & LZX_NUM_PRIMARY_LENGTHS;
-            if (match_length == LZX_NUM_PRIMARY_LENGTHS) {
-              READ_HUFFSYM(LENGTH, length_footer);
-              match_length += length_footer;
-            }
-            match_length += LZX_MIN_MATCH;
-  
-            match_offset = main_element >> 3;
-  
-            if (match_offset > 2) {
-              /* not repeated offset */
-              if (match_offset != 3) {
-                extra = CAB(extra_bits)[match_offset];
-                READ_BITS(verbatim_bits, extra);
-                match_offset = CAB(lzx_position_base)[match_offset] 
-                               - 2 + verbatim_bits;
-              }
-              else {
-                match_offset = 1;
-              }
-  
-              /* update repeated offset LRU queue */
-              R2 = R1; R1 = R0; R0 = match_offset;
-            }
-            else if (match_offset == 0) {
-              match_offset = R0;
-            }
-            else if (match_offset == 1) {
-              match_offset = R1;
-              R1 = R0; R0 = match_offset;
+
+          /* match: LZX_NUM_CHARS + ((slot<<3) | length_header (3 bits)) */
+          main_element -= LZX_NUM_CHARS;
+
+          match_length = main_element & LZX_NUM_PRIMARY_LENGTHS;
+          if (match_length == LZX_NUM_PRIMARY_LENGTHS) {
+            READ_HUFFSYM(LENGTH, length_footer);
+            match_length += length_footer;
+          }
+          match_length += LZX_MIN_MATCH;
+
+          match_offset = main_element >> 3;
+
+          if (match_offset > 2) {
+            /* not repeated offset */
+            extra = CAB(extra_bits)[match_offset];
+            match_offset = CAB(lzx_position_base)[match_offset] - 2;
+            if (LZX(block_type) == LZX_BLOCKTYPE_ALIGNED && extra >= 3) {
+              /* verbatim and aligned bits */
+              extra -= 3;
+              READ_BITS(verbatim_bits, extra);
+              match_offset += (verbatim_bits << 3);
+              READ_HUFFSYM(ALIGNED, aligned_bits);
+              match_offset += aligned_bits;
             }
-            else /* match_offset == 2 */ {
-              match_offset = R2;
-              R2 = R0; R0 = match_offset;
+            else if (extra > 0) {
+              /* verbatim bits only */
+              READ_BITS(verbatim_bits, extra);
+              match_offset += verbatim_bits;
             }
-
-            rundest = window + window_posn;
-            this_run -= match_length;
-
-            /* copy any wrapped around source data */
-            if (window_posn >= match_offset) {
-              /* no wrap */
-              runsrc = rundest - match_offset;
-            } else {
-              runsrc = rundest + (window_size - match_offset);
-              copy_length = match_offset - window_posn;
-              if (copy_length < match_length) {
-                match_length -= copy_length;
-                window_posn += copy_length;
-                while (copy_length-- > 0) *rundest++ = *runsrc++;
-                runsrc = window;
-              }
+            else /* extra == 0 */ {
+              match_offset = 1;
             }
-            window_posn += match_length;
 
-            /* copy match data - no worries about destination wraps */
-            while (match_length-- > 0) *rundest++ = *runsrc++;
+            /* update repeated offset LRU queue */
+            R2 = R1; R1 = R0; R0 = match_offset;
           }
-        }
-        break;
-
-      case LZX_BLOCKTYPE_ALIGNED:
-        while (this_run > 0) {
-          READ_HUFFSYM(MAINTREE, main_element);
-
-          if (window_posn == 0x22eb5)
-          {
-            int n = 0;
+          else if (match_offset == 0) {
+            match_offset = R0;
           }
-  
-          if (main_element < LZX_NUM_CHARS) {
-            /* literal: 0 to LZX_NUM_CHARS-1 */
-            window[window_posn++] = main_element;
-            this_run--;
+          else if (match_offset == 1) {
+            match_offset = R1;
+            R1 = R0; R0 = match_offset;
+          }
+          else /* match_offset == 2 */ {
+            match_offset = R2;
+            R2 = R0; R0 = match_offset;
           }
-          else {
-            /* match: LZX_NUM_CHARS + ((slot<<3) | length_header (3 bits)) */
-            main_element -= LZX_NUM_CHARS;
-  
-            match_length = main_element & LZX_NUM_PRIMARY_LENGTHS;
-            if (match_length == LZX_NUM_PRIMARY_LENGTHS) {
-              READ_HUFFSYM(LENGTH, length_footer);
-              match_length += length_footer;
-            }
-            match_length += LZX_MIN_MATCH;
-  
-            match_offset = main_element >> 3;
-  
-            if (match_offset > 2) {
-              /* not repeated offset */
-              extra = CAB(extra_bits)[match_offset];
-              match_offset = CAB(lzx_position_base)[match_offset] - 2;
-              if (extra > 3) {
-                /* verbatim and aligned bits */
-                extra -= 3;
-                READ_BITS(verbatim_bits, extra);
-                match_offset += (verbatim_bits << 3);
-                READ_HUFFSYM(ALIGNED, aligned_bits);
-                match_offset += aligned_bits;
-              }
-              else if (extra == 3) {
-                /* aligned bits only */
-                READ_HUFFSYM(ALIGNED, aligned_bits);
-                match_offset += aligned_bits;
-              }
-              else if (extra > 0) { /* extra==1, extra==2 */
-                /* verbatim bits only */
-                READ_BITS(verbatim_bits, extra);
-                match_offset += verbatim_bits;
-              }
-              else /* extra == 0 */ {
-                /* ??? */
-                match_offset = 1;
-              }
-  
-              /* update repeated offset LRU queue */
-              R2 = R1; R1 = R0; R0 = match_offset;
-            }
-            else if (match_offset == 0) {
-              match_offset = R0;
-            }
-            else if (match_offset == 1) {
-              match_offset = R1;
-              R1 = R0; R0 = match_offset;
-            }
-            else /* match_offset == 2 */ {
-              match_offset = R2;
-              R2 = R0; R0 = match_offset;
-            }
 
-            rundest = window + window_posn;
-            this_run -= match_length;
-
-            /* copy any wrapped around source data */
-            if (window_posn >= match_offset) {
-              /* no wrap */
-              runsrc = rundest - match_offset;
-            } else {
-              runsrc = rundest + (window_size - match_offset);
-              copy_length = match_offset - window_posn;
-              if (copy_length < match_length) {
-                match_length -= copy_length;
-                window_posn += copy_length;
-                while (copy_length-- > 0) *rundest++ = *runsrc++;
-                runsrc = window;
-              }
+          /* matches can't run past the end of the run (and the window) */
+          if ((this_run -= match_length) < 0) return DECR_ILLEGALDATA;
+          rundest = window + window_posn;
+
+          /* copy any wrapped around source data */
+          if (window_posn >= match_offset) {
+            /* no wrap */
+            runsrc = rundest - match_offset;
+          } else {
+            if (match_offset > window_size) return DECR_ILLEGALDATA;
+            runsrc = rundest + (window_size - match_offset);
+            copy_length = match_offset - window_posn;
+            if (copy_length < match_length) {
+              match_length -= copy_length;
+              window_posn += copy_length;
+              lzx_copy_match(rundest, runsrc, copy_length);
+              rundest += copy_length;
+              runsrc = window;
             }
-            window_posn += match_length;
-
-            /* copy match data - no worries about destination wraps */
-            while (match_length-- > 0) *rundest++ = *runsrc++;
           }
+          window_posn += match_length;
+
+          /* copy match data - no worries about destination wraps */
+          lzx_copy_match(rundest, runsrc, match_length);
         }
         break;
 
@@ -1890,6 +1409,8 @@ static int LZXfdi_decomp(int inlen, int outlen, fdi_decomp_state *decomp_state)
   }
 
   if (togo != 0) return DECR_ILLEGALDATA;
+  if (inpos > endinp && (cab_ULONG)(inpos - endinp) * 8 > (cab_ULONG)bitsleft)
+    return DECR_ILLEGALDATA;
   memcpy(CAB(outbuf), window + ((!window_posn) ? window_size : window_posn) -
     outlen, (size_t) outlen);
 
@@ -1900,36 +1421,717 @@ static int LZXfdi_decomp(int inlen, int outlen, fdi_decomp_state *decomp_state)
 
   /* intel E8 decoding */
   if ((LZX(frames_read)++ < 32768) && LZX(intel_filesize) != 0) {
-    if (outlen <= 6 || !LZX(intel_started)) {
-      LZX(intel_curpos) += outlen;
-    }
-    else {
-      cab_UBYTE *data    = CAB(outbuf);
-      cab_UBYTE *dataend = data + outlen - 10;
-      cab_LONG curpos    = LZX(intel_curpos);
-      cab_LONG filesize  = LZX(intel_filesize);
-      cab_LONG abs_off, rel_off;
-
-      LZX(intel_curpos) = curpos + outlen;
-
-      while (data < dataend) {
-        if (*data++ != 0xE8) { curpos++; continue; }
-        abs_off = data[0] | (data[1]<<8) | (data[2]<<16) | (data[3]<<24);
-        if ((abs_off >= -curpos) && (abs_off < filesize)) {
-          rel_off = (abs_off >= 0) ? abs_off - curpos : abs_off + filesize;
-          data[0] = (cab_UBYTE) rel_off;
-          data[1] = (cab_UBYTE) (rel_off >> 8);
-          data[2] = (cab_UBYTE) (rel_off >> 16);
-          data[3] = (cab_UBYTE) (rel_off >> 24);
-        }
-        data += 4;
-        curpos += 5;
-      }
+    if (outlen > 6 && LZX(intel_started)) {
+      liblzx_e8_postprocess(CAB(outbuf), outlen, LZX(intel_curpos),
+                            LZX(intel_filesize));
     }
+    LZX(intel_curpos) += outlen;
   }
   return DECR_OK;
 }
 
+static void free_decompression_temps(FDI_Int *fdi, const struct fdi_folder *fol,
+  fdi_decomp_state *decomp_state)
+{
+  switch (fol->comp_type & cffoldCOMPTYPE_MASK) {
+  case cffoldCOMPTYPE_MSZIP:
+    inflateEnd(&ZIP(stream));
+    break;
+  case cffoldCOMPTYPE_LZX:
+    if (LZX(window)) {
+      fdi->free(LZX(window));
+      LZX(window) = NULL;
+    }
+    break;
+  case cffoldCOMPTYPE_QUANTUM:
+    if (QTM(window)) {
+      fdi->free(QTM(window));
+      QTM(window) = NULL;
+    }
+    break;
+  }
+  /* the states of the decompressors overlap */
+  memset(&decomp_state->methods, 0, sizeof(decomp_state->methods));
+}
+
+/* snapshot of the LZX decoder at a data block boundary of a folder, from which
+ * the decoding can resume instead of starting over at the folder data */
+struct lzx_checkpoint
+{
+    struct list     entry;
+    cab_ULONG       position;    /* uncompressed offset in the folder */
+    cab_ULONG       cab_offset;  /* offset of the next data block in the cabinet */
+    cab_UBYTE       cfdata[cfdata_SIZEOF]; /* header of that block, to check it's unchanged */
+    struct LZXstate state;       /* the window pointer isn't used */
+    cab_UBYTE       window[1];   /* state.window_size bytes */
+};
+
+/* checkpoints of an LZX folder, recorded while it is decoded.  They are kept
+ * by the HFDI, so that extracting single files with further FDICopy calls
+ * doesn't have to decode all the data before them. */
+struct folder_checkpoints
+{
+    struct list entry;
+    char       *cabinet;         /* full path of the cabinet */
+    USHORT      setID;
+    USHORT      iCabinet;
+    cab_ULONG   cabsize;
+    cab_off_t   offset;          /* offset of the folder data */
+    cab_UWORD   comp_type;
+    cab_UWORD   num_blocks;
+    cab_ULONG   interval;        /* uncompressed size between two checkpoints */
+    struct list list;            /* checkpoints, by position */
+};
+
+/* total size of the checkpoints kept by an HFDI */
+#ifndef FDI_CHECKPOINT_MEMORY_LIMIT
+#define FDI_CHECKPOINT_MEMORY_LIMIT (64 * 1024 * 1024)
+#endif
+
+/* uncompressed size between two checkpoints, in windows */
+#define CHECKPOINT_INTERVAL 8
+
+static cab_ULONG get_checkpoint_size( const struct folder_checkpoints *checkpoints )
+{
+    return FIELD_OFFSET( struct lzx_checkpoint, window ) + (1 << ((checkpoints->comp_type >> 8) & 0x1f));
+}
+
+/* the checkpoints of an LZX folder, created if it hasn't been decoded yet */
+static struct folder_checkpoints *get_folder_checkpoints( fdi_decomp_state *decomp_state,
+                                                          const struct fdi_folder *fol, const char *cabpath )
+{
+    FDI_Int *fdi = CAB(fdi);
+    struct folder_checkpoints *checkpoints;
+    int window = (fol->comp_type >> 8) & 0x1f;
+
+    if ((fol->comp_type & cffoldCOMPTYPE_MASK) != cffoldCOMPTYPE_LZX || window < 15 || window > 21)
+        return NULL;
+
+    LIST_FOR_EACH_ENTRY( checkpoints, &fdi->checkpoints_list, struct folder_checkpoints, entry )
+    {
+        if (checkpoints->setID == CAB(setID) && checkpoints->iCabinet == CAB(iCabinet) &&
+            checkpoints->cabsize == CAB(cabsize) && checkpoints->offset == fol->offset &&
+            checkpoints->comp_type == fol->comp_type && checkpoints->num_blocks == fol->num_blocks &&
+            !strcmp( checkpoints->cabinet, cabpath ))
+            return checkpoints;
+    }
+
+    if (!(checkpoints = fdi->alloc( sizeof(*checkpoints) ))) return NULL;
+    if (!(checkpoints->cabinet = fdi->alloc( strlen( cabpath ) + 1 )))
+    {
+        fdi->free( checkpoints );
+        return NULL;
+    }
+    strcpy( checkpoints->cabinet, cabpath );
+    checkpoints->setID      = CAB(setID);
+    checkpoints->iCabinet   = CAB(iCabinet);
+    checkpoints->cabsize    = CAB(cabsize);
+    checkpoints->offset     = fol->offset;
+    checkpoints->comp_type  = fol->comp_type;
+    checkpoints->num_blocks = fol->num_blocks;
+    checkpoints->interval   = CHECKPOINT_INTERVAL << window;
+    list_init( &checkpoints->list );
+    list_add_tail( &fdi->checkpoints_list, &checkpoints->entry );
+    return checkpoints;
+}
+
+static struct lzx_checkpoint *alloc_checkpoint( FDI_Int *fdi, const struct folder_checkpoints *checkpoints )
+{
+    struct lzx_checkpoint *cp;
+    cab_ULONG size = get_checkpoint_size( checkpoints );
+
+    if (fdi->checkpoint_memory + size > FDI_CHECKPOINT_MEMORY_LIMIT) return NULL;
+    if (!(cp = fdi->alloc( size ))) return NULL;
+    fdi->checkpoint_memory += size;
+    return cp;
+}
+
+static void free_checkpoint( FDI_Int *fdi, const struct folder_checkpoints *checkpoints,
+                             struct lzx_checkpoint *cp )
+{
+    fdi->checkpoint_memory -= get_checkpoint_size( checkpoints );
+    fdi->free( cp );
+}
+
+/* free the checkpoints of a folder, the folder entry is kept */
+static void drop_checkpoints( FDI_Int *fdi, struct folder_checkpoints *checkpoints )
+{
+    struct lzx_checkpoint *cp, *cp_next;
+
+    LIST_FOR_EACH_ENTRY_SAFE( cp, cp_next, &checkpoints->list, struct lzx_checkpoint, entry )
+    {
+        list_remove( &cp->entry );
+        free_checkpoint( fdi, checkpoints, cp );
+    }
+}
+
+/* free all the checkpoints, in FDIDestroy */
+static void free_checkpoints( FDI_Int *fdi )
+{
+    struct folder_checkpoints *checkpoints, *checkpoints_next;
+
+    LIST_FOR_EACH_ENTRY_SAFE( checkpoints, checkpoints_next, &fdi->checkpoints_list,
+                              struct folder_checkpoints, entry )
+    {
+        drop_checkpoints( fdi, checkpoints );
+        list_remove( &checkpoints->entry );
+        fdi->free( checkpoints->cabinet );
+        fdi->free( checkpoints );
+    }
+}
+
+static BOOL has_checkpoint( const struct folder_checkpoints *checkpoints, cab_ULONG position )
+{
+    const struct lzx_checkpoint *cp;
+
+    LIST_FOR_EACH_ENTRY( cp, &checkpoints->list, struct lzx_checkpoint, entry )
+        if (cp->position >= position) return cp->position == position;
+    return FALSE;
+}
+
+/* insert a checkpoint by position, FALSE if there is already one at the same position */
+static BOOL add_checkpoint( struct folder_checkpoints *checkpoints, struct lzx_checkpoint *new_cp )
+{
+    struct lzx_checkpoint *cp;
+
+    LIST_FOR_EACH_ENTRY( cp, &checkpoints->list, struct lzx_checkpoint, entry )
+    {
+        if (cp->position == new_cp->position) return FALSE;
+        if (cp->position > new_cp->position)
+        {
+            list_add_before( &cp->entry, &new_cp->entry );
+            return TRUE;
+        }
+    }
+    list_add_tail( &checkpoints->list, &new_cp->entry );
+    return TRUE;
+}
+
+/* the last checkpoint in the (start, end] range of positions, if any */
+static const struct lzx_checkpoint *find_checkpoint( const struct folder_checkpoints *checkpoints,
+                                                     cab_ULONG start, cab_ULONG end )
+{
+    const struct lzx_checkpoint *cp, *found = NULL;
+
+    LIST_FOR_EACH_ENTRY( cp, &checkpoints->list, struct lzx_checkpoint, entry )
+    {
+        if (cp->position > end) break;
+        if (cp->position > start) found = cp;
+    }
+    return found;
+}
+
+/* read the header of the data block at offset in the cabinet */
+static BOOL read_cfdata_header( FDI_Int *fdi, INT_PTR hf, cab_ULONG offset, cab_UBYTE *buf )
+{
+    return fdi->seek( hf, offset, SEEK_SET ) != -1 &&
+           fdi->read( hf, buf, cfdata_SIZEOF ) == cfdata_SIZEOF;
+}
+
+/* whether the cabinet still has the data block header recorded with a
+ * checkpoint, it may have been rewritten since an earlier FDICopy.  The
+ * position of the cabinet handle is kept. */
+static BOOL check_checkpoint( fdi_decomp_state *decomp_state, const struct lzx_checkpoint *cp )
+{
+    cab_UBYTE buf[cfdata_SIZEOF];
+    LONG offset;
+    BOOL ret;
+
+    if ((offset = FDI_getoffset( CAB(fdi), CAB(cabhf) )) == -1) return FALSE;
+    ret = read_cfdata_header( CAB(fdi), CAB(cabhf), cp->cab_offset, buf ) &&
+          !memcmp( buf, cp->cfdata, cfdata_SIZEOF );
+    if (CAB(fdi)->seek( CAB(cabhf), offset, SEEK_SET ) == -1) return FALSE;
+    return ret;
+}
+
+/* snapshot the LZX decoder after the data block ending at position */
+static void save_checkpoint( fdi_decomp_state *decomp_state, struct lzx_checkpoint *cp,
+                             cab_ULONG position, cab_ULONG cab_offset )
+{
+    cp->position   = position;
+    cp->cab_offset = cab_offset;
+    cp->state      = decomp_state->methods.lzx;
+    memcpy( cp->window, LZX(window), LZX(window_size) );
+}
+
+/* resume the decoding of the current folder at a checkpoint, the LZX
+ * decompressor has to be initialized for the folder */
+static int restore_checkpoint( fdi_decomp_state *decomp_state, const struct lzx_checkpoint *cp )
+{
+    cab_UBYTE *window = LZX(window);
+    cab_ULONG actual_size = LZX(actual_size);
+
+    if (CAB(fdi)->seek( CAB(cabhf), cp->cab_offset, SEEK_SET ) == -1) return DECR_INPUT;
+
+    decomp_state->methods.lzx = cp->state;
+    LZX(window) = window;
+    LZX(actual_size) = actual_size;
+    memcpy( window, cp->window, LZX(window_size) );
+
+    CAB(decomp_cab) = NULL;
+    CAB(offset) = CAB(decoded) = cp->position;
+    CAB(outlen) = 0;
+    return DECR_OK;
+}
+
+/* record a checkpoint of the current folder at the end of the data block just decoded */
+static void record_checkpoint( fdi_decomp_state *decomp_state )
+{
+    struct lzx_checkpoint *cp;
+    LONG cab_offset;
+
+    if (has_checkpoint( CAB(checkpoints), CAB(decoded) )) return;
+    if ((cab_offset = FDI_getoffset( CAB(fdi), CAB(cabhf) )) == -1) return;
+    if (!(cp = alloc_checkpoint( CAB(fdi), CAB(checkpoints) ))) return;
+    save_checkpoint( decomp_state, cp, CAB(decoded), cab_offset );
+    /* the next block is read from cab_offset, there is none at the end of the cabinet */
+    if (read_cfdata_header( CAB(fdi), CAB(cabhf), cab_offset, cp->cfdata ))
+        add_checkpoint( CAB(checkpoints), cp );
+    else
+        free_checkpoint( CAB(fdi), CAB(checkpoints), cp );
+    CAB(fdi)->seek( CAB(cabhf), cab_offset, SEEK_SET );
+}
+
+/* data block buffer handed to a decoding job */
+struct job_block
+{
+    struct list entry;
+    cab_UWORD   inlen;                   /* compressed size */
+    cab_UWORD   outlen;                  /* uncompressed size */
+    cab_ULONG   position;                /* uncompressed offset in the folder of the end of the block */
+    cab_ULONG   cab_offset;              /* offset of the next block in the cabinet */
+    cab_UBYTE   data[CAB_INPUTMAX + 2];  /* compressed data on input, decoded data on output */
+};
+
+/* decoding of the data of one folder on a thread pool worker, ahead of the
+ * extraction of its files.  The calling thread reads the data blocks with the
+ * cabinet handle of the job, and takes the decoded blocks in folder order, so
+ * the callbacks are only called from the calling thread.  The worker records
+ * the checkpoints of LZX folders in the spare buffers provided by the calling
+ * thread.  Blocks in in_list and out_list, the spare checkpoint, the recorded
+ * list, and the running and err fields are protected by the FDI jobs_lock. */
+struct folder_job
+{
+    struct list        entry;
+    FDI_Int           *fdi;
+    struct fdi_folder *folder;
+    unsigned int       index;          /* index of the folder in the cabinet */
+    fdi_decomp_state  *decomp_state;
+    INT_PTR            cabhf;
+    PTP_WORK           work;
+    struct list        in_list;        /* blocks waiting to be decoded */
+    struct list        out_list;       /* decoded blocks, in folder order */
+    struct job_block  *current;        /* decoded block being extracted */
+    unsigned int       queued;         /* number of blocks read and not extracted yet */
+    ULONGLONG          size_read;      /* uncompressed size of the blocks read */
+    ULONGLONG          size_needed;    /* uncompressed size of the folder used by its files */
+    cab_ULONG          cab_offset;     /* offset of the next block in the cabinet */
+    struct folder_checkpoints *checkpoints; /* LZX only */
+    struct lzx_checkpoint *spare;      /* buffer for the next checkpoint */
+    struct list        recorded;       /* checkpoints not added to the folder yet */
+    int                read_err;       /* error reading the blocks, stops the reads */
+    int                err;            /* error decoding the blocks, stops the worker */
+    BOOL               running;
+};
+
+/* maximum number of blocks read ahead for a job, enough to keep the worker
+ * busy while the calling thread writes out the files of another folder */
+#define JOB_QUEUE_MAX 32
+
+/* decode the queued blocks of a job, on a thread pool worker */
+static void decode_job_blocks( struct folder_job *job )
+{
+    FDI_Int *fdi = job->fdi;
+    fdi_decomp_state *decomp_state = job->decomp_state;
+    struct job_block *block;
+    struct lzx_checkpoint *cp;
+    int err;
+
+    AcquireSRWLockExclusive( &fdi->jobs_lock );
+    while (!job->err && !list_empty( &job->in_list ))
+    {
+        block = LIST_ENTRY( job->in_list.next, struct job_block, entry );
+        list_remove( &block->entry );
+        /* the spare buffer stays with the job until the checkpoint is complete */
+        cp = NULL;
+        if (job->spare && !(block->position % job->checkpoints->interval)) cp = job->spare;
+        ReleaseSRWLockExclusive( &fdi->jobs_lock );
+
+        /* the two bytes after the data are cleared by read_job_block */
+        memcpy( CAB(inbuf), block->data, block->inlen + 2 );
+        err = CAB(decompress)( block->inlen, block->outlen, decomp_state );
+        if (!err) memcpy( block->data, CAB(outbuf), block->outlen );
+        if (!err && cp) save_checkpoint( decomp_state, cp, block->position, block->cab_offset );
+
+        AcquireSRWLockExclusive( &fdi->jobs_lock );
+        if (err)
+        {
+            /* keep the block with the job, it is released by free_job */
+            list_add_tail( &job->in_list, &block->entry );
+            job->err = err;
+        }
+        else
+        {
+            list_add_tail( &job->out_list, &block->entry );
+            if (cp)
+            {
+                list_add_tail( &job->recorded, &cp->entry );
+                job->spare = NULL;
+            }
+        }
+        WakeAllConditionVariable( &fdi->jobs_cond );
+    }
+    job->running = FALSE;
+    WakeAllConditionVariable( &fdi->jobs_cond );
+    ReleaseSRWLockExclusive( &fdi->jobs_lock );
+}
+
+static void CALLBACK job_work_callback( PTP_CALLBACK_INSTANCE instance, void *context, PTP_WORK work )
+{
+    decode_job_blocks( context );
+}
+
+static void release_job_blocks( FDI_Int *fdi, struct list *blocks )
+{
+    struct job_block *block, *block_next;
+
+    LIST_FOR_EACH_ENTRY_SAFE( block, block_next, blocks, struct job_block, entry )
+    {
+        list_remove( &block->entry );
+        list_add_tail( &fdi->free_blocks, &block->entry );
+    }
+}
+
+/* add the checkpoints recorded by a job to its folder, and give it a buffer for
+ * the next one if the folder is long enough.  The headers of the blocks after
+ * the checkpoints are read here, the cabinet handle of the job is only used by
+ * the calling thread. */
+static void collect_checkpoints( FDI_Int *fdi, struct folder_job *job, BOOL spare )
+{
+    struct lzx_checkpoint *cp, *cp_next;
+    struct list recorded;
+
+    if (!job->checkpoints) return;
+
+    list_init( &recorded );
+    AcquireSRWLockExclusive( &fdi->jobs_lock );
+    LIST_FOR_EACH_ENTRY_SAFE( cp, cp_next, &job->recorded, struct lzx_checkpoint, entry )
+    {
+        list_remove( &cp->entry );
+        list_add_tail( &recorded, &cp->entry );
+    }
+    if (job->spare) spare = FALSE;
+    ReleaseSRWLockExclusive( &fdi->jobs_lock );
+
+    if (!list_empty( &recorded ))
+    {
+        LIST_FOR_EACH_ENTRY_SAFE( cp, cp_next, &recorded, struct lzx_checkpoint, entry )
+        {
+            list_remove( &cp->entry );
+            if (!read_cfdata_header( fdi, job->cabhf, cp->cab_offset, cp->cfdata ) ||
+                !add_checkpoint( job->checkpoints, cp ))
+                free_checkpoint( fdi, job->checkpoints, cp );
+        }
+        if (fdi->seek( job->cabhf, job->cab_offset, SEEK_SET ) == -1 && !job->read_err)
+            job->read_err = DECR_INPUT;
+    }
+
+    if (spare && job->size_needed > job->checkpoints->interval &&
+        (cp = alloc_checkpoint( fdi, job->checkpoints )))
+    {
+        AcquireSRWLockExclusive( &fdi->jobs_lock );
+        job->spare = cp;
+        ReleaseSRWLockExclusive( &fdi->jobs_lock );
+    }
+}
+
+static void free_job( FDI_Int *fdi, struct folder_job *job )
+{
+    /* stop the worker after the block it is decoding */
+    AcquireSRWLockExclusive( &fdi->jobs_lock );
+    if (!job->err) job->err = DECR_USERABORT;
+    ReleaseSRWLockExclusive( &fdi->jobs_lock );
+    WaitForThreadpoolWorkCallbacks( job->work, FALSE );
+    CloseThreadpoolWork( job->work );
+
+    collect_checkpoints( fdi, job, FALSE );
+    if (job->spare) free_checkpoint( fdi, job->checkpoints, job->spare );
+
+    release_job_blocks( fdi, &job->in_list );
+    release_job_blocks( fdi, &job->out_list );
+    if (job->current) list_add_tail( &fdi->free_blocks, &job->current->entry );
+    fdi->close( job->cabhf );
+    free_decompression_temps( fdi, job->folder, job->decomp_state );
+    fdi->free( job->decomp_state );
+    list_remove( &job->entry );
+    fdi->job_count--;
+    fdi->free( job );
+}
+
+/* free all the jobs and the block buffers, at the end of FDICopy */
+static void free_jobs( FDI_Int *fdi )
+{
+    struct folder_job *job, *job_next;
+    struct job_block *block, *block_next;
+
+    LIST_FOR_EACH_ENTRY_SAFE( job, job_next, &fdi->jobs_list, struct folder_job, entry )
+        free_job( fdi, job );
+    LIST_FOR_EACH_ENTRY_SAFE( block, block_next, &fdi->free_blocks, struct job_block, entry )
+    {
+        list_remove( &block->entry );
+        fdi->free( block );
+    }
+    fdi->job_folder = NULL;
+}
+
+/* read the next data block of the folder of a job, with the same checks as fdi_decomp */
+static int read_job_block( struct folder_job *job, struct job_block *block )
+{
+    FDI_Int *fdi = job->fdi;
+    cab_UBYTE buf[cfdata_SIZEOF];
+    cab_ULONG cksum;
+
+    if (fdi->read( job->cabhf, buf, cfdata_SIZEOF ) != cfdata_SIZEOF) return DECR_INPUT;
+    if (fdi->seek( job->cabhf, job->decomp_state->mii.block_resv, SEEK_CUR ) == -1) return DECR_INPUT;
+
+    block->inlen  = EndGetI16( buf + cfdata_CompressedSize );
+    block->outlen = EndGetI16( buf + cfdata_UncompressedSize );
+    /* jobs are only used for cabinets without a next one, so there is no split block */
+    if (block->inlen > CAB_INPUTMAX || !block->outlen) return DECR_INPUT;
+    if (block->outlen > CAB_BLOCKMAX) return DECR_DATAFORMAT;
+    if (fdi->read( job->cabhf, block->data, block->inlen ) != block->inlen) return DECR_INPUT;
+    block->data[block->inlen] = block->data[block->inlen + 1] = 0;
+
+    cksum = EndGetI32( buf + cfdata_CheckSum );
+    if (cksum && cksum != cab_checksum( buf + 4, 4, cab_checksum( block->data, block->inlen, 0 ) ))
+        return DECR_CHECKSUM;
+    return DECR_OK;
+}
+
+/* read the blocks of a job until its queue is full */
+static void fill_job_queue( FDI_Int *fdi, struct folder_job *job )
+{
+    struct job_block *block;
+
+    while (!job->read_err && job->queued < JOB_QUEUE_MAX && job->size_read < job->size_needed)
+    {
+        if (!list_empty( &fdi->free_blocks ))
+        {
+            block = LIST_ENTRY( fdi->free_blocks.next, struct job_block, entry );
+            list_remove( &block->entry );
+        }
+        else if (!(block = fdi->alloc( sizeof(*block) )))
+        {
+            job->read_err = DECR_NOMEMORY;
+            break;
+        }
+
+        if ((job->read_err = read_job_block( job, block )))
+        {
+            list_add_tail( &fdi->free_blocks, &block->entry );
+            break;
+        }
+        job->queued++;
+        job->size_read += block->outlen;
+        job->cab_offset += cfdata_SIZEOF + job->decomp_state->mii.block_resv + block->inlen;
+        block->position = job->size_read;
+        block->cab_offset = job->cab_offset;
+
+        AcquireSRWLockExclusive( &fdi->jobs_lock );
+        list_add_tail( &job->in_list, &block->entry );
+        if (!job->running)
+        {
+            job->running = TRUE;
+            SubmitThreadpoolWork( job->work );
+        }
+        ReleaseSRWLockExclusive( &fdi->jobs_lock );
+    }
+}
+
+/* uncompressed size of a folder that is covered by its files */
+static ULONGLONG get_folder_size_needed( const fdi_decomp_state *decomp_state, unsigned int index )
+{
+    const struct fdi_file *file;
+    ULONGLONG size = 0;
+
+    for (file = CAB(firstfile); file; file = file->next)
+        if (file->index == index)
+            size = max( size, (ULONGLONG)file->offset + file->length );
+    return size;
+}
+
+static struct folder_job *create_job( fdi_decomp_state *decomp_state, struct fdi_folder *fol,
+                                      unsigned int index, const char *cabpath )
+{
+    FDI_Int *fdi = CAB(fdi);
+    struct folder_job *job;
+    fdi_decomp_state *job_state;
+    cab_UWORD comptype = fol->comp_type;
+    int err;
+
+    if (!(job = fdi->alloc( sizeof(*job) ))) return NULL;
+    memset( job, 0, sizeof(*job) );
+    job->fdi = fdi;
+    job->folder = fol;
+    job->index = index;
+    list_init( &job->in_list );
+    list_init( &job->out_list );
+    list_init( &job->recorded );
+    job->cab_offset = fol->offset;
+    if (!(job->size_needed = get_folder_size_needed( decomp_state, index ))) goto failed;
+
+    if (!(job_state = fdi->alloc( sizeof(*job_state) ))) goto failed;
+    ZeroMemory( job_state, sizeof(*job_state) );
+    job_state->fdi = fdi;
+    job_state->mii.block_resv = CAB(mii).block_resv;
+    job->decomp_state = job_state;
+
+    switch (comptype & cffoldCOMPTYPE_MASK) {
+    case cffoldCOMPTYPE_QUANTUM:
+      job_state->decompress = QTMfdi_decomp;
+      err = QTMfdi_init( (comptype >> 8) & 0x1f, (comptype >> 4) & 0xF, job_state );
+      break;
+    case cffoldCOMPTYPE_LZX:
+      job_state->decompress = LZXfdi_decomp;
+      err = LZXfdi_init( (comptype >> 8) & 0x1f, job_state );
+      break;
+    case cffoldCOMPTYPE_MSZIP:
+      job_state->decompress = ZIPfdi_decomp;
+      err = ZIPfdi_init( job_state );
+      break;
+    default:
+      err = DECR_DATAFORMAT;
+      break;
+    }
+    if (err) goto failed;
+
+    /* the folder is read with its own handle, so the reads of the jobs don't
+     * have to seek back and forth */
+    job->cabhf = fdi->open( (char *)cabpath, _O_RDONLY|_O_BINARY, _S_IREAD | _S_IWRITE );
+    if (job->cabhf == -1) goto failed;
+    if (fdi->seek( job->cabhf, fol->offset, SEEK_SET ) == -1 ||
+        !(job->work = CreateThreadpoolWork( job_work_callback, job, NULL )))
+    {
+        fdi->close( job->cabhf );
+        goto failed;
+    }
+
+    list_add_tail( &fdi->jobs_list, &job->entry );
+    fdi->job_count++;
+    job->checkpoints = get_folder_checkpoints( decomp_state, fol, cabpath );
+    collect_checkpoints( fdi, job, TRUE );
+    return job;
+
+failed:
+    if (job->decomp_state)
+    {
+        free_decompression_temps( fdi, fol, job->decomp_state );
+        fdi->free( job->decomp_state );
+    }
+    fdi->free( job );
+    return NULL;
+}
+
+/* start decoding the next folders, up to one per processor.  Folders that
+ * can't be decoded by a job are extracted by fdi_decomp as usual. */
+static void start_jobs( fdi_decomp_state *decomp_state, const char *cabpath )
+{
+    FDI_Int *fdi = CAB(fdi);
+    struct folder_job *job;
+
+    while (fdi->job_folder && fdi->job_count < fdi->max_jobs)
+    {
+        job = create_job( decomp_state, fdi->job_folder, fdi->job_index, cabpath );
+        fdi->job_folder = fdi->job_folder->next;
+        fdi->job_index++;
+        if (job) fill_job_queue( fdi, job );
+    }
+}
+
+/* the job decoding a folder, if any.  The jobs of the folders before it are
+ * freed, the files of those folders have been skipped. */
+static struct folder_job *get_folder_job( fdi_decomp_state *decomp_state, const struct fdi_folder *fol,
+                                          const char *cabpath )
+{
+    FDI_Int *fdi = CAB(fdi);
+    struct folder_job *job, *job_next;
+    struct fdi_folder *next;
+    unsigned int index = 0;
+
+    if (!fdi->job_folder && list_empty( &fdi->jobs_list )) return NULL;
+
+    for (next = CAB(firstfol); next != fol; next = next->next) index++;
+
+    LIST_FOR_EACH_ENTRY_SAFE( job, job_next, &fdi->jobs_list, struct folder_job, entry )
+        if (job->index < index) free_job( fdi, job );
+
+    /* don't start jobs for the skipped folders */
+    if (fdi->job_folder && fdi->job_index < index)
+    {
+        fdi->job_folder = (struct fdi_folder *)fol;
+        fdi->job_index = index;
+    }
+    start_jobs( decomp_state, cabpath );
+
+    LIST_FOR_EACH_ENTRY( job, &fdi->jobs_list, struct folder_job, entry )
+        if (job->index == index) return job;
+    return NULL;
+}
+
+/* take the next decoded block of the current folder, reading ahead the blocks
+ * of all the jobs while it is being decoded */
+static int get_job_output( fdi_decomp_state *decomp_state )
+{
+    FDI_Int *fdi = CAB(fdi);
+    struct folder_job *job = CAB(job), *other;
+    struct job_block *block = NULL;
+    int err = DECR_OK;
+
+    if (job->current)
+    {
+        list_add_tail( &fdi->free_blocks, &job->current->entry );
+        job->current = NULL;
+        job->queued--;
+    }
+
+    fill_job_queue( fdi, job );
+    LIST_FOR_EACH_ENTRY( other, &fdi->jobs_list, struct folder_job, entry )
+    {
+        if (other != job) fill_job_queue( fdi, other );
+        collect_checkpoints( fdi, other, TRUE );
+    }
+
+    AcquireSRWLockExclusive( &fdi->jobs_lock );
+    for (;;)
+    {
+        if (!list_empty( &job->out_list ))
+        {
+            block = LIST_ENTRY( job->out_list.next, struct job_block, entry );
+            list_remove( &block->entry );
+            break;
+        }
+        if (job->err)
+        {
+            err = job->err;
+            break;
+        }
+        /* all the blocks that could be read have been decoded */
+        if (!job->running)
+        {
+            err = job->read_err ? job->read_err : DECR_INPUT;
+            break;
+        }
+        SleepConditionVariableSRW( &fdi->jobs_cond, &fdi->jobs_lock, INFINITE, 0 );
+    }
+    ReleaseSRWLockExclusive( &fdi->jobs_lock );
+
+    if (err) return err;
+    job->current = block;
+    CAB(outpos) = block->data;
+    CAB(outlen) = block->outlen;
+    return DECR_OK;
+}
+
 /**********************************************************
  * fdi_decomp (internal)
  *
@@ -1969,6 +2171,13 @@ static int fdi_decomp(const struct fdi_file *fi, int savemode, fdi_decomp_state
 
     /* we only get here if we emptied the output buffer */
 
+    /* the folder is decoded ahead by a job */
+    if (CAB(job)) {
+      if ((err = get_job_output(decomp_state)))
+        return err;
+      continue;
+    }
+
     /* read data header + data */
     inlen = outlen = 0;
     while (outlen == 0) {
@@ -1992,10 +2201,11 @@ static int fdi_decomp(const struct fdi_file *fi, int savemode, fdi_decomp_state
 
       /* perform checksum test on the block (if one is stored) */
       cksum = EndGetI32(buf+cfdata_CheckSum);
-      if (cksum && cksum != checksum(buf+4, 4, checksum(data, len, 0)))
+      if (cksum && cksum != cab_checksum(buf+4, 4, cab_checksum(data, len, 0)))
         return DECR_CHECKSUM; /* checksum is wrong */
 
       outlen = EndGetI16(buf+cfdata_UncompressedSize);
+      if (outlen > CAB_BLOCKMAX) return DECR_DATAFORMAT;
 
       /* outlen=0 means this block was the last contiguous part
          of a split block, continued in the next cabinet */
@@ -2202,6 +2412,9 @@ static int fdi_decomp(const struct fdi_file *fi, int savemode, fdi_decomp_state
     /* decompress block */
     if ((err = CAB(decompress)(inlen, outlen, decomp_state)))
       return err;
+    CAB(decoded) += outlen;
+    if (CAB(checkpoints) && cab == decomp_state && !(CAB(decoded) % CAB(checkpoints)->interval))
+      record_checkpoint(decomp_state);
     CAB(outlen) = outlen;
     CAB(outpos) = CAB(outbuf);
   }
@@ -2210,25 +2423,6 @@ static int fdi_decomp(const struct fdi_file *fi, int savemode, fdi_decomp_state
   return DECR_OK;
 }
 
-static void free_decompression_temps(FDI_Int *fdi, const struct fdi_folder *fol,
-  fdi_decomp_state *decomp_state)
-{
-  switch (fol->comp_type & cffoldCOMPTYPE_MASK) {
-  case cffoldCOMPTYPE_LZX:
-    if (LZX(window)) {
-      fdi->free(LZX(window));
-      LZX(window) = NULL;
-    }
-    break;
-  case cffoldCOMPTYPE_QUANTUM:
-    if (QTM(window)) {
-      fdi->free(QTM(window));
-      QTM(window) = NULL;
-    }
-    break;
-  }
-}
-
 static void free_decompression_mem(FDI_Int *fdi, fdi_decomp_state *decomp_state)
 {
   struct fdi_folder *fol;
@@ -2444,6 +2638,8 @@ BOOL __cdecl FDICopy(
   struct fdi_folder *fol = NULL, *linkfol = NULL; 
   struct fdi_file   *file = NULL, *linkfile = NULL;
   fdi_decomp_state *decomp_state;
+  const struct lzx_checkpoint *cp;
+  BOOL standalone;
   FDI_Int *fdi = get_fdi_ptr( hfdi );
 
   TRACE("(hfdi == ^%p, pszCabinet == %s, pszCabPath == %s, flags == %x, "
@@ -2512,6 +2708,7 @@ BOOL __cdecl FDICopy(
 
   CAB(setID) = fdici.setID;
   CAB(iCabinet) = fdici.iCabinet;
+  CAB(cabsize) = fdici.cbCabinet;
   CAB(cabhf) = cabhf;
 
   /* read folders */
@@ -2576,6 +2773,21 @@ BOOL __cdecl FDICopy(
     linkfile = file;
   }
 
+  /* decode the folders ahead on the thread pool and record checkpoints of the
+   * LZX folders, unless the cabinet is part of a set: the split folders are
+   * extracted by fdi_decomp alone */
+  CAB(fdi) = fdi;
+  standalone = !CAB(mii).hasnext && !CAB(mii).prevname;
+  if (fdi->max_jobs > 1 && standalone) {
+    for (file = CAB(firstfile); (file); file = file->next)
+      if (file->index >= fdici.cFolders) break;
+    if (!file) {
+      fdi->job_folder = CAB(firstfol);
+      fdi->job_index = 0;
+      start_jobs(decomp_state, fullpath);
+    }
+  }
+
   for (file = CAB(firstfile); (file); file = file->next) {
 
     /*
@@ -2690,33 +2902,30 @@ BOOL __cdecl FDICopy(
         TRACE("Resetting folder for file %s.\n", debugstr_a(file->filename));
 
         /* free stuff for the old decompressor */
-        switch (ct2) {
-        case cffoldCOMPTYPE_LZX:
-          if (LZX(window)) {
-            fdi->free(LZX(window));
-            LZX(window) = NULL;
-          }
-          break;
-        case cffoldCOMPTYPE_QUANTUM:
-          if (QTM(window)) {
-            fdi->free(QTM(window));
-            QTM(window) = NULL;
-          }
-          break;
-        }
+        if (CAB(current)) free_decompression_temps(fdi, CAB(current), decomp_state);
 
         CAB(decomp_cab) = NULL;
         CAB(fdi)->seek(CAB(cabhf), fol->offset, SEEK_SET);
         CAB(offset) = 0;
         CAB(outlen) = 0;
+        CAB(decoded) = 0;
+        CAB(checkpoints) = standalone ? get_folder_checkpoints(decomp_state, fol, fullpath) : NULL;
 
-        /* initialize the new decompressor */
-        switch (ct1) {
+        if (CAB(job)) {
+          free_job(fdi, CAB(job));
+          CAB(job) = NULL;
+        }
+
+        /* use the job decoding the folder, or initialize the new decompressor */
+        if ((CAB(job) = get_folder_job(decomp_state, fol, fullpath)))
+          CAB(decompress) = NULL;
+        else switch (ct1) {
         case cffoldCOMPTYPE_NONE:
           CAB(decompress) = NONEfdi_decomp;
           break;
         case cffoldCOMPTYPE_MSZIP:
           CAB(decompress) = ZIPfdi_decomp;
+          err = ZIPfdi_init(decomp_state);
           break;
         case cffoldCOMPTYPE_QUANTUM:
           CAB(decompress) = QTMfdi_decomp;
@@ -2744,6 +2953,39 @@ BOOL __cdecl FDICopy(
           goto bail_and_fail;
       }
 
+      /* resume from the last checkpoint before the file, if it is further
+       * than what the job of the folder may have decoded already.  If the
+       * cabinet doesn't match the checkpoint anymore, the checkpoints of the
+       * folder are dropped and the decoding goes on from where it is. */
+      cp = NULL;
+      if (CAB(checkpoints) && file->offset > CAB(offset) &&
+          (cp = find_checkpoint(CAB(checkpoints), CAB(offset) + (CAB(job) ? JOB_QUEUE_MAX * CAB_BLOCKMAX : 0),
+                                file->offset)) &&
+          !check_checkpoint(decomp_state, cp)) {
+        WARN("cabinet changed, dropping the checkpoints of the folder\n");
+        drop_checkpoints(fdi, CAB(checkpoints));
+        cp = NULL;
+      }
+      if (cp) {
+        if (CAB(job)) {
+          free_job(fdi, CAB(job));
+          CAB(job) = NULL;
+          CAB(decompress) = LZXfdi_decomp;
+          err = LZXfdi_init((comptype >> 8) & 0x1f, decomp_state);
+        }
+        if (!err) err = restore_checkpoint(decomp_state, cp);
+        switch (err) {
+          case DECR_OK:
+            break;
+          case DECR_NOMEMORY:
+            set_error( fdi, FDIERROR_ALLOC_FAIL, ERROR_NOT_ENOUGH_MEMORY );
+            goto bail_and_fail;
+          default:
+            set_error( fdi, FDIERROR_CORRUPT_CABINET, 0 );
+            goto bail_and_fail;
+        }
+      }
+
       if (file->offset > CAB(offset)) {
         /* decode bytes and send them to /dev/null */
         switch (fdi_decomp(file, 0, decomp_state, pszCabPath, pfnfdin, pvUser)) {
@@ -2764,7 +3006,11 @@ BOOL __cdecl FDICopy(
 
       /* now do the actual decompression */
       err = fdi_decomp(file, 1, decomp_state, pszCabPath, pfnfdin, pvUser);
-      if (err) CAB(current) = NULL; else CAB(offset) += file->length;
+      if (err) {
+        free_decompression_temps(fdi, CAB(current), decomp_state);
+        CAB(current) = NULL;
+      }
+      else CAB(offset) += file->length;
 
       /* fdintCLOSE_FILE_INFO notification */
       ZeroMemory(&fdin, sizeof(FDINOTIFICATION));
@@ -2795,14 +3041,16 @@ BOOL __cdecl FDICopy(
     }
   }
 
-  if (fol) free_decompression_temps(fdi, fol, decomp_state);
+  free_jobs(fdi);
+  if (CAB(current)) free_decompression_temps(fdi, CAB(current), decomp_state);
   free_decompression_mem(fdi, decomp_state);
  
   return TRUE;
 
   bail_and_fail: /* here we free ram before error returns */
 
-  if (fol) free_decompression_temps(fdi, fol, decomp_state);
+  free_jobs(fdi);
+  if (CAB(current)) free_decompression_temps(fdi, CAB(current), decomp_state);
 
   if (filehf) fdi->close(filehf);
 
@@ -2830,6 +3078,7 @@ BOOL __cdecl FDIDestroy(HFDI hfdi)
 
     TRACE("(hfdi == ^%p)\n", hfdi);
     if (!fdi) return FALSE;
+    free_checkpoints(fdi);
     fdi->magic = 0; /* paranoia */
     fdi->free(fdi);
     return TRUE;